@@ -0,0 +1,381 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "tgaimage.h"
+#include "geometry.h"
+#include "model.h"
+#include "gl.h"
+#include "shader.h"
+#include "scene.h"
+#include "renderer.h"
+
+#ifndef BABYRASTERIZER_DATA_DIR
+#define BABYRASTERIZER_DATA_DIR "."
+#endif
+
+// micro-benchmarks of the rasterizer building blocks and end-to-end renders of the default scene, written
+// as JSON so runs can be compared over time:
+//   raster_bench [--filter substring] [--min-time seconds] [--data dir] [--out file.json]
+
+typedef std::chrono::steady_clock Clock;
+
+struct BenchResult
+{
+	std::string name;
+	unsigned long long iterations;
+	double seconds;
+	double items;                       // items processed by all the iterations
+	std::string unit;                   // what an item is
+};
+
+struct BenchOptions
+{
+	std::string filter;
+	double minTime;
+	std::string dataDir;
+	std::string outPath;
+
+	BenchOptions() : filter(), minTime(0.5), dataDir(BABYRASTERIZER_DATA_DIR), outPath() {}
+};
+
+// keeps the optimizer from dropping the results of the measured code
+static volatile float sink;
+
+// runs body once to warm up, then doubles the iteration count until the run lasts minTime;
+// body returns the number of items it processed
+static void run(const BenchOptions &options, std::vector<BenchResult> &results, const std::string &name, const std::string &unit,
+	const std::function<double()> &body)
+{
+	if (!options.filter.empty() && name.find(options.filter) == std::string::npos) return;
+	body();
+
+	BenchResult result;
+	result.name = name;
+	result.unit = unit;
+	for (unsigned long long iterations = 1; ; iterations *= 2)
+	{
+		double items = 0.0;
+		Clock::time_point start = Clock::now();
+		for (unsigned long long i = 0; i < iterations; ++i)
+		{
+			items += body();
+		}
+		double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+		result.iterations = iterations;
+		result.seconds = seconds;
+		result.items = items;
+		if (seconds >= options.minTime) break;
+	}
+	std::cerr << name << ": " << result.seconds / result.iterations * 1e3 << " ms per iteration, "
+		<< result.items / result.seconds << " " << unit << "/s" << std::endl;
+	results.push_back(result);
+}
+
+// writes a constant color, so the rasterizer is measured and not the shading
+struct FlatShader : public IShader
+{
+	Vec4f vertex(unsigned /*nthvert*/, Vec4f worldCoord, Vec2f /*uv*/, Vec3f /*normal*/, Vec4f /*tangent*/)
+	{
+		return worldCoord;
+	}
+
+	bool fragment(Vec3f bar, Vec3f &color)
+	{
+		color = bar;
+		return true;
+	}
+};
+
+static void rasterBenchmarks(const BenchOptions &options, std::vector<BenchResult> &results)
+{
+	// points around a triangle, half of them inside
+	Vec2f A(10.0f, 10.0f), B(200.0f, 30.0f), C(60.0f, 180.0f);
+	std::vector<Vec2f> points(1024);
+	srand(1);
+	for (Vec2f &p : points)
+	{
+		p = Vec2f(float(rand() % 256), float(rand() % 256));
+	}
+	run(options, results, "barycentric", "points", [&]()
+	{
+		float sum = 0.0f;
+		for (const Vec2f &p : points)
+		{
+			sum += barycentric(A, B, C, p).x;
+		}
+		sink = sum;
+		return double(points.size());
+	});
+
+	// right triangles of a few sizes in the middle of a 512 x 512 target; the depth test keeps passing
+	// since every draw has the same depth
+	const unsigned SIZE = 512;
+	const unsigned SIDES[] = { 4, 32, 256 };
+	const unsigned SAMPLES[] = { 1, 2, 4, 8, 16 };
+	std::vector<float> zBuffer(SIZE * SIZE * MAX_SAMPLE);
+	std::vector<Vec3f> colorBuffer(SIZE * SIZE * MAX_SAMPLE);
+	FlatShader shader;
+	for (unsigned cntSample : SAMPLES)
+	{
+		for (unsigned side : SIDES)
+		{
+			std::fill(zBuffer.begin(), zBuffer.end(), -std::numeric_limits<float>::max());
+			float x0 = SIZE / 2.0f - side / 2.0f + 0.3f, y0 = SIZE / 2.0f - side / 2.0f + 0.3f;
+			Vec4f screenCoords[3] = { Vec4f(x0, y0, 0.5f, 1.0f), Vec4f(x0 + side, y0, 0.5f, 1.0f), Vec4f(x0, y0 + side, 0.5f, 1.0f) };
+			std::ostringstream name;
+			name << "triangle/" << side << "px/msaa" << cntSample;
+			run(options, results, name.str(), "pixels", [&]()
+			{
+				return double(triangle(screenCoords, shader, colorBuffer.data(), zBuffer.data(), SIZE, SIZE, samplePattern(cntSample), cntSample));
+			});
+		}
+	}
+
+	// triangles crossing the near plane, so every one is cut
+	std::vector<std::vector<Vertex>> triangles(256);
+	for (unsigned i = 0; i < triangles.size(); ++i)
+	{
+		float t = float(i) / triangles.size();
+		triangles[i].push_back(Vertex(Vec4f(0.0f, 0.0f, 0.0f, 1.0f), Vec4f(-1.0f, -1.0f, -2.0f + t, 1.0f)));
+		triangles[i].push_back(Vertex(Vec4f(1.0f, 0.0f, 0.0f, 1.0f), Vec4f(1.0f, -1.0f, 0.5f, 1.0f)));
+		triangles[i].push_back(Vertex(Vec4f(0.0f, 1.0f, 0.0f, 1.0f), Vec4f(0.0f, 1.0f, 0.0f - t, 1.0f)));
+	}
+	std::vector<Vertex> clipped;
+	run(options, results, "homogeneousClip", "triangles", [&]()
+	{
+		unsigned cnt = 0;
+		for (const std::vector<Vertex> &original : triangles)
+		{
+			clipped.clear();
+			homogeneousClip(original, clipped, 2);
+			cnt += clipped.size();
+		}
+		sink = float(cnt);
+		return double(triangles.size());
+	});
+}
+
+static void assetBenchmarks(const BenchOptions &options, std::vector<BenchResult> &results)
+{
+	// the asset cache drops the mesh and the textures with the last model, so every iteration loads them again
+	std::string head = options.dataDir + "/obj/african_head/african_head.obj";
+	run(options, results, "model/load/african_head", "models", [&]()
+	{
+		Model model(head);
+		sink = float(model.nfaces());
+		return 1.0;
+	});
+
+	std::string diffuse = options.dataDir + "/obj/african_head/african_head_diffuse.tga";
+	TGAImage image;
+	run(options, results, "tga/read", "megapixels", [&]()
+	{
+		image.read_tga_file(diffuse);
+		return image.get_width() * image.get_height() / 1e6;
+	});
+
+	std::string tmp = "raster_bench_tmp.tga";
+	run(options, results, "tga/write", "megapixels", [&]()
+	{
+		image.write_tga_file(tmp);
+		return image.get_width() * image.get_height() / 1e6;
+	});
+	std::remove(tmp.c_str());
+}
+
+// the Phong shader with the math functions of Math, names start with prefix
+template <typename Math>
+static void shaderBenchmarks(const BenchOptions &options, std::vector<BenchResult> &results, const std::string &prefix)
+{
+	// the Phong shader on a face of the head seen by the default camera, without shadows
+	Model model(options.dataDir + "/obj/african_head/african_head.obj");
+	Camera camera;
+	Light light;
+	ShaderT<Math> shader;
+	shader.uTexture = &model;
+	shader.uModel = Matrix::identity();
+	shader.uVpPV = viewport(800, 800) * projection(camera.fov, 1.0, -0.01, -10.0) * lookat(camera.eye, camera.center, camera.up);
+	shader.uLightVpPV = Matrix::identity();
+	shader.uEyePos = camera.eye;
+	shader.uLightPos = light.pos;
+	shader.uLightColor = light.color;
+	shader.uShadowBuffer = nullptr;
+	int face = model.nfaces() / 2;
+	for (int j = 0; j < 3; ++j)
+	{
+		shader.vertex(j, embed<4>(model.vert(face, j)), model.uv(face, j), model.normal(face, j), model.tangent(model.tangent_index(face, j)));
+	}
+
+	std::vector<Vec3f> bars(1024);
+	srand(2);
+	for (Vec3f &bar : bars)
+	{
+		float u = float(rand()) / RAND_MAX, v = float(rand()) / RAND_MAX * (1.0f - u);
+		bar = Vec3f(u, v, 1.0f - u - v);
+	}
+	run(options, results, prefix + "/fragment", "fragments", [&]()
+	{
+		Vec3f color, sum;
+		for (const Vec3f &bar : bars)
+		{
+			shader.fragment(bar, color);
+			sum = sum + color;
+		}
+		sink = sum.x;
+		return double(bars.size());
+	});
+	run(options, results, prefix + "/fragmentQuad", "fragments", [&]()
+	{
+		Vec3f color[4], sum;
+		for (size_t i = 0; i + 4 <= bars.size(); i += 4)
+		{
+			shader.fragmentQuad(&bars[i], 0xf, color);
+			sum = sum + color[0];
+		}
+		sink = sum.x;
+		return double(bars.size());
+	});
+}
+
+static void frontEndBenchmarks(const BenchOptions &options, std::vector<BenchResult> &results)
+{
+	// the geometry front-end on 1024 instances of the head in a 32 x 32 grid in front of the camera, 2.5M
+	// triangles, with pools of 1 to 64 threads
+	Model model(options.dataDir + "/obj/african_head/african_head.obj");
+	std::vector<Matrix> transforms;
+	for (int i = 0; i < 1024; ++i)
+	{
+		transforms.push_back(translation(Vec3f(i % 32 - 15.5f, i / 32 - 15.5f, -20.0f)));
+	}
+	Camera camera;
+	Matrix view = lookat(camera.eye, camera.center, camera.up);
+	Matrix PV = projection(camera.fov, 1.0, -0.01, -100.0) * view;
+	InstanceScratch scratch;
+	std::vector<ClippedTriangle> triangles;
+	for (unsigned cntThread = 1; cntThread <= 64; cntThread *= 2)
+	{
+		ThreadPool pool(cntThread);
+		std::ostringstream name;
+		name << "frontend/" << cntThread << "threads";
+		run(options, results, name.str(), "triangles", [&]()
+		{
+			triangles.clear();
+			processInstances(model, transforms.data(), unsigned(transforms.size()), view, PV, scratch, triangles, &pool);
+			return double(transforms.size()) * model.nfaces();
+		});
+	}
+}
+
+static void sceneBenchmarks(const BenchOptions &options, std::vector<BenchResult> &results)
+{
+	// the default scene, built here so the model paths don't depend on the working directory; incremental
+	// rendering and the shadow cache are off, or every frame after the first would be almost free
+	Scene scene;
+	int head = scene.addModel("head", options.dataDir + "/obj/african_head/african_head.obj");
+	int floor = scene.addModel("floor", options.dataDir + "/obj/floor.obj");
+	scene.models[head].transforms.push_back(Matrix::identity());
+	scene.models[floor].transforms.push_back(translation(Vec3f(0.0f, -0.3f, 0.0f)));
+	scene.cameras.push_back(Camera());
+
+	struct Variant
+	{
+		const char *name;
+		unsigned cntSample;
+		bool centroid;
+		bool shadows;
+		bool fastMath;
+		DepthFormat depthFormat;
+		ColorFormat colorFormat;
+	};
+	const DepthFormat F32 = DEPTH_FLOAT32;
+	const ColorFormat C32 = COLOR_FLOAT32;
+	const Variant VARIANTS[] = { { "scene/default/msaa4", 4, false, true, false, F32, C32 }, { "scene/default/msaa1", 1, false, true, false, F32, C32 },
+		{ "scene/default/msaa2", 2, false, true, false, F32, C32 }, { "scene/default/msaa8", 8, false, true, false, F32, C32 },
+		{ "scene/default/msaa16", 16, false, true, false, F32, C32 }, { "scene/default/msaa4/centroid", 4, true, true, false, F32, C32 },
+		{ "scene/default/noshadows", 4, false, false, false, F32, C32 }, { "scene/default/fastmath", 4, false, true, true, F32, C32 },
+		{ "scene/default/unorm24+rgba8", 4, false, true, false, DEPTH_UNORM24, COLOR_RGBA8 },
+		{ "scene/default/half16+half16", 4, false, true, false, DEPTH_HALF16, COLOR_HALF16 },
+		{ "scene/default/half16+rgba8", 4, false, true, false, DEPTH_HALF16, COLOR_RGBA8 } };
+	for (const Variant &variant : VARIANTS)
+	{
+		RenderSettings settings;
+		settings.cntSample = variant.cntSample;
+		settings.centroid = variant.centroid;
+		settings.shadows = variant.shadows;
+		settings.fastMath = variant.fastMath;
+		settings.depthFormat = variant.depthFormat;
+		settings.colorFormat = variant.colorFormat;
+		settings.incremental = false;
+		settings.shadowCache = false;
+		RenderContext context;
+		context.configure(settings);
+		TGAImage frame(settings.width, settings.height, TGAImage::RGB);
+		run(options, results, variant.name, "frames", [&]()
+		{
+			context.render(scene, scene.cameras[0], scene.light, frame);
+			return 1.0;
+		});
+	}
+}
+
+static void writeJson(std::ostream &out, const std::vector<BenchResult> &results)
+{
+	out << "{\n  \"benchmarks\": [";
+	for (size_t i = 0; i < results.size(); ++i)
+	{
+		const BenchResult &r = results[i];
+		out << (i ? "," : "") << "\n    {\"name\": \"" << r.name << "\", \"iterations\": " << r.iterations
+			<< ", \"ms_per_iteration\": " << r.seconds / r.iterations * 1e3
+			<< ", \"items_per_second\": " << r.items / r.seconds << ", \"unit\": \"" << r.unit << "\"}";
+	}
+	out << "\n  ]\n}\n";
+}
+
+int main(int argc, char **argv)
+{
+	BenchOptions options;
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		if (arg == "--filter" && i + 1 < argc) options.filter = argv[++i];
+		else if (arg == "--min-time" && i + 1 < argc) options.minTime = atof(argv[++i]);
+		else if (arg == "--data" && i + 1 < argc) options.dataDir = argv[++i];
+		else if (arg == "--out" && i + 1 < argc) options.outPath = argv[++i];
+		else
+		{
+			std::cerr << "usage: " << argv[0] << " [--filter substring] [--min-time seconds] [--data dir] [--out file.json]" << std::endl;
+			return 1;
+		}
+	}
+
+	std::vector<BenchResult> results;
+	rasterBenchmarks(options, results);
+	assetBenchmarks(options, results);
+	shaderBenchmarks<PreciseMath>(options, results, "shader");
+	shaderBenchmarks<FastMath>(options, results, "shader/fast");
+	frontEndBenchmarks(options, results);
+	sceneBenchmarks(options, results);
+
+	if (options.outPath.empty())
+	{
+		writeJson(std::cout, results);
+		return 0;
+	}
+	std::ofstream out(options.outPath);
+	if (out.fail())
+	{
+		std::cerr << "can't write " << options.outPath << std::endl;
+		return 1;
+	}
+	writeJson(out, results);
+	return 0;
+}
@@ -0,0 +1,283 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "tgaimage.h"
+#include "scene.h"
+#include "renderer.h"
+
+#ifndef BABYRASTERIZER_DATA_DIR
+#define BABYRASTERIZER_DATA_DIR "."
+#endif
+
+// regression gate for the renderer: renders a fixed set of reference scenes, compares the frames and shadow
+// depth images with the golden images in bench/golden, and the render times with the baseline recorded there;
+// exits with 1 when an image or a time is off by more than the thresholds:
+//   raster_regress [--tolerance n] [--max-bad fraction] [--min-psnr dB] [--max-slowdown fraction] [--runs n]
+//                  [--no-timing] [--update] [--update-timing] [--data dir]
+
+typedef std::chrono::steady_clock Clock;
+
+struct RegressOptions
+{
+	int tolerance;                      // largest difference of a color channel a pixel may show
+	double maxBad;                      // fraction of the pixels allowed over the tolerance
+	double minPsnr;
+	double maxSlowdown;                 // render time allowed over the baseline, as a fraction of it
+	unsigned cntRun;                    // renders per case, the fastest one is kept
+	bool timing;
+	bool updateImages, updateTiming;
+	std::string dataDir;
+
+	RegressOptions() : tolerance(2), maxBad(0.001), minPsnr(45.0), maxSlowdown(0.25), cntRun(3), timing(true), updateImages(false), updateTiming(false),
+		dataDir(BABYRASTERIZER_DATA_DIR) {}
+};
+
+// a reference scene and the settings it is rendered with on top of its own; a case with a reference
+// case is checked against the golden images of that one, to bound the error of an approximation
+struct RegressCase
+{
+	const char *name;
+	const char *sceneFile;
+	void (*configure)(RenderSettings &settings);
+	const char *reference;              // null: the golden images of the case itself
+};
+
+static void keepSettings(RenderSettings & /*settings*/) {}
+static void singleSample(RenderSettings &settings) { settings.cntSample = 1; }
+static void sixteenSamples(RenderSettings &settings) { settings.cntSample = 16; }
+static void centroidShading(RenderSettings &settings) { settings.centroid = true; }
+static void scalarShading(RenderSettings &settings) { settings.quadShading = false; }
+static void fastMath(RenderSettings &settings) { settings.fastMath = true; }
+static void fastMathScalar(RenderSettings &settings) { settings.fastMath = true; settings.quadShading = false; }
+static void compactFormats(RenderSettings &settings) { settings.depthFormat = DEPTH_UNORM24; settings.colorFormat = COLOR_RGBA8; }
+static void halfFormats(RenderSettings &settings) { settings.depthFormat = DEPTH_HALF16; settings.colorFormat = COLOR_HALF16; }
+
+static const RegressCase CASES[] = {
+	{ "default", "./scenes/default.scene", keepSettings, nullptr },
+	{ "default_msaa1", "./scenes/default.scene", singleSample, nullptr },
+	{ "default_msaa16", "./scenes/default.scene", sixteenSamples, nullptr },
+	{ "default_centroid", "./scenes/default.scene", centroidShading, nullptr },
+	{ "default_scalar", "./scenes/default.scene", scalarShading, nullptr },
+	{ "occlusion", "./scenes/occlusion.scene", keepSettings, nullptr },
+	{ "crowd", "./scenes/crowd.scene", keepSettings, nullptr },
+	{ "default_fastmath", "./scenes/default.scene", fastMath, "default" },
+	{ "default_fastmath_scalar", "./scenes/default.scene", fastMathScalar, "default_scalar" },
+	{ "crowd_fastmath", "./scenes/crowd.scene", fastMath, "crowd" },
+	{ "default_compact", "./scenes/default.scene", compactFormats, "default" },
+	{ "crowd_half", "./scenes/crowd.scene", halfFormats, "crowd" },
+};
+
+static const char *GOLDEN_DIR = "./bench/golden";
+static const char *BASELINE_PATH = "./bench/golden/baseline.txt";
+
+struct ImageDiff
+{
+	bool sameSize;
+	int maxError;                       // largest difference of a color channel
+	double badFraction;                 // fraction of the pixels over the tolerance
+	double psnr;                        // infinite for identical images
+};
+
+static ImageDiff compare(const TGAImage &image, const TGAImage &golden, int tolerance)
+{
+	ImageDiff diff = { false, 0, 0.0, INFINITY };
+	int width = image.get_width(), height = image.get_height();
+	if (width != golden.get_width() || height != golden.get_height() || width * height == 0) return diff;
+	diff.sameSize = true;
+
+	double squared = 0.0;
+	unsigned cntBad = 0;
+	for (int y = 0; y < height; ++y)
+	{
+		for (int x = 0; x < width; ++x)
+		{
+			TGAColor a = image.get(x, y), b = golden.get(x, y);
+			int pixelError = 0;
+			for (int i = 0; i < 3; ++i)
+			{
+				int e = std::abs(int(a[i]) - int(b[i]));
+				pixelError = std::max(pixelError, e);
+				squared += e * e;
+			}
+			diff.maxError = std::max(diff.maxError, pixelError);
+			if (pixelError > tolerance) cntBad++;
+		}
+	}
+	diff.badFraction = double(cntBad) / (width * height);
+	double mse = squared / (3.0 * width * height);
+	if (mse > 0.0) diff.psnr = 10.0 * std::log10(255.0 * 255.0 / mse);
+	return diff;
+}
+
+// checks an image against its golden image, or replaces the golden image when updating; the images of
+// another case are only compared with
+static bool checkImage(const RegressOptions &options, const std::string &name, const TGAImage &image, bool reference = false)
+{
+	std::string path = std::string(GOLDEN_DIR) + "/" + name + ".tga";
+	if (options.updateImages && !reference)
+	{
+		if (!image.write_tga_file(path))
+		{
+			std::cerr << "can't write " << path << std::endl;
+			return false;
+		}
+		std::cerr << "  " << name << ": golden image written" << std::endl;
+		return true;
+	}
+
+	TGAImage golden;
+	if (!golden.read_tga_file(path))
+	{
+		std::cerr << "  " << name << ": FAIL, no golden image " << path << " (run with --update)" << std::endl;
+		return false;
+	}
+	golden.flip_vertically();           // written with the bottom-left origin of the output images, turned over by the reader
+	ImageDiff diff = compare(image, golden, options.tolerance);
+	if (!diff.sameSize)
+	{
+		std::cerr << "  " << name << ": FAIL, " << image.get_width() << "x" << image.get_height() << " instead of "
+			<< golden.get_width() << "x" << golden.get_height() << std::endl;
+		return false;
+	}
+	bool ok = diff.badFraction <= options.maxBad && diff.psnr >= options.minPsnr;
+	std::cerr << "  " << name << ": " << (ok ? "ok" : "FAIL") << ", psnr " << diff.psnr << " dB, max error " << diff.maxError << ", "
+		<< diff.badFraction * 100.0 << "% of the pixels over " << options.tolerance << std::endl;
+	return ok;
+}
+
+// baseline render times by case, one "<case> <ms>" line each
+static std::map<std::string, double> readBaseline(const std::string &path)
+{
+	std::map<std::string, double> baseline;
+	std::ifstream in(path);
+	std::string line;
+	while (std::getline(in, line))
+	{
+		if (line.empty() || line[0] == '#') continue;
+		std::istringstream iss(line);
+		std::string name;
+		double ms;
+		if (iss >> name >> ms) baseline[name] = ms;
+	}
+	return baseline;
+}
+
+static bool writeBaseline(const std::string &path, const std::map<std::string, double> &baseline)
+{
+	std::ofstream out(path);
+	if (out.fail())
+	{
+		std::cerr << "can't write " << path << std::endl;
+		return false;
+	}
+	out << "# fastest render time in ms of every case of raster_regress, recorded with --update-timing" << std::endl;
+	for (const std::pair<const std::string, double> &entry : baseline)
+	{
+		out << entry.first << " " << entry.second << std::endl;
+	}
+	return true;
+}
+
+// renders a case, checks its images and its time; the time is put in times
+static bool runCase(const RegressOptions &options, const RegressCase &regressCase, const std::map<std::string, double> &baseline,
+	std::map<std::string, double> &times)
+{
+	std::cerr << regressCase.name << " (" << regressCase.sceneFile << ")" << std::endl;
+	Scene scene;
+	if (!scene.load(regressCase.sceneFile) || scene.cameras.empty())
+	{
+		std::cerr << "  FAIL, can't load " << regressCase.sceneFile << std::endl;
+		return false;
+	}
+
+	// every run renders the whole frame from scratch
+	RenderSettings settings = scene.settings;
+	regressCase.configure(settings);
+	settings.incremental = false;
+	settings.shadowCache = false;
+	RenderContext context;
+	context.configure(settings);
+	TGAImage frame(settings.width, settings.height, TGAImage::RGB);
+	TGAImage depth(settings.shadowWidth, settings.shadowHeight, TGAImage::RGB);
+	double fastest = INFINITY;
+	for (unsigned i = 0; i < options.cntRun; ++i)
+	{
+		Clock::time_point start = Clock::now();
+		context.render(scene, scene.cameras[0], scene.light, frame, settings.shadows ? &depth : nullptr);
+		fastest = std::min(fastest, std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+	}
+	times[regressCase.name] = fastest;
+
+	std::string golden = regressCase.reference ? regressCase.reference : regressCase.name;
+	if (regressCase.reference) std::cerr << "  against the golden images of " << golden << std::endl;
+	bool ok = checkImage(options, golden + "_frame", frame, regressCase.reference != nullptr);
+	if (settings.shadows) ok = checkImage(options, golden + "_depth", depth, regressCase.reference != nullptr) && ok;
+
+	if (!options.timing || options.updateTiming) std::cerr << "  " << fastest << " ms" << std::endl;
+	else
+	{
+		std::map<std::string, double>::const_iterator it = baseline.find(regressCase.name);
+		if (it == baseline.end())
+		{
+			std::cerr << "  FAIL, " << fastest << " ms, no baseline time (run with --update-timing)" << std::endl;
+			return false;
+		}
+		bool fast = fastest <= it->second * (1.0 + options.maxSlowdown);
+		std::cerr << "  " << (fast ? "ok" : "FAIL") << ", " << fastest << " ms, baseline " << it->second << " ms ("
+			<< (fastest / it->second - 1.0) * 100.0 << "%)" << std::endl;
+		ok = ok && fast;
+	}
+	return ok;
+}
+
+int main(int argc, char **argv)
+{
+	RegressOptions options;
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		if (arg == "--tolerance" && i + 1 < argc) options.tolerance = atoi(argv[++i]);
+		else if (arg == "--max-bad" && i + 1 < argc) options.maxBad = atof(argv[++i]);
+		else if (arg == "--min-psnr" && i + 1 < argc) options.minPsnr = atof(argv[++i]);
+		else if (arg == "--max-slowdown" && i + 1 < argc) options.maxSlowdown = atof(argv[++i]);
+		else if (arg == "--runs" && i + 1 < argc) options.cntRun = std::max(1, atoi(argv[++i]));
+		else if (arg == "--no-timing") options.timing = false;
+		else if (arg == "--update") options.updateImages = options.updateTiming = true;
+		else if (arg == "--update-timing") options.updateTiming = true;
+		else if (arg == "--data" && i + 1 < argc) options.dataDir = argv[++i];
+		else
+		{
+			std::cerr << "usage: " << argv[0] << " [--tolerance n] [--max-bad fraction] [--min-psnr dB] [--max-slowdown fraction] [--runs n]"
+				<< " [--no-timing] [--update] [--update-timing] [--data dir]" << std::endl;
+			return 1;
+		}
+	}
+
+	// the scene files name their models relative to the data directory
+	if (chdir(options.dataDir.c_str()) != 0)
+	{
+		std::cerr << "can't enter " << options.dataDir << std::endl;
+		return 1;
+	}
+
+	std::map<std::string, double> baseline = readBaseline(BASELINE_PATH), times;
+	unsigned cntFailed = 0, cntCase = sizeof(CASES) / sizeof(CASES[0]);
+	for (const RegressCase &regressCase : CASES)
+	{
+		if (!runCase(options, regressCase, baseline, times)) cntFailed++;
+	}
+	if (options.updateTiming && !writeBaseline(BASELINE_PATH, times)) return 1;
+
+	std::cerr << std::endl << cntCase - cntFailed << " of " << cntCase << " cases passed" << std::endl;
+	return cntFailed ? 1 : 0;
+}
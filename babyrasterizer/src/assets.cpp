@@ -0,0 +1,128 @@
+#include "assets.h"
+
+AssetCache::AssetCache() : meshes_(), textures_(), hits_(0), misses_(0), mutex_() {}
+
+AssetCache &AssetCache::instance() {
+	static AssetCache cache;
+	return cache;
+}
+
+static size_t asset_bytes(const Mesh &mesh) {
+	return mesh.bytes();
+}
+
+static size_t asset_bytes(const TGAImage &image) {
+	return size_t(image.get_width()) * image.get_height() * image.get_bytespp();
+}
+
+// drops the entries of the assets no model references anymore; called with the cache locked
+template <typename T> void AssetCache::prune(std::map<std::string, Entry<T>> &entries) {
+	for (auto it = entries.begin(); it != entries.end();) {
+		if (it->second.asset.expired() && !it->second.pending.valid()) it = entries.erase(it);
+		else ++it;
+	}
+}
+
+template <typename T> AssetCache::Future<T> AssetCache::request(std::map<std::string, Entry<T>> &entries, const std::string &filename,
+	std::function<std::shared_ptr<T>()> load, ThreadPool *pool) {
+	std::shared_ptr<std::promise<std::shared_ptr<const T>>> promise;
+	Future<T> future;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		prune(entries);
+		Entry<T> &entry = entries[filename];
+		std::shared_ptr<const T> ret = entry.asset.lock();
+		if (ret || entry.pending.valid()) {
+			hits_++;
+			if (entry.pending.valid()) return entry.pending;
+			std::promise<std::shared_ptr<const T>> ready;
+			ready.set_value(ret);
+			return ready.get_future().share();
+		}
+		misses_++;
+		promise = std::make_shared<std::promise<std::shared_ptr<const T>>>();
+		future = promise->get_future().share();
+		entry.pending = future;
+	}
+
+	ThreadPool::Task job = [this, &entries, filename, load, promise]() {
+		std::shared_ptr<const T> loaded = load();
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (loaded) {
+				Entry<T> &entry = entries[filename];
+				entry.asset = loaded;
+				entry.bytes = asset_bytes(*loaded);
+				entry.pending = Future<T>();
+			}
+			else entries.erase(filename);
+		}
+		promise->set_value(loaded);
+	};
+	if (pool) pool->submit(job);
+	else job();
+	return future;
+}
+
+std::shared_ptr<const Mesh> AssetCache::mesh(const std::string &filename) {
+	return mesh_async(filename, nullptr).get();
+}
+
+std::shared_ptr<const TGAImage> AssetCache::texture(const std::string &filename) {
+	return texture_async(filename, nullptr).get();
+}
+
+AssetCache::Future<Mesh> AssetCache::mesh_async(const std::string &filename, ThreadPool *pool) {
+	return request<Mesh>(meshes_, filename, [filename]() {
+		std::shared_ptr<Mesh> loaded = std::make_shared<Mesh>();
+		if (loaded->load(filename)) return loaded;
+		std::cerr << "mesh file " << filename << " loading failed" << std::endl;
+		return std::shared_ptr<Mesh>();
+	}, pool);
+}
+
+AssetCache::Future<TGAImage> AssetCache::texture_async(const std::string &filename, ThreadPool *pool) {
+	return request<TGAImage>(textures_, filename, [filename]() {
+		std::shared_ptr<TGAImage> loaded = std::make_shared<TGAImage>();
+		bool ok = loaded->read_tga_file(filename.c_str());
+		std::cerr << "texture file " << filename << " loading " << (ok ? "ok" : "failed") << std::endl;
+		if (!ok) return std::shared_ptr<TGAImage>();
+		loaded->flip_vertically();
+		return loaded;
+	}, pool);
+}
+
+size_t AssetCache::resident_bytes() const {
+	std::lock_guard<std::mutex> lock(mutex_);
+	size_t ret = 0;
+	for (auto &item : meshes_)
+		if (!item.second.asset.expired()) ret += item.second.bytes;
+	for (auto &item : textures_)
+		if (!item.second.asset.expired()) ret += item.second.bytes;
+	return ret;
+}
+
+unsigned AssetCache::resident_count() const {
+	std::lock_guard<std::mutex> lock(mutex_);
+	unsigned ret = 0;
+	for (auto &item : meshes_)
+		if (!item.second.asset.expired()) ret++;
+	for (auto &item : textures_)
+		if (!item.second.asset.expired()) ret++;
+	return ret;
+}
+
+unsigned AssetCache::hits() const {
+	std::lock_guard<std::mutex> lock(mutex_);
+	return hits_;
+}
+
+unsigned AssetCache::misses() const {
+	std::lock_guard<std::mutex> lock(mutex_);
+	return misses_;
+}
+
+void AssetCache::report(std::ostream &out) const {
+	out << "asset cache: " << resident_count() << " assets resident, " << resident_bytes() << " bytes, "
+		<< hits() << " hits, " << misses() << " misses" << std::endl;
+}
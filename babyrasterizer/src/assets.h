@@ -0,0 +1,51 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <memory>
+#include <future>
+#include <functional>
+#include <string>
+#include <iostream>
+
+#include "tgaimage.h"
+#include "model.h"
+#include "threadpool.h"
+
+// registry of loaded meshes and textures keyed by path, every asset is loaded once and
+// shared by all its users; an asset is released when the last model referencing it is gone.
+// The async requests load on a thread pool and return at once, requests for an asset that
+// is still loading share its load; the cache is not locked while loading. A mesh or texture that
+// fails to load comes back null and is not cached, so the next request tries again
+class AssetCache {
+public:
+	template <typename T> using Future = std::shared_future<std::shared_ptr<const T>>;
+
+private:
+	template <typename T> struct Entry {
+		std::weak_ptr<const T> asset;
+		Future<T> pending;           // valid while the asset is loading
+		size_t bytes;
+	};
+	std::map<std::string, Entry<Mesh>> meshes_;
+	std::map<std::string, Entry<TGAImage>> textures_;
+	unsigned hits_, misses_;
+	mutable std::mutex mutex_;
+
+	AssetCache();
+	template <typename T> void prune(std::map<std::string, Entry<T>> &entries);
+	template <typename T> Future<T> request(std::map<std::string, Entry<T>> &entries, const std::string &filename,
+		std::function<std::shared_ptr<T>()> load, ThreadPool *pool);
+public:
+	static AssetCache &instance();
+	std::shared_ptr<const Mesh> mesh(const std::string &filename);
+	std::shared_ptr<const TGAImage> texture(const std::string &filename);
+	// without a pool the asset is loaded before returning
+	Future<Mesh> mesh_async(const std::string &filename, ThreadPool *pool);
+	Future<TGAImage> texture_async(const std::string &filename, ThreadPool *pool);
+	size_t resident_bytes() const;   // bytes of assets still referenced by some model
+	unsigned resident_count() const;
+	unsigned hits() const;
+	unsigned misses() const;
+	void report(std::ostream &out) const;
+};
@@ -0,0 +1,175 @@
+#pragma once
+
+#include <cstring>
+#include <algorithm>
+#include <limits>
+#include <string>
+
+#include "geometry.h"
+
+// storage formats of the depth and color samples of a frame, chosen at compile time by the Depth and Color
+// parameters of the rasterizers: they still compute float depths and colors, and a format encodes them into
+// what a sample keeps and decodes them back for the resolve. A greater encoded depth is nearer, so the depth
+// test compares encoded values, and a cleared sample holds far()
+
+// IEEE half floats, rounded to nearest even; from "half <-> float conversions" by F. Giesen
+inline unsigned short floatToHalf(float f)
+{
+	const unsigned INFINITY32 = 255u << 23, MAX16 = (127u + 16) << 23, DENORMAL_MAGIC = ((127u - 15) + (23 - 10) + 1) << 23;
+	unsigned x;
+	memcpy(&x, &f, sizeof(x));
+	unsigned sign = x & 0x80000000u;
+	x ^= sign;
+	unsigned short h;
+	if (x >= MAX16) h = x > INFINITY32 ? 0x7e00 : 0x7c00;
+	else if (x < (113u << 23))
+	{
+		// the float addition shifts the mantissa of a subnormal half into place and rounds it
+		float magic, t;
+		memcpy(&magic, &DENORMAL_MAGIC, sizeof(magic));
+		memcpy(&t, &x, sizeof(t));
+		t += magic;
+		memcpy(&x, &t, sizeof(x));
+		h = (unsigned short)(x - DENORMAL_MAGIC);
+	}
+	else
+	{
+		unsigned odd = (x >> 13) & 1;
+		x += ((15u - 127) << 23) + 0xfff + odd;
+		h = (unsigned short)(x >> 13);
+	}
+	return (unsigned short)(h | (sign >> 16));
+}
+
+inline float halfToFloat(unsigned short h)
+{
+	const unsigned MAGIC = 113u << 23, SHIFTED_EXP = 0x7c00u << 13;
+	unsigned x = (h & 0x7fffu) << 13;
+	unsigned exp = x & SHIFTED_EXP;
+	x += (127u - 15) << 23;
+	if (exp == SHIFTED_EXP) x += (128u - 16) << 23;
+	else if (exp == 0)
+	{
+		// subnormal half, renormalized by a float subtraction
+		x += 1u << 23;
+		float f, magic;
+		memcpy(&f, &x, sizeof(f));
+		memcpy(&magic, &MAGIC, sizeof(magic));
+		f -= magic;
+		memcpy(&x, &f, sizeof(x));
+	}
+	x |= (h & 0x8000u) << 16;
+	float f;
+	memcpy(&f, &x, sizeof(f));
+	return f;
+}
+
+enum DepthFormat { DEPTH_FLOAT32, DEPTH_UNORM24, DEPTH_HALF16 };
+enum ColorFormat { COLOR_FLOAT32, COLOR_HALF16, COLOR_RGBA8 };
+
+// the depth of the projection as is, from -1 at the far plane to 1 at the near plane
+struct DepthFloat32
+{
+	typedef float Type;
+	static Type far() { return -std::numeric_limits<float>::max(); }
+	static Type encode(float z) { return z; }
+};
+
+// the depth range of the projection mapped to [0, 1] with the near plane at 1, for the reduced formats:
+// a half float then has its finest steps at the far plane, where the perspective divide crowds the
+// depths. This only flips the convention of depths that are already projected; it is not a reversed
+// projection, so a float32 depth would gain nothing from it, and the fine steps near 0 cannot recover
+// what z + 1 rounded away near the far plane. Encoded depths are never 0, a sample at the far plane
+// still reads as drawn
+inline float reversedDepth(float z)
+{
+	return std::min(1.0f, std::max(0.0f, (z + 1.0f) * 0.5f));
+}
+
+// 24 bits of normalized depth packed in three bytes, least significant first
+struct Unorm24
+{
+	unsigned char b[3];
+
+	unsigned value() const { return b[0] | b[1] << 8 | b[2] << 16; }
+	static Unorm24 make(unsigned v) { Unorm24 u = { { (unsigned char)v, (unsigned char)(v >> 8), (unsigned char)(v >> 16) } }; return u; }
+};
+
+inline bool operator==(Unorm24 a, Unorm24 b) { return a.value() == b.value(); }
+inline bool operator!=(Unorm24 a, Unorm24 b) { return a.value() != b.value(); }
+inline bool operator<(Unorm24 a, Unorm24 b) { return a.value() < b.value(); }
+inline bool operator>=(Unorm24 a, Unorm24 b) { return a.value() >= b.value(); }
+
+struct DepthUnorm24
+{
+	typedef Unorm24 Type;
+	static Type far() { return Unorm24::make(0); }
+	static Type encode(float z) { return Unorm24::make(std::max(1u, unsigned(reversedDepth(z) * 16777215.0f + 0.5f))); }
+};
+static_assert(sizeof(Unorm24) == 3, "a 24-bit depth sample takes three bytes");
+
+// half float depth; positive halfs order like their bits, so the test compares them as integers
+struct DepthHalf16
+{
+	typedef unsigned short Type;
+	static Type far() { return 0; }
+	static Type encode(float z) { return std::max((unsigned short)1, floatToHalf(reversedDepth(z))); }
+};
+
+struct ColorFloat32
+{
+	typedef Vec3f Type;
+	static Type encode(const Vec3f &c) { return c; }
+	static Vec3f decode(const Type &c) { return c; }
+};
+
+struct Half3
+{
+	unsigned short r, g, b;
+};
+
+struct ColorHalf16
+{
+	typedef Half3 Type;
+	static Type encode(const Vec3f &c) { Type h = { floatToHalf(c.x), floatToHalf(c.y), floatToHalf(c.z) }; return h; }
+	static Vec3f decode(const Type &h) { return Vec3f(halfToFloat(h.r), halfToFloat(h.g), halfToFloat(h.b)); }
+};
+
+// 8 bits per channel, rounded to the nearest; the alpha byte only pads the sample to 4 bytes
+struct ColorRGBA8
+{
+	typedef unsigned Type;
+	static unsigned channel(float v) { return unsigned(std::min(255.0f, std::max(0.0f, v)) + 0.5f); }
+	static Type encode(const Vec3f &c) { return channel(c.x) | channel(c.y) << 8 | channel(c.z) << 16; }
+	static Vec3f decode(Type c) { return Vec3f(float(c & 0xff), float(c >> 8 & 0xff), float(c >> 16 & 0xff)); }
+};
+
+// names of the formats in scene files and render requests; parsing returns false for an unknown name
+inline bool parseDepthFormat(const std::string &name, DepthFormat &format)
+{
+	if (name == "float32") format = DEPTH_FLOAT32;
+	else if (name == "unorm24") format = DEPTH_UNORM24;
+	else if (name == "half16") format = DEPTH_HALF16;
+	else return false;
+	return true;
+}
+
+inline bool parseColorFormat(const std::string &name, ColorFormat &format)
+{
+	if (name == "float32") format = COLOR_FLOAT32;
+	else if (name == "half16") format = COLOR_HALF16;
+	else if (name == "rgba8") format = COLOR_RGBA8;
+	else return false;
+	return true;
+}
+
+// bytes of a sample of the formats
+inline unsigned depthBytes(DepthFormat format)
+{
+	return format == DEPTH_UNORM24 ? sizeof(DepthUnorm24::Type) : format == DEPTH_HALF16 ? sizeof(DepthHalf16::Type) : sizeof(DepthFloat32::Type);
+}
+
+inline unsigned colorBytes(ColorFormat format)
+{
+	return format == COLOR_HALF16 ? sizeof(ColorHalf16::Type) : format == COLOR_RGBA8 ? sizeof(ColorRGBA8::Type) : sizeof(ColorFloat32::Type);
+}
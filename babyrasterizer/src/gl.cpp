@@ -4,6 +4,7 @@
 #include <cassert>
 
 #include "gl.h"
+#include "profiler.h"
 
 Matrix lookat(Vec3f eye, Vec3f center, Vec3f up)
 {
@@ -63,6 +64,45 @@ Matrix viewport(unsigned width, unsigned height)
 	return ret;
 }
 
+Matrix translation(Vec3f offset)
+{
+	Matrix ret = Matrix::identity();
+	for (int i = 0; i < 3; ++i)
+	{
+		ret[i][3] = offset[i];
+	}
+	return ret;
+}
+
+Matrix scaling(Vec3f factor)
+{
+	Matrix ret = Matrix::identity();
+	for (int i = 0; i < 3; ++i)
+	{
+		ret[i][i] = factor[i];
+	}
+	return ret;
+}
+
+Matrix rotation(Vec3f axis, float angle)
+{
+	// Rodrigues' rotation formula, angle in radians
+	Vec3f k = axis.normalize();
+	float c = cosf(angle), s = sinf(angle);
+	Matrix ret = Matrix::identity();
+	for (int i = 0; i < 3; ++i)
+	{
+		for (int j = 0; j < 3; ++j)
+		{
+			ret[i][j] = (i == j ? c : 0.0f) + (1.0f - c) * k[i] * k[j];
+		}
+	}
+	ret[0][1] -= s * k.z; ret[0][2] += s * k.y;
+	ret[1][0] += s * k.z; ret[1][2] -= s * k.x;
+	ret[2][0] -= s * k.y; ret[2][1] += s * k.x;
+	return ret;
+}
+
 Vec3f barycentric(Vec2f A, Vec2f B, Vec2f C, Vec2f P)
 {
 	Vec3f t[2];
@@ -78,11 +118,12 @@ Vec3f barycentric(Vec2f A, Vec2f B, Vec2f C, Vec2f P)
 	return Vec3f(1.0f - (u.x + u.y) / u.z, u.x / u.z, u.y / u.z);
 }
 
-void triangle(Vec4f *screenCoords, IShader &shader, Vec3f *colorBuffer, float *zBuffer, unsigned width, unsigned height, const float d[][2], unsigned cntSample)
+// finds the pixels touched by a triangle, returns false when none of them is drawn
+static bool triangleBox(Vec4f *screenCoords, unsigned width, unsigned height, const TileMask *tiles, Vec2i &bboxmin, Vec2i &bboxmax)
 {
 	// find the minimum bounding box for the triangle on the screen
-	Vec2i bboxmin(width - 1, height - 1);
-	Vec2i bboxmax(0.0f, 0.0f);
+	bboxmin = Vec2i(width - 1, height - 1);
+	bboxmax = Vec2i(0.0f, 0.0f);
 	for (int i = 0; i < 3; ++i)
 	{
 		for (int j = 0; j < 2; ++j)
@@ -97,41 +138,316 @@ void triangle(Vec4f *screenCoords, IShader &shader, Vec3f *colorBuffer, float *z
 	bboxmax[0] = std::min(int(width - 1), bboxmax[0]);
 	bboxmax[1] = std::min(int(height - 1), bboxmax[1]);
 
-	// rasterize the triangle
+	// skip the triangle when none of the tiles it touches is drawn
+	if (tiles)
+	{
+		bool touched = false;
+		for (int ty = bboxmin.y / int(tiles->tileSize); !touched && ty <= bboxmax.y / int(tiles->tileSize); ++ty)
+		{
+			for (int tx = bboxmin.x / int(tiles->tileSize); !touched && tx <= bboxmax.x / int(tiles->tileSize); ++tx)
+			{
+				touched = tiles->mask[ty * tiles->cntTileX + tx] != 0;
+			}
+		}
+		if (!touched) return false;
+	}
+	return true;
+}
+
+// depth of a sample, or false when the sample is outside of the triangle
+static bool sampleDepth(Vec4f *screenCoords, Vec2f A, Vec2f B, Vec2f C, Vec2f sample, float &z)
+{
+	Vec3f barSample = barycentric(A, B, C, sample);
+	float w = screenCoords[0].w * barSample.x + screenCoords[1].w * barSample.y + screenCoords[2].w * barSample.z;
+	w = 1.0f / w;
+	z = screenCoords[0].z * barSample.x + screenCoords[1].z * barSample.y + screenCoords[2].z * barSample.z;
+	z = z * w;
+	return !(barSample.x < 0 || barSample.y < 0 || barSample.z < 0);
+}
+
+// where a pixel is shaded: its center, or with centroid the mean of the samples inside of the triangle when
+// some are not; coverage masks have one bit per sample
+template <unsigned N>
+static Vec2f shadingPoint(int x, int y, const float d[][2], unsigned inside, bool centroid)
+{
+	if (!centroid || inside == (1u << N) - 1) return Vec2f(x + 0.5f, y + 0.5f);
+	float sx = 0.0f, sy = 0.0f;
+	unsigned cnt = 0;
+	for (unsigned i = 0; i < N; ++i)
+	{
+		if (!(inside >> i & 1)) continue;
+		sx += d[i][0];
+		sy += d[i][1];
+		cnt++;
+	}
+	return Vec2f(x + sx / cnt, y + sy / cnt);
+}
+
+template <unsigned N, typename Depth, typename Color>
+static unsigned rasterize(Vec4f *screenCoords, IShader &shader, typename Color::Type *colorBuffer, typename Depth::Type *zBuffer, unsigned width,
+	const float d[][2], const TileMask *tiles, bool centroid, Vec2i bboxmin, Vec2i bboxmax)
+{
+	unsigned cntShaded = 0;
+	SampleCounter samples;
 	Vec2f A = proj<2>(screenCoords[0]), B = proj<2>(screenCoords[1]), C = proj<2>(screenCoords[2]);
 	for (int x = bboxmin.x; x <= bboxmax.x; ++x)
 	{
 		for (int y = bboxmin.y; y <= bboxmax.y; ++y)
 		{
-			// calculate color and depth for every sample of a pixel
-			Vec3f barMiddle, color;
-			bool covered = false;
-			for (int i = 0; i < cntSample; ++i)
+			if (tiles && !tiles->covered(x, y)) continue;
+
+			// coverage and depth test of every sample of the pixel, then one shading invocation for the
+			// samples that passed
+			typename Depth::Type z[N];
+			unsigned inside = 0, passed = 0;
+			size_t first = size_t(N) * (y*width + x);
+			for (unsigned i = 0; i < N; ++i)
+			{
+				float depth;
+				bool covered = sampleDepth(screenCoords, A, B, C, Vec2f(x + d[i][0], y + d[i][1]), depth);
+				z[i] = Depth::encode(depth);
+				if (!covered) continue;
+				inside |= 1u << i;
+				samples.test(z[i] >= zBuffer[first + i]);
+				if (z[i] >= zBuffer[first + i]) passed |= 1u << i;
+			}
+			if (!passed) continue;
+
+			Vec3f barMiddle = barycentric(A, B, C, shadingPoint<N>(x, y, d, inside, centroid)), color;
+			cntShaded++;
+			bool discard;
 			{
-				Vec2f sample(x + d[i][0], y + d[i][1]);
-				Vec3f barSample = barycentric(A, B, C, sample);
-				float w = screenCoords[0].w * barSample.x + screenCoords[1].w * barSample.y + screenCoords[2].w * barSample.z;
-				w = 1.0f / w;
-				float z = screenCoords[0].z * barSample.x + screenCoords[1].z * barSample.y + screenCoords[2].z * barSample.z;
-				z = z * w;
-				unsigned idx = cntSample * (y*width + x) + i;
-				if (barSample.x < 0 || barSample.y < 0 || barSample.z < 0) continue;
-
-				if (barSample.x < 0 || barSample.y < 0 || barSample.z < 0 || z < zBuffer[idx]) continue;
-
-				if (!covered) // calculate the color only once for each pixel
+				PROFILE_ACCUMULATE(TIMER_FRAGMENT);
+				discard = !shader.fragment(barMiddle, color);
+			}
+			if (discard) continue;
+			typename Color::Type encoded = Color::encode(color);
+			for (unsigned i = 0; i < N; ++i)
+			{
+				if (!(passed >> i & 1)) continue;
+				colorBuffer[first + i] = encoded;
+				zBuffer[first + i] = z[i];
+			}
+		}
+	}
+	return cntShaded;
+}
+
+template <typename Depth, typename Color>
+unsigned triangle(Vec4f *screenCoords, IShader &shader, typename Color::Type *colorBuffer, typename Depth::Type *zBuffer, unsigned width, unsigned height,
+	const float d[][2], unsigned cntSample, const TileMask *tiles, bool centroid)
+{
+	Vec2i bboxmin, bboxmax;
+	if (!triangleBox(screenCoords, width, height, tiles, bboxmin, bboxmax)) return 0;
+	switch (cntSample)
+	{
+	case 1: return rasterize<1, Depth, Color>(screenCoords, shader, colorBuffer, zBuffer, width, d, tiles, centroid, bboxmin, bboxmax);
+	case 2: return rasterize<2, Depth, Color>(screenCoords, shader, colorBuffer, zBuffer, width, d, tiles, centroid, bboxmin, bboxmax);
+	case 4: return rasterize<4, Depth, Color>(screenCoords, shader, colorBuffer, zBuffer, width, d, tiles, centroid, bboxmin, bboxmax);
+	case 8: return rasterize<8, Depth, Color>(screenCoords, shader, colorBuffer, zBuffer, width, d, tiles, centroid, bboxmin, bboxmax);
+	case 16: return rasterize<16, Depth, Color>(screenCoords, shader, colorBuffer, zBuffer, width, d, tiles, centroid, bboxmin, bboxmax);
+	}
+	assert(!"unsupported sample count");
+	return 0;
+}
+
+template <unsigned N, typename Depth>
+static void rasterizeDepth(Vec4f *screenCoords, typename Depth::Type *zBuffer, unsigned width, const float d[][2], const TileMask *tiles, Vec2i bboxmin, Vec2i bboxmax)
+{
+	SampleCounter samples;
+	Vec2f A = proj<2>(screenCoords[0]), B = proj<2>(screenCoords[1]), C = proj<2>(screenCoords[2]);
+	for (int x = bboxmin.x; x <= bboxmax.x; ++x)
+	{
+		for (int y = bboxmin.y; y <= bboxmax.y; ++y)
+		{
+			if (tiles && !tiles->covered(x, y)) continue;
+			size_t first = size_t(N) * (y*width + x);
+			for (unsigned i = 0; i < N; ++i)
+			{
+				float depth;
+				if (!sampleDepth(screenCoords, A, B, C, Vec2f(x + d[i][0], y + d[i][1]), depth)) continue;
+				typename Depth::Type z = Depth::encode(depth);
+				samples.test(z >= zBuffer[first + i]);
+				if (z < zBuffer[first + i]) continue;
+				zBuffer[first + i] = z;
+			}
+		}
+	}
+}
+
+template <typename Depth>
+void triangleDepth(Vec4f *screenCoords, typename Depth::Type *zBuffer, unsigned width, unsigned height, const float d[][2], unsigned cntSample, const TileMask *tiles)
+{
+	Vec2i bboxmin, bboxmax;
+	if (!triangleBox(screenCoords, width, height, tiles, bboxmin, bboxmax)) return;
+	switch (cntSample)
+	{
+	case 1: rasterizeDepth<1, Depth>(screenCoords, zBuffer, width, d, tiles, bboxmin, bboxmax); return;
+	case 2: rasterizeDepth<2, Depth>(screenCoords, zBuffer, width, d, tiles, bboxmin, bboxmax); return;
+	case 4: rasterizeDepth<4, Depth>(screenCoords, zBuffer, width, d, tiles, bboxmin, bboxmax); return;
+	case 8: rasterizeDepth<8, Depth>(screenCoords, zBuffer, width, d, tiles, bboxmin, bboxmax); return;
+	case 16: rasterizeDepth<16, Depth>(screenCoords, zBuffer, width, d, tiles, bboxmin, bboxmax); return;
+	}
+	assert(!"unsupported sample count");
+}
+
+// shades the part [x0, x1] x [y0, y1] of a triangle in 2x2 quads of coarse pixels of rate.x * rate.y pixels;
+// quads are aligned to multiples of their size
+template <unsigned N, typename Depth, typename Color>
+static unsigned shadeQuads(Vec4f *screenCoords, IQuadShader &shader, typename Color::Type *colorBuffer, typename Depth::Type *zBuffer, unsigned width,
+	const float d[][2], const TileMask *tiles, bool centroid, int x0, int y0, int x1, int y1, ShadingRate rate)
+{
+	const unsigned MAX_PIXEL = MAX_RATE * MAX_RATE;
+	unsigned cntShaded = 0;
+	SampleCounter samples;
+	Vec2f A = proj<2>(screenCoords[0]), B = proj<2>(screenCoords[1]), C = proj<2>(screenCoords[2]);
+	typename Depth::Type z[4][MAX_PIXEL][N];  // depth of the samples of the pixels of every lane
+	unsigned passed[4][MAX_PIXEL];      // samples of the pixels of every lane that passed the depth test
+	int quadX = 2 * rate.x, quadY = 2 * rate.y;
+	for (int qy = y0 - y0 % quadY; qy <= y1; qy += quadY)
+	{
+		for (int qx = x0 - x0 % quadX; qx <= x1; qx += quadX)
+		{
+			// coverage and depth test of the samples of all the pixels, nothing is written yet; with centroid
+			// the positions of the samples inside of the triangle are summed per lane
+			unsigned mask = 0;
+			Vec2f insideSum[4];
+			unsigned cntInside[4], cntTested[4];
+			for (int lane = 0; lane < 4; ++lane)
+			{
+				int lx = qx + lane % 2 * rate.x, ly = qy + lane / 2 * rate.y;
+				insideSum[lane] = Vec2f(0.0f, 0.0f);
+				cntInside[lane] = cntTested[lane] = 0;
+				for (int p = 0; p < rate.x * rate.y; ++p)
 				{
-					barMiddle = barycentric(A, B, C, Vec2f(x + 0.5f, y + 0.5f));
-					if (!shader.fragment(barMiddle, color)) break;
-					covered = true;
+					int x = lx + p % rate.x, y = ly + p / rate.x;
+					passed[lane][p] = 0;
+					if (x < x0 || x > x1 || y < y0 || y > y1 || (tiles && !tiles->covered(x, y))) continue;
+					size_t first = size_t(N) * (y*width + x);
+					unsigned inside = 0;
+					for (unsigned i = 0; i < N; ++i)
+					{
+						float depth;
+						bool covered = sampleDepth(screenCoords, A, B, C, Vec2f(x + d[i][0], y + d[i][1]), depth);
+						z[lane][p][i] = Depth::encode(depth);
+						if (!covered) continue;
+						inside |= 1u << i;
+						samples.test(z[lane][p][i] >= zBuffer[first + i]);
+						if (z[lane][p][i] >= zBuffer[first + i]) passed[lane][p] |= 1u << i;
+					}
+					if (passed[lane][p]) mask |= 1u << lane;
+					cntTested[lane] += N;
+					if (!centroid || !inside) continue;
+					for (unsigned i = 0; i < N; ++i)
+					{
+						if (!(inside >> i & 1)) continue;
+						insideSum[lane] = insideSum[lane] + Vec2f(x + d[i][0], y + d[i][1]);
+						cntInside[lane]++;
+					}
 				}
-				colorBuffer[idx] = color;
-				zBuffer[idx] = z;
 			}
+			if (!mask) continue;
+
+			// shade the whole quad at the centers of the coarse pixels (or their centroids), then write the
+			// samples of the lanes that got a color
+			Vec3f barMiddle[4], color[4];
+			for (int lane = 0; lane < 4; ++lane)
+			{
+				Vec2f center(qx + (lane % 2 + 0.5f) * rate.x, qy + (lane / 2 + 0.5f) * rate.y);
+				if (cntInside[lane] > 0 && cntInside[lane] < cntTested[lane]) center = insideSum[lane] / float(cntInside[lane]);
+				barMiddle[lane] = barycentric(A, B, C, center);
+				if (mask >> lane & 1) cntShaded++;
+			}
+			unsigned shaded;
+			{
+				PROFILE_ACCUMULATE(TIMER_FRAGMENT);
+				shaded = shader.fragmentQuad(barMiddle, mask, color) & mask;
+			}
+			for (int lane = 0; lane < 4; ++lane)
+			{
+				if (!(shaded >> lane & 1)) continue;
+				typename Color::Type encoded = Color::encode(color[lane]);
+				int lx = qx + lane % 2 * rate.x, ly = qy + lane / 2 * rate.y;
+				for (int p = 0; p < rate.x * rate.y; ++p)
+				{
+					int x = lx + p % rate.x, y = ly + p / rate.x;
+					size_t first = size_t(N) * (y*width + x);
+					for (unsigned i = 0; i < N; ++i)
+					{
+						if (!(passed[lane][p] >> i & 1)) continue;
+						colorBuffer[first + i] = encoded;
+						zBuffer[first + i] = z[lane][p][i];
+					}
+				}
+			}
+		}
+	}
+	return cntShaded;
+}
+
+template <unsigned N, typename Depth, typename Color>
+static unsigned rasterizeQuads(Vec4f *screenCoords, IQuadShader &shader, typename Color::Type *colorBuffer, typename Depth::Type *zBuffer, unsigned width,
+	const float d[][2], const TileMask *tiles, const RateMap *rates, bool centroid, Vec2i bboxmin, Vec2i bboxmax)
+{
+	if (!rates || !rates->rates)
+	{
+		ShadingRate rate = rates ? rates->uniform : ShadingRate();
+		return shadeQuads<N, Depth, Color>(screenCoords, shader, colorBuffer, zBuffer, width, d, tiles, centroid, bboxmin.x, bboxmin.y, bboxmax.x, bboxmax.y, rate);
+	}
+
+	// the rate changes from tile to tile, shade the part of the triangle in every tile with its rate
+	unsigned cntShaded = 0;
+	int tileSize = rates->tileSize;
+	for (int ty = bboxmin.y / tileSize; ty <= bboxmax.y / tileSize; ++ty)
+	{
+		for (int tx = bboxmin.x / tileSize; tx <= bboxmax.x / tileSize; ++tx)
+		{
+			int x0 = std::max(bboxmin.x, tx * tileSize), y0 = std::max(bboxmin.y, ty * tileSize);
+			int x1 = std::min(bboxmax.x, (tx + 1) * tileSize - 1), y1 = std::min(bboxmax.y, (ty + 1) * tileSize - 1);
+			cntShaded += shadeQuads<N, Depth, Color>(screenCoords, shader, colorBuffer, zBuffer, width, d, tiles, centroid, x0, y0, x1, y1, rates->rate(tx, ty));
 		}
 	}
+	return cntShaded;
 }
 
+template <typename Depth, typename Color>
+unsigned triangleQuads(Vec4f *screenCoords, IQuadShader &shader, typename Color::Type *colorBuffer, typename Depth::Type *zBuffer, unsigned width, unsigned height,
+	const float d[][2], unsigned cntSample, const TileMask *tiles, const RateMap *rates, bool centroid)
+{
+	Vec2i bboxmin, bboxmax;
+	if (!triangleBox(screenCoords, width, height, tiles, bboxmin, bboxmax)) return 0;
+	switch (cntSample)
+	{
+	case 1: return rasterizeQuads<1, Depth, Color>(screenCoords, shader, colorBuffer, zBuffer, width, d, tiles, rates, centroid, bboxmin, bboxmax);
+	case 2: return rasterizeQuads<2, Depth, Color>(screenCoords, shader, colorBuffer, zBuffer, width, d, tiles, rates, centroid, bboxmin, bboxmax);
+	case 4: return rasterizeQuads<4, Depth, Color>(screenCoords, shader, colorBuffer, zBuffer, width, d, tiles, rates, centroid, bboxmin, bboxmax);
+	case 8: return rasterizeQuads<8, Depth, Color>(screenCoords, shader, colorBuffer, zBuffer, width, d, tiles, rates, centroid, bboxmin, bboxmax);
+	case 16: return rasterizeQuads<16, Depth, Color>(screenCoords, shader, colorBuffer, zBuffer, width, d, tiles, rates, centroid, bboxmin, bboxmax);
+	}
+	assert(!"unsupported sample count");
+	return 0;
+}
+
+// the rasterizers of every pair of formats
+#define INSTANTIATE_RASTERIZERS(Depth, Color) \
+	template unsigned triangle<Depth, Color>(Vec4f *, IShader &, Color::Type *, Depth::Type *, unsigned, unsigned, const float[][2], unsigned, \
+		const TileMask *, bool); \
+	template unsigned triangleQuads<Depth, Color>(Vec4f *, IQuadShader &, Color::Type *, Depth::Type *, unsigned, unsigned, const float[][2], unsigned, \
+		const TileMask *, const RateMap *, bool);
+INSTANTIATE_RASTERIZERS(DepthFloat32, ColorFloat32)
+INSTANTIATE_RASTERIZERS(DepthFloat32, ColorHalf16)
+INSTANTIATE_RASTERIZERS(DepthFloat32, ColorRGBA8)
+INSTANTIATE_RASTERIZERS(DepthUnorm24, ColorFloat32)
+INSTANTIATE_RASTERIZERS(DepthUnorm24, ColorHalf16)
+INSTANTIATE_RASTERIZERS(DepthUnorm24, ColorRGBA8)
+INSTANTIATE_RASTERIZERS(DepthHalf16, ColorFloat32)
+INSTANTIATE_RASTERIZERS(DepthHalf16, ColorHalf16)
+INSTANTIATE_RASTERIZERS(DepthHalf16, ColorRGBA8)
+#undef INSTANTIATE_RASTERIZERS
+template void triangleDepth<DepthFloat32>(Vec4f *, DepthFloat32::Type *, unsigned, unsigned, const float[][2], unsigned, const TileMask *);
+template void triangleDepth<DepthUnorm24>(Vec4f *, DepthUnorm24::Type *, unsigned, unsigned, const float[][2], unsigned, const TileMask *);
+template void triangleDepth<DepthHalf16>(Vec4f *, DepthHalf16::Type *, unsigned, unsigned, const float[][2], unsigned, const TileMask *);
+
 void homogeneousClip(const std::vector<Vertex> &original, std::vector<Vertex> &result, unsigned axis)
 {
 	std::vector<Vertex> intermediate;
@@ -182,5 +498,8 @@ void pushIntersection(std::vector<Vertex> &result, Vertex now, Vertex next, unsi
 	inter.normal = inter.normal * w;
 	inter.uv = now.uv + (next.uv - now.uv) * t;
 	inter.uv = inter.uv * w;
+	inter.tangent = now.tangent + (next.tangent - now.tangent) * t;
+	inter.tangent = inter.tangent * w;
+	inter.tangent.w = now.tangent.w;
 	result.push_back(inter);
 }
@@ -5,23 +5,33 @@
 #include "geometry.h"
 #include "tgaimage.h"
 #include "model.h"
+#include "framebuffer.h"
 
 // interface for shader struct
 struct IShader
 {
-	virtual Vec4f vertex(unsigned nthvert, Vec4f worldCoord, Vec2f uv, Vec3f normal) = 0;
+	virtual Vec4f vertex(unsigned nthvert, Vec4f worldCoord, Vec2f uv, Vec3f normal, Vec4f tangent) = 0;
 	virtual bool fragment(Vec3f bar, Vec3f &color) = 0;
 };
 
+// interface for shaders that also shade a 2x2 quad of pixels at once; lane i of a quad is the pixel
+// (x + i % 2, y + i / 2), the lanes whose bit is not set in mask only help the others and are not written
+struct IQuadShader : public IShader
+{
+	// returns the mask of the lanes that got a color
+	virtual unsigned fragmentQuad(const Vec3f bar[4], unsigned mask, Vec3f color[4]) = 0;
+};
+
 // struct for clipping parameter
 struct Vertex
 {
 	Vec3f normal;
 	Vec4f worldCoord, clipCoord;
 	Vec2f uv;
+	Vec4f tangent;                      // w is the handedness of the bitangent
 
-	Vertex(Vec4f worldCoord = Vec4f(), Vec4f clipCoord = Vec4f(), Vec2f uv = Vec2f(), Vec3f normal = Vec3f())
-		: worldCoord(worldCoord), clipCoord(clipCoord), uv(uv), normal(normal) {}
+	Vertex(Vec4f worldCoord = Vec4f(), Vec4f clipCoord = Vec4f(), Vec2f uv = Vec2f(), Vec3f normal = Vec3f(), Vec4f tangent = Vec4f())
+		: normal(normal), worldCoord(worldCoord), clipCoord(clipCoord), uv(uv), tangent(tangent) {}
 };
 
 // functions for viewing transformation
@@ -31,9 +41,79 @@ Matrix perspective(double n, double f);
 Matrix ortho(float l, float r, float b, float t, float n, float f);
 Matrix viewport(unsigned width, unsigned height);
 
+// functions for modeling transformation
+Matrix translation(Vec3f offset);
+Matrix scaling(Vec3f factor);
+Matrix rotation(Vec3f axis, float angle);
+
+// screen tiles a draw is restricted to, one byte per tile (non-zero: the tile is drawn)
+struct TileMask
+{
+	const unsigned char *mask;
+	unsigned tileSize, cntTileX;
+
+	bool covered(int x, int y) const { return mask[(y / tileSize) * cntTileX + x / tileSize] != 0; }
+};
+
+// coarse shading: one shading invocation for a block of x * y pixels, visibility is still resolved per sample
+struct ShadingRate
+{
+	unsigned char x, y;
+
+	ShadingRate(unsigned char x = 1, unsigned char y = 1) : x(x), y(y) {}
+};
+const unsigned MAX_RATE = 4;            // largest block of pixels shaded together, in both directions
+const unsigned MAX_SAMPLE = 16;         // most samples of a pixel, the sample counts are the powers of 2 up to it
+
+inline bool validSampleCount(unsigned cntSample) { return cntSample && cntSample <= MAX_SAMPLE && !(cntSample & (cntSample - 1)); }
+
+// shading rates of the screen tiles, or one rate for the whole screen when rates is null; the tile size
+// must be a multiple of 2 * MAX_RATE so the quads of coarse pixels never straddle two tiles
+struct RateMap
+{
+	const ShadingRate *rates;
+	unsigned tileSize, cntTileX;
+	ShadingRate uniform;
+
+	ShadingRate rate(int tx, int ty) const { return rates ? rates[ty * cntTileX + tx] : uniform; }
+};
+
 // functions for rasterization
 Vec3f barycentric(Vec2f A, Vec2f B, Vec2f C, Vec2f P);
-void triangle(Vec4f *screenCoords, IShader &shader, Vec3f *colorBuffer, float *zBuffer, unsigned width, unsigned height, const float d[][2], unsigned cntSample);
+// both return the number of shading invocations; triangleQuads walks the triangle in 2x2 quads of coarse
+// pixels and shades the covered coarse pixels of a quad with a single call. The rasterizers are instantiated
+// for every valid sample count, and for the depth and color formats of the buffers (see framebuffer.h); with
+// centroid, a pixel the triangle only partly covers is shaded at the mean of its covered samples instead of
+// its center, which may be outside of the triangle
+template <typename Depth, typename Color>
+unsigned triangle(Vec4f *screenCoords, IShader &shader, typename Color::Type *colorBuffer, typename Depth::Type *zBuffer, unsigned width, unsigned height,
+	const float d[][2], unsigned cntSample, const TileMask *tiles = nullptr, bool centroid = false);
+template <typename Depth, typename Color>
+unsigned triangleQuads(Vec4f *screenCoords, IQuadShader &shader, typename Color::Type *colorBuffer, typename Depth::Type *zBuffer, unsigned width, unsigned height,
+	const float d[][2], unsigned cntSample, const TileMask *tiles = nullptr, const RateMap *rates = nullptr, bool centroid = false);
+
+// depth-only rasterization for depth prepasses, produces the very depth values of triangle and triangleQuads
+template <typename Depth>
+void triangleDepth(Vec4f *screenCoords, typename Depth::Type *zBuffer, unsigned width, unsigned height, const float d[][2], unsigned cntSample,
+	const TileMask *tiles = nullptr);
+
+// float depth and color buffers, as the shadow maps and the depth prepasses of the culling use
+inline unsigned triangle(Vec4f *screenCoords, IShader &shader, Vec3f *colorBuffer, float *zBuffer, unsigned width, unsigned height, const float d[][2], unsigned cntSample,
+	const TileMask *tiles = nullptr, bool centroid = false)
+{
+	return triangle<DepthFloat32, ColorFloat32>(screenCoords, shader, colorBuffer, zBuffer, width, height, d, cntSample, tiles, centroid);
+}
+
+inline unsigned triangleQuads(Vec4f *screenCoords, IQuadShader &shader, Vec3f *colorBuffer, float *zBuffer, unsigned width, unsigned height, const float d[][2], unsigned cntSample,
+	const TileMask *tiles = nullptr, const RateMap *rates = nullptr, bool centroid = false)
+{
+	return triangleQuads<DepthFloat32, ColorFloat32>(screenCoords, shader, colorBuffer, zBuffer, width, height, d, cntSample, tiles, rates, centroid);
+}
+
+inline void triangleDepth(Vec4f *screenCoords, float *zBuffer, unsigned width, unsigned height, const float d[][2], unsigned cntSample, const TileMask *tiles = nullptr)
+{
+	triangleDepth<DepthFloat32>(screenCoords, zBuffer, width, height, d, cntSample, tiles);
+}
 
 // functions for clipping
 void homogeneousClip(const std::vector<Vertex> &original, std::vector<Vertex> &result, unsigned axis);
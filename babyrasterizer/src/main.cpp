@@ -1,385 +1,266 @@
-﻿#include <limits>
+﻿#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
 #include <vector>
 
 #include "tgaimage.h"
 #include "geometry.h"
 #include "model.h"
+#include "assets.h"
 #include "gl.h"
-
-struct DepthShader : public IShader
+#include "shader.h"
+#include "scene.h"
+#include "renderer.h"
+#include "server.h"
+#include "sequence.h"
+#include "progressive.h"
+#include "profiler.h"
+#include "taskgraph.h"
+
+// frame state, images and statistics of the render of a camera
+struct CameraJob
 {
-	// uniform variables
-	Matrix uVpPV;
-	// varying variables
-	mat<4, 3, float> vScreenCoords;
-
-
-	DepthShader() {}
+	FrameState state;
+	TGAImage frame, depth;
+	unsigned cntShaded;
+	float overdraw;
+	double shadingSeconds;
+	float lightsPerTile;                // -1 without a light grid
+
+	CameraJob() : state(), frame(), depth(), cntShaded(0), overdraw(0.0f), shadingSeconds(0.0), lightsPerTile(-1.0f) {}
+};
 
-	Vec4f vertex(unsigned nthvert, Vec4f worldCoord, Vec2f uv, Vec3f normal)
+// writes the stage timings and counters collected by the profiler, and the trace of the timed scopes
+static bool writeProfile(const std::string &profilePath, const std::string &tracePath)
+{
+	if (!profilePath.empty())
 	{
-		Vec4f screenCoord = uVpPV * worldCoord;
-		screenCoord = screenCoord / screenCoord[3];
-		vScreenCoords.set_col(nthvert, screenCoord);
-
-		return screenCoord;
+		std::ofstream out(profilePath);
+		if (out.fail())
+		{
+			std::cerr << "can't write " << profilePath << std::endl;
+			return false;
+		}
+		Profiler::instance().writeJson(out);
+		std::cerr << "profile written to " << profilePath << std::endl;
 	}
-
-	bool fragment(Vec3f bar, Vec3f &color)
+	if (!tracePath.empty())
 	{
-		Vec4f fragPos = vScreenCoords * bar;
-		color = Vec3f(255.0f, 255.0f, 255.0f) * powf(expf(fragPos[2]-1.0f), 4.0f);
-
-		return true;
+		std::ofstream out(tracePath);
+		if (out.fail())
+		{
+			std::cerr << "can't write " << tracePath << std::endl;
+			return false;
+		}
+		Profiler::instance().writeTrace(out);
+		std::cerr << "trace written to " << tracePath << std::endl;
 	}
-};
+	return true;
+}
 
-struct LightColor
+int main(int argc, char **argv)
 {
-	Vec3f ambient, diffuse, specular;
-
-	LightColor(Vec3f ambi = Vec3f(), Vec3f diff = Vec3f(), Vec3f spec = Vec3f())
+	typedef std::chrono::steady_clock Clock;
+
+	// parse command line arguments
+	std::string sceneFile = "./scenes/default.scene";
+	std::string socketPath;
+	unsigned cntWorker = std::max(1u, std::thread::hardware_concurrency());
+	unsigned queueSize = 16;
+	bool pipelined = true;
+	bool progressive = false;
+	std::string profilePath, tracePath;
+	for (int i = 1; i < argc; ++i)
 	{
-		ambient = ambi;
-		diffuse = diff;
-		specular = spec;
+		std::string arg = argv[i];
+		if (arg == "--server" && i + 1 < argc) socketPath = argv[++i];
+		else if (arg == "--workers" && i + 1 < argc) cntWorker = std::max(1, atoi(argv[++i]));
+		else if (arg == "--queue" && i + 1 < argc) queueSize = std::max(1, atoi(argv[++i]));
+		else if (arg == "--no-pipeline") pipelined = false;
+		else if (arg == "--progressive") progressive = true;
+		else if (arg == "--profile" && i + 1 < argc) profilePath = argv[++i];
+		else if (arg == "--trace" && i + 1 < argc) tracePath = argv[++i];
+		else if (arg[0] != '-') sceneFile = arg;
+		else
+		{
+			std::cerr << "usage: babyrasterizer [scene-file] [--server socket-path [--workers n] [--queue n]] [--no-pipeline] [--progressive] [--profile file.json] [--trace file.json]" << std::endl;
+			return 1;
+		}
 	}
-};
 
-struct Shader : public IShader
-{
-	// uniform variables
-	Model *uTexture;
-	Matrix uModel, uVpPV, uLightVpPV;
-	Vec3f uEyePos, uLightPos, uTangent, uBitangent;
-	LightColor uLightColor;
-	float *uShadowBuffer;
-	unsigned uShadowBufferWidth, uShadowBufferHeight;
-	// varying variables
-	mat<4, 3, float> vScreenCoords;
-	mat<2, 3, float> vUv;
-	mat<3, 3, float> vN;
-	mat<3, 3, float> vLightSpacePos;
-	mat<3, 3, float> vWorldCoords;
-
-
-	Shader() {}
-
-	Vec4f vertex(unsigned nthvert, Vec4f worldCoord, Vec2f uv, Vec3f normal)
+	if (!PROFILE_ENABLED && (!profilePath.empty() || !tracePath.empty()))
 	{
-		Vec4f screenCoord = uVpPV * worldCoord;
-		float w = screenCoord[3];
-
-		vWorldCoords.set_col(nthvert, proj<3>(worldCoord) / w);
-
-		screenCoord = screenCoord / w;
-		screenCoord[2] = screenCoord[2] / w;
-		screenCoord[3] = 1.0f / w;
-		vScreenCoords.set_col(nthvert, screenCoord);
-
-		Vec2f vertUv = uv / w;
-		vUv.set_col(nthvert, vertUv);
-
-		Vec3f vertN = normal / w;
-		vN.set_col(nthvert, vertN);
+		std::cerr << "built without BABYRASTERIZER_PROFILE, --profile and --trace write empty reports" << std::endl;
+	}
 
-		Vec4f temp = uLightVpPV * worldCoord;
-		temp = temp / temp.w;
-		Vec3f vertLightSpacePos = proj<3>(temp) / w;
-		vLightSpacePos.set_col(nthvert, vertLightSpacePos);
+	// parse the scene, its meshes and textures keep loading as separate jobs of the loader pool; reading and
+	// parsing the files is partly waiting on the disk, so there are a few loaders even on a single core
+	Clock::time_point start = Clock::now();
+	ThreadPool loader(std::max(4u, std::thread::hardware_concurrency()));
+	Scene scene;
+	if (!scene.load(sceneFile, &loader)) return 1;
+	std::cerr << "scene " << sceneFile << " parsed in " << std::chrono::duration<double, std::milli>(Clock::now() - start).count() << " ms" << std::endl << std::endl;
 
-		return screenCoord;
+	// serve render requests for the loaded scene
+	if (!socketPath.empty())
+	{
+		scene.waitMeshes();
+		scene.waitTextures();
+		AssetCache::instance().report(std::cerr);
+		return runServer(scene, socketPath, cntWorker, queueSize);
 	}
 
-	bool fragment(Vec3f bar, Vec3f &color)
+	// render the frames along the camera/light path of a sequence
+	if (scene.cntFrame() > 0)
 	{
-		// calculate w for perspective-correct interpolation
-		float w = (vScreenCoords * bar)[3];
-		if (fabs(w) < 1e-7) return false;
-		w = 1.0f / w;
-
-		// calculate uv for texture indexing
-		Vec2f uv = vUv * bar * w;
-
-		// calculate normal vector from tangent space
-		mat<3, 3, float> TBN;
-		TBN.set_col(0, uTangent);
-		TBN.set_col(1, uBitangent);
-		TBN.set_col(2, vN * bar * w);
-		Vec3f n = (TBN * uTexture->normal(uv)).normalize();
-		
-		// calculate direction vectors for lattter use
-		Vec3f worldCoord = vWorldCoords * bar * w;
-		Vec3f lightDir = uLightPos.normalize();
-		Vec3f eyeDir = (uEyePos - worldCoord).normalize();
-		Vec3f half = (lightDir + eyeDir) / 2.0f;
-
-		// ambient reflection
-		Vec3f materialAmbient = uTexture->diffuse(uv).rgb();
-		Vec3f ambient = uLightColor.ambient * materialAmbient;
-		
-		// diffuse reflection
-		Vec3f materialDiffuse = uTexture->diffuse(uv).rgb();
-		Vec3f diffuse = uLightColor.diffuse * (materialDiffuse * std::max(0.0f, dot(n, lightDir)));
-
-		// specular reflection
-		float materialSpecular = uTexture->specular(uv);
-		Vec3f specular = uLightColor.specular * (materialSpecular * powf(std::max(0.0f, dot(n, half)), 32.0f));
-
-		// calculate shadow
-		float shadow = 0.0f;
-		Vec3f lightSpacePos = vLightSpacePos * bar * w;
-		int cntSample = 0;
-		for (int dx = -2; dx < 2; dx++)
-		{
-			int sampleX = lightSpacePos.x + dx;
-			if (sampleX < 0 || sampleX >= uShadowBufferWidth) continue;
-			for (int dy = -2; dy < 2; dy++)
-			{
-				int sampleY = lightSpacePos.y + dy;
-				if (sampleY < 0 || sampleY >= uShadowBufferHeight) continue;
-				cntSample++;
-				if (lightSpacePos.z + 0.005f < uShadowBuffer[sampleY * uShadowBufferWidth + sampleX])
-					shadow += 1.0f;
-			}
-		}
-		shadow /= cntSample;
-
-		// Blinn-Phong lighting model
-		color = ambient + (diffuse + specular) * (1.0f - shadow);
-
-		return true;
+		scene.waitMeshes();
+		scene.waitTextures();
+		AssetCache::instance().report(std::cerr);
+		renderSequence(scene, pipelined);
+		return writeProfile(profilePath, tracePath) ? 0 : 1;
 	}
-};
-
-const float PI = acosf(-1.0f);
-
-const unsigned SCREEN_WIDTH = 800;
-const unsigned SCREEN_HEIGHT = 800;
-
-const unsigned SHADOW_WIDTH = 800;
-const unsigned SHADOW_HEIGHT = 800;
-
-const unsigned CNT_SAMPLE = 4;          // number of samples for every pixel
-const float D_MSAA[CNT_SAMPLE][2] = {   // displacements for MSAA samples
-	{0.25f, 0.25f}, {0.25f, 0.75f},
-	{0.75f, 0.25f}, {0.75f, 0.75f}
-};
-const float D_NonMSAA[1][2] = {         // displacements for non-MSAA samples
-	{0.0f, 0.0f}
-};
 
-Vec3f lightPos(1.0f, 1.0f, 1.0f);
-LightColor lightColor(Vec3f(0.3f, 0.3f, 0.3f), Vec3f(1.0f, 1.0f, 1.0f), Vec3f(0.5f, 0.5f, 0.5f));
+	// allocate buffers once for all the cameras of the scene
+	const RenderSettings &settings = scene.settings;
+	RenderContext context;
+	context.configure(settings);
 
-Vec3f eye(1.0f, 1.0f, 3.0f);
-Vec3f center(0.0f, 0.0f, 0.0f);
-Vec3f up(0.0f, 1.0f, 0.0f);
-
-Matrix shadowMapping(Model **modelData, Matrix *modelTrans, unsigned cntModel, float *zBuffer, Vec3f *colorBuffer, TGAImage &depth)
-{
-	Matrix view = lookat(lightPos, center, up);
-	Matrix project = ortho(-2.0f, 2.0f, -2.0f, 2.0f, -0.01f, -10.0f);
-	Matrix vp = viewport(SHADOW_WIDTH, SHADOW_HEIGHT);
-
-	for (unsigned m = 0; m < cntModel; ++m)
+	unsigned cntCamera = scene.cameras.size();
+	if (progressive)
 	{
-		// create shader, set uniform variables of shader
-		DepthShader depthShader;
-		depthShader.uVpPV = vp * project*view;
-
-		// rendering pipeline: calculate depth vewing from the light
-		Matrix modelInverTranspose = modelTrans[m].invert_transpose();
-		for (int i = 0; i < modelData[m]->nfaces(); ++i)
+		scene.waitMeshes();
+		scene.waitTextures();
+		AssetCache::instance().report(std::cerr);
+		// every stage is written next to the frame, "frame.tga" -> "frame_preview.tga", the last one to the frame itself
+		for (unsigned c = 0; c < cntCamera; ++c)
 		{
-			// vertex processing
-			Vec4f screenCoords[3];
-			for (int j = 0; j < 3; ++j)
+			double first = 0.0;
+			std::string framePath = numberedPath(settings.framePath, c, cntCamera);
+			double final = renderProgressive(context, scene, scene.cameras[c], scene.light,
+				[&](ProgressiveStage stage, const TGAImage &image, double ms)
 			{
-				Vec4f worldCoord = modelTrans[m] * embed<4>(modelData[m]->vert(i, j));
-				Vec2f uv = modelData[m]->uv(i, j);
-				Vec3f normal = proj<3>(modelInverTranspose * Vec4f(modelData[m]->normal(i, j), 0.0f));
-				screenCoords[j] = depthShader.vertex(j, worldCoord, uv, normal);
-			}
-
-			// ransterization + fragment processing
-			triangle(screenCoords, depthShader, colorBuffer, zBuffer, SHADOW_WIDTH, SHADOW_HEIGHT, D_NonMSAA, 1);
+				if (stage == STAGE_PREVIEW) first = ms;
+				std::string path = framePath;
+				if (stage != finalStage(settings))
+				{
+					size_t dot = path.find_last_of(".");
+					path = dot == std::string::npos ? path + "_" + stageName(stage) : path.substr(0, dot) + "_" + stageName(stage) + path.substr(dot);
+				}
+				if (!framePath.empty()) image.write_tga_file(path);
+				std::cerr << "finish " << stageName(stage) << " stage (" << ms << " ms)" << std::endl;
+			});
+			std::cerr << "camera " << c << ": time to first image " << first << " ms, time to final image " << final << " ms" << std::endl << std::endl;
 		}
+		return writeProfile(profilePath, tracePath) ? 0 : 1;
 	}
-	
-	return vp * project * view;
-}
-
-void PhongShading(Model **modelData, Matrix *modelTrans, unsigned cntModel, float *zBuffer, Vec3f *colorBuffer, Matrix lightVpPV, float *shadowBuffer, TGAImage &frame)
-{
-	Matrix view = lookat(eye, center, up);
-	Matrix project = projection(PI / 4.0f, 1.0f, -0.01f, -10.0f);
-	Matrix vp = viewport(SCREEN_WIDTH, SCREEN_HEIGHT);
-	Matrix PV = project * view;
 
-	for (unsigned m = 0; m < cntModel; ++m)
+	// the passes of every camera go into one task graph: the shadow pass and the front-end don't depend on
+	// each other, the images are written while the next camera is shaded, and the shading passes take
+	// their turns on the buffers of the context; the geometry passes only wait for the meshes, the textures
+	// keep loading until shading. Handing the textures to the models comes after the meshes, and reaches the
+	// levels of detail the front-ends may already have created
+	double meshesReady = 0.0, texturesReady = 0.0;
+	Clock::time_point firstPass = Clock::time_point::max();
+	std::mutex firstPassMutex;
+	auto startPass = [&firstPass, &firstPassMutex]()
 	{
-		// create shader, set uniform variables of shader
-		Shader PhongShader;
-		PhongShader.uTexture = modelData[m];
-		PhongShader.uModel = modelTrans[m];
-		PhongShader.uVpPV = vp * project * view;
-		PhongShader.uLightVpPV = lightVpPV;
-		PhongShader.uEyePos = eye;
-		PhongShader.uLightPos = lightPos;
-		PhongShader.uLightColor = lightColor;
-		PhongShader.uShadowBuffer = shadowBuffer;
-		PhongShader.uShadowBufferWidth = SHADOW_WIDTH;
-		PhongShader.uShadowBufferHeight = SHADOW_HEIGHT;
-
-		// rendering pipeline: calculate info for each sample
-		for (int i = 0; i < modelData[m]->nfaces(); ++i)
+		std::lock_guard<std::mutex> lock(firstPassMutex);
+		firstPass = std::min(firstPass, Clock::now());
+	};
+	std::vector<CameraJob> jobs(cntCamera);
+	TaskGraph graph;
+	graph.addPass("load meshes", {}, { "meshes" }, [&scene, &meshesReady, start]()
+	{
+		scene.waitMeshes();
+		meshesReady = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+	});
+	graph.addPass("load textures", { "meshes" }, { "textures" }, [&scene, &texturesReady, start]()
+	{
+		scene.waitTextures();
+		texturesReady = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+	});
+	for (unsigned c = 0; c < cntCamera; ++c)
+	{
+		CameraJob &job = jobs[c];
+		std::string suffix = " " + std::to_string(c);
+		graph.addPass("shadow pass" + suffix, { "meshes" }, { "shadow map" + suffix }, [&context, &scene, &job, &startPass]()
 		{
-			// back-face culling
-			Vec3f n = cross(modelData[m]->vert(i, 1) - modelData[m]->vert(i, 0), modelData[m]->vert(i, 2) - modelData[m]->vert(i, 0)).normalize();
-			n = proj<3>((view * modelTrans[m]).invert_transpose() * Vec4f(n, 0.0f));
-			if (n.z <= 0.0f) continue;
-
-			// z-axis clipping
-			Matrix modelInverTranspose = modelTrans[m].invert_transpose();
-			std::vector<Vertex> original, clipped;
-			for (int j = 0; j < 3; j++)
+			startPass();
+			context.shadowStage(scene, scene.light, job.state);
+		});
+		graph.addPass("front-end" + suffix, { "meshes" }, { "triangles" + suffix }, [&context, &scene, &job, &startPass, c]()
+		{
+			startPass();
+			context.frontEndStage(scene, scene.cameras[c], job.state);
+		});
+		if (!settings.depthPath.empty())
+		{
+			job.depth = TGAImage(settings.shadowWidth, settings.shadowHeight, TGAImage::RGB);
+			graph.addPass("depth image" + suffix, { "shadow map" + suffix }, { "depth image" + suffix }, [&context, &job]()
 			{
-				Vec4f worldCoord = modelTrans[m] * embed<4>(modelData[m]->vert(i, j));
-				Vec4f clipCoord = PV * worldCoord;
-				Vec3f normal = proj<3>(modelInverTranspose * Vec4f(modelData[m]->normal(i, j), 0.0f));
-				Vec2f uv = modelData[m]->uv(i, j);
-				Vertex vertex(worldCoord, clipCoord, uv, normal);
-				original.push_back(vertex);
-			}
-			homogeneousClip(original, clipped, 2);
-
-			// frustum culling (only z-axis)
-			if (clipped.size() < 3) continue;
-
-			// calculate the tangent and bitangent vectors for this triangle
-			mat<2, 3, float> A;
-			A[0] = proj<3>(modelTrans[m] * Vec4f(modelData[m]->vert(i, 1) - modelData[m]->vert(i, 0), 0.0f));
-			A[1] = proj<3>(modelTrans[m] * Vec4f(modelData[m]->vert(i, 2) - modelData[m]->vert(i, 0), 0.0f));
-			mat<2, 2, float> U;
-			U[0] = modelData[m]->uv(i, 1) - modelData[m]->uv(i, 0);
-			U[1] = modelData[m]->uv(i, 2) - modelData[m]->uv(i, 0);
-			mat<2, 3, float> tTB = U.invert() * A;
-			PhongShader.uTangent = tTB[0].normalize();
-			PhongShader.uBitangent = tTB[1].normalize();
-
-			// shade for each sub-triangle
-			for (size_t j = 1; j < clipped.size() - 1; ++j)
+				context.writeDepth(job.state, job.depth);
+			});
+			graph.addPass("write depth" + suffix, { "depth image" + suffix }, {}, [&settings, &job, c, cntCamera]()
 			{
-				// vertex processing
-				Vec4f screenCoords[3];
-				screenCoords[0] = PhongShader.vertex(0, clipped[0].worldCoord, clipped[0].uv, clipped[0].normal);
-				screenCoords[1] = PhongShader.vertex(1, clipped[j].worldCoord, clipped[j].uv, clipped[j].normal);
-				screenCoords[2] = PhongShader.vertex(2, clipped[j+1].worldCoord, clipped[j+1].uv, clipped[j+1].normal);
-
-				// ransterization + fragment processing
-				triangle(screenCoords, PhongShader, colorBuffer, zBuffer, SCREEN_WIDTH, SCREEN_HEIGHT, D_MSAA, CNT_SAMPLE);
-			}
+				job.depth.write_tga_file(numberedPath(settings.depthPath, c, cntCamera));
+			});
 		}
-	}
-}
-
-void writeDepth(TGAImage &depth, Vec3f *colorBuffer)
-{
-	// write depth color to TGAImage depth (for debugging)
-	for (unsigned x = 0; x < depth.get_width(); ++x)
-	{
-		for (unsigned y = 0; y < depth.get_height(); ++y)
+		graph.addPass("shading" + suffix, { "shadow map" + suffix, "triangles" + suffix, "textures" }, { "frame buffer" }, [&context, &scene, &job]()
 		{
-			Vec3f color = colorBuffer[y * depth.get_width() + x];
-			depth.set(x, y, TGAColor(color.x, color.y, color.z, 255));
-		}
-	}
-}
-
-void writeFrame(TGAImage &frame, float *zBuffer, Vec3f *colorBuffer, unsigned cntSample)
-{
-	// write shading color to TGAImage frame, average the MSAA samples for each pixel
-	for (unsigned x = 0; x < frame.get_width(); ++x)
-	{
-		for (unsigned y = 0; y < frame.get_height(); ++y)
+			Clock::time_point shadingStart = Clock::now();
+			context.shadingStage(scene, job.state);
+			job.shadingSeconds = std::chrono::duration<double>(Clock::now() - shadingStart).count();
+			job.cntShaded = context.cntShaded();
+			job.overdraw = context.overdraw();
+			const LightGrid &grid = context.lightGrid();
+			if (grid.cntTileX > 0) job.lightsPerTile = float(grid.indices.size()) / (grid.offsets.size() - 1);
+		});
+		job.frame = TGAImage(settings.width, settings.height, TGAImage::RGB);
+		graph.addPass("resolve" + suffix, { "frame buffer" }, { "frame image" + suffix }, [&context, &job]()
 		{
-			if (x == 362 && y == 417)
-				x = x;
-			Vec3f color(0.0f, 0.0f, 0.0f);
-			for (unsigned i = 0; i < cntSample; ++i)
+			context.writeFrame(job.frame);
+		});
+		if (!settings.framePath.empty())
+		{
+			graph.addPass("write frame" + suffix, { "frame image" + suffix }, {}, [&settings, &job, c, cntCamera]()
 			{
-				if (zBuffer[cntSample * (y*frame.get_width() + x) + i] > -std::numeric_limits<float>::max())
-				{
-					color = color + colorBuffer[cntSample * (y*frame.get_width() + x) + i];
-				}
-			}
-			color = color / cntSample;
-			frame.set(x, y, TGAColor(color.x, color.y, color.z, 255));
+				job.frame.write_tga_file(numberedPath(settings.framePath, c, cntCamera));
+			});
 		}
 	}
-}
+	graph.run(context.pool());
+	AssetCache::instance().report(std::cerr);
+	std::cerr << "meshes loaded after " << meshesReady << " ms, textures after " << texturesReady << " ms, first pass started after "
+		<< std::chrono::duration<double, std::milli>(firstPass - start).count() << " ms" << std::endl << std::endl;
 
-int main()
-{
-	// allocate buffers
-	float *zBuffer = new float[SCREEN_WIDTH * SCREEN_HEIGHT * CNT_SAMPLE];
-	Vec3f *colorBuffer = new Vec3f[SCREEN_WIDTH * SCREEN_HEIGHT * CNT_SAMPLE];
-	float *shadowZBuffer = new float[SCREEN_WIDTH * SCREEN_HEIGHT];
-	Vec3f *shadowColorBuffer = new Vec3f[SCREEN_WIDTH * SCREEN_HEIGHT];
-	for (int i = 0; i < SCREEN_WIDTH*SCREEN_HEIGHT; ++i)
+	for (unsigned c = 0; c < cntCamera; ++c)
 	{
-		for (int j = 0; j < CNT_SAMPLE; ++j)
+		const CameraJob &job = jobs[c];
+		std::cerr << "camera " << c << ":" << std::endl;
+		if (settings.occlusionCulling)
 		{
-			zBuffer[CNT_SAMPLE * i + j] = -std::numeric_limits<float>::max();
-			colorBuffer[CNT_SAMPLE * i + j] = Vec3f(0.0f, 0.0f, 0.0f);
+			std::cerr << "occlusion culling: " << job.state.cntOccluded << " of " << scene.cntInstance() << " instances, "
+				<< job.state.cntOccludedFaces << " triangles skipped" << std::endl;
 		}
-		shadowZBuffer[i] = -std::numeric_limits<float>::max();
-		shadowColorBuffer[i] = Vec3f(0.0f, 0.0f, 0.0f);
+		std::cerr << "levels of detail: " << job.state.cntFaces << " triangles submitted, " << job.state.cntFullFaces << " without them" << std::endl;
+		std::cerr << "finish shading (" << job.cntShaded << " shading invocations in " << job.shadingSeconds * 1e3 << " ms, "
+			<< job.cntShaded / job.shadingSeconds / 1e6 << " M/s, "
+			<< (settings.quadShading ? "2x2 quads" : "scalar") << ", overdraw " << job.overdraw
+			<< (settings.depthPrepass ? ", depth prepass" : "") << (settings.frontToBack ? ", front to back" : "") << ")" << std::endl;
+		if (!scene.lights.empty() && job.lightsPerTile >= 0.0f)
+		{
+			std::cerr << "lights: " << scene.lights.size() << ", " << job.lightsPerTile
+				<< " per tile on average" << (settings.lightCulling ? "" : " (culling off)") << std::endl;
+		}
+		std::cerr << std::endl;
 	}
-
-	// load model
-	unsigned cntModel = 2;
-	Model **modelData = new Model*[cntModel];
-	modelData[0] = new Model("./obj/african_head/african_head.obj");
-	modelData[1] = new Model("./obj/floor.obj");
+	graph.report(std::cerr);
 	std::cerr << std::endl;
-	
-	// model tansformations for each model
-	Matrix *modelTrans = new Matrix[cntModel];
-	modelTrans[0] = Matrix::identity();
-	modelTrans[1] = Matrix::identity();
-	modelTrans[1][1][3] = -0.3f;
-
-	// shadow pass
-	TGAImage depth(SCREEN_WIDTH, SCREEN_HEIGHT, TGAImage::RGB);
-	Matrix lightVpPV = shadowMapping(modelData, modelTrans, cntModel, shadowZBuffer, shadowColorBuffer, depth);
-	std::cerr << "finish shadow depth buffer calculation" << std::endl;
-	writeDepth(depth, shadowColorBuffer);
-	depth.write_tga_file("./output/depth.tga");
-	std::cerr << "finish writing depth.tga" << std::endl;
-	std::cerr << "Shadow Pass Over" << std::endl << std::endl;
-
-	// shading pass
-	TGAImage frame(SCREEN_WIDTH, SCREEN_HEIGHT, TGAImage::RGB);
-	PhongShading(modelData, modelTrans, cntModel, zBuffer, colorBuffer, lightVpPV, shadowZBuffer, frame);
-	std::cerr << "finish shading" << std::endl;
-	writeFrame(frame, zBuffer, colorBuffer, CNT_SAMPLE);
-	frame.write_tga_file("./output/frame.tga"); 
-	std::cerr << "finish writing frame.tga" << std::endl;
-	std::cerr << "Shading Pass Over" << std::endl << std::endl;
-
-	// deallocate resources
-	for (unsigned i = 0; i < cntModel; ++i)
-	{
-		delete modelData[i];
-	}
-	delete[] modelData;
-	delete[] modelTrans;
-	delete[] zBuffer;
-	delete[] colorBuffer;
-	delete[] shadowZBuffer;
-	delete[] shadowColorBuffer;
 
-	return 0;
+	return writeProfile(profilePath, tracePath) ? 0 : 1;
 }
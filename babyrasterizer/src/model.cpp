@@ -1,13 +1,20 @@
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <tuple>
+#include <queue>
+#include <functional>
 
 #include "model.h"
+#include "assets.h"
 
-Model::Model(const std::string filename) : verts_(), uv_(), norms_(), facet_vrt_(), facet_tex_(), facet_nrm_(), diffusemap_(), normalmap_(), specularmap_() {
+bool Mesh::load(const std::string filename) {
 	std::ifstream in;
 	in.open(filename, std::ifstream::in);
-	if (in.fail()) return;
+	if (in.fail()) return false;
 	std::string line;
 	while (!in.eof()) {
 		std::getline(in, line);
@@ -44,47 +51,452 @@ Model::Model(const std::string filename) : verts_(), uv_(), norms_(), facet_vrt_
 			if (3 != cnt) {
 				std::cerr << "Error: the obj file is supposed to be triangulated" << std::endl;
 				in.close();
-				return;
+				return false;
 			}
 		}
 	}
 	in.close();
-	std::cerr << "# v# " << nverts() << " f# " << nfaces() << " vt# " << uv_.size() << " vn# " << norms_.size() << std::endl;
-	load_texture(filename, "_diffuse.tga", diffusemap_);
-	load_texture(filename, "_nm_tangent.tga", normalmap_);
-	load_texture(filename, "_spec.tga", specularmap_);
+	// a truncated file leaves faces referring to what was never read
+	for (size_t i = 0; i < facet_vrt_.size(); i++) {
+		if (facet_vrt_[i] < 0 || facet_vrt_[i] >= int(verts_.size()) || facet_tex_[i] < 0 || facet_tex_[i] >= int(uv_.size())
+			|| facet_nrm_[i] < 0 || facet_nrm_[i] >= int(norms_.size())) {
+			std::cerr << "Error: a face of the obj file refers to a missing vertex" << std::endl;
+			return false;
+		}
+	}
+	compute_face_normals();
+	compute_tangents();
+	compute_bbox();
+	std::cerr << "# v# " << verts_.size() << " f# " << facet_vrt_.size() / 3 << " vt# " << uv_.size() << " vn# " << norms_.size() << std::endl;
+	return true;
+}
+
+void Mesh::compute_face_normals() {
+	int nfaces = facet_vrt_.size() / 3;
+	facet_norm_.resize(nfaces);
+	for (int i = 0; i < nfaces; i++) {
+		Vec3f v0 = verts_[facet_vrt_[i * 3]];
+		facet_norm_[i] = cross(verts_[facet_vrt_[i * 3 + 1]] - v0, verts_[facet_vrt_[i * 3 + 2]] - v0).normalize();
+	}
+}
+
+void Mesh::compute_tangents() {
+	// smoothed tangents in the spirit of MikkTSpace: the tangent of every face corner is made orthogonal
+	// to the corner normal and weighted by the corner angle; corners sharing position, uv, normal and
+	// handedness share the tangent, so the frames are split at uv seams and mirrored uvs
+	int nfaces = facet_vrt_.size() / 3;
+	std::map<std::tuple<int, int, int, bool>, int> index;
+	std::vector<Vec3f> sum;
+	tangents_.clear();
+	facet_tng_.resize(nfaces * 3);
+	for (int i = 0; i < nfaces; i++) {
+		// face tangent and bitangent: solve [T B]^T = U^-1 A
+		Vec3f e1 = verts_[facet_vrt_[i * 3 + 1]] - verts_[facet_vrt_[i * 3]];
+		Vec3f e2 = verts_[facet_vrt_[i * 3 + 2]] - verts_[facet_vrt_[i * 3]];
+		Vec2f d1 = uv_[facet_tex_[i * 3 + 1]] - uv_[facet_tex_[i * 3]];
+		Vec2f d2 = uv_[facet_tex_[i * 3 + 2]] - uv_[facet_tex_[i * 3]];
+		float det = d1.x * d2.y - d2.x * d1.y;
+		Vec3f t(1.0f, 0.0f, 0.0f), b(0.0f, 1.0f, 0.0f);
+		if (std::fabs(det) > 1e-12f) {
+			t = (e1 * d2.y - e2 * d1.y) / det;
+			b = (e2 * d1.x - e1 * d2.x) / det;
+		}
+
+		for (int j = 0; j < 3; j++) {
+			Vec3f n = norms_[facet_nrm_[i * 3 + j]];
+			bool positive = dot(cross(n, t), b) >= 0.0f;
+			std::tuple<int, int, int, bool> key(facet_vrt_[i * 3 + j], facet_tex_[i * 3 + j], facet_nrm_[i * 3 + j], positive);
+			std::map<std::tuple<int, int, int, bool>, int>::iterator it = index.find(key);
+			if (it == index.end()) {
+				it = index.insert(std::make_pair(key, int(tangents_.size()))).first;
+				tangents_.push_back(Vec4f(0.0f, 0.0f, 0.0f, positive ? 1.0f : -1.0f));
+				sum.push_back(Vec3f(0.0f, 0.0f, 0.0f));
+			}
+			facet_tng_[i * 3 + j] = it->second;
+
+			// corner angle between the two edges leaving the vertex
+			Vec3f v = verts_[facet_vrt_[i * 3 + j]];
+			Vec3f a = verts_[facet_vrt_[i * 3 + (j + 1) % 3]] - v, c = verts_[facet_vrt_[i * 3 + (j + 2) % 3]] - v;
+			float la = a.norm(), lc = c.norm();
+			if (la < 1e-12f || lc < 1e-12f) continue;
+			float angle = std::acos(std::max(-1.0f, std::min(1.0f, dot(a, c) / (la * lc))));
+			Vec3f tc = t - n * dot(n, t);
+			if (tc.norm() < 1e-12f) continue;
+			sum[it->second] = sum[it->second] + tc.normalize() * angle;
+		}
+	}
+
+	for (size_t k = 0; k < tangents_.size(); k++) {
+		Vec3f t = sum[k].norm() > 1e-12f ? sum[k].normalize() : Vec3f(1.0f, 0.0f, 0.0f);
+		tangents_[k] = Vec4f(t.x, t.y, t.z, tangents_[k].w);
+	}
+}
+
+void Mesh::compute_bbox() {
+	bboxmin_ = verts_.empty() ? Vec3f() : verts_[0];
+	bboxmax_ = bboxmin_;
+	for (const Vec3f &v : verts_) {
+		for (int j = 0; j < 3; j++) {
+			bboxmin_[j] = std::min(bboxmin_[j], v[j]);
+			bboxmax_[j] = std::max(bboxmax_[j], v[j]);
+		}
+	}
+}
+
+// sum of squared distances to a set of planes, the symmetric 4x4 matrix is stored as its upper triangle
+struct Quadric {
+	double a[10];
+
+	Quadric() { std::fill(a, a + 10, 0.0); }
+	Quadric(const Vec3f &n, const Vec3f &p, const double weight) {
+		double x = n.x, y = n.y, z = n.z, d = -(n.x * p.x + n.y * p.y + n.z * p.z);
+		double plane[10] = { x * x, x * y, x * z, x * d, y * y, y * z, y * d, z * z, z * d, d * d };
+		for (int i = 0; i < 10; i++) a[i] = plane[i] * weight;
+	}
+	void add(const Quadric &q) {
+		for (int i = 0; i < 10; i++) a[i] += q.a[i];
+	}
+	double error(const Vec3f &v) const {
+		double x = v.x, y = v.y, z = v.z;
+		return a[0] * x * x + 2 * a[1] * x * y + 2 * a[2] * x * z + 2 * a[3] * x + a[4] * y * y + 2 * a[5] * y * z + 2 * a[6] * y
+			+ a[7] * z * z + 2 * a[8] * z + a[9];
+	}
+};
+
+// collapse of the vertex from into the vertex to, to keeps its position
+struct Collapse {
+	double cost;
+	int from, to;
+	unsigned version_from, version_to;   // versions of the vertices the cost was computed with
+
+	bool operator>(const Collapse &c) const { return cost > c.cost; }
+};
+
+bool Mesh::simplify(const int target_faces, Mesh &out, float &error) const {
+	// quadric error simplification (Garland and Heckbert) by half-edge collapses onto existing vertices: the
+	// vertices on uv or normal seams and on non-manifold edges never move, so every face corner keeps
+	// attributes that belong to its position; open borders are kept by planes orthogonal to their faces
+	const int nverts = verts_.size(), nfaces = facet_vrt_.size() / 3;
+	const double BORDER_WEIGHT = 10.0;
+	std::vector<int> vrt = facet_vrt_, tex = facet_tex_, nrm = facet_nrm_;
+	std::vector<std::vector<int>> faces_of(nverts);
+	std::vector<Quadric> quadrics(nverts);
+	std::vector<char> locked(nverts, 0), removed(nverts, 0), dead(nfaces, 0);
+	std::vector<int> first_tex(nverts, -1), first_nrm(nverts, -1);
+	std::map<std::pair<int, int>, int> edges;
+	for (int i = 0; i < nfaces; i++) {
+		Vec3f n = cross(verts_[vrt[i * 3 + 1]] - verts_[vrt[i * 3]], verts_[vrt[i * 3 + 2]] - verts_[vrt[i * 3]]);
+		float len = n.norm();
+		for (int j = 0; j < 3; j++) {
+			int v = vrt[i * 3 + j];
+			faces_of[v].push_back(i);
+			if (len > 1e-12f) quadrics[v].add(Quadric(n / len, verts_[v], 1.0));
+			if (first_tex[v] < 0) { first_tex[v] = tex[i * 3 + j]; first_nrm[v] = nrm[i * 3 + j]; }
+			if (first_tex[v] != tex[i * 3 + j] || first_nrm[v] != nrm[i * 3 + j]) locked[v] = 1;
+			int a = vrt[i * 3 + j], b = vrt[i * 3 + (j + 1) % 3];
+			edges[std::make_pair(std::min(a, b), std::max(a, b))]++;
+		}
+	}
+	for (int i = 0; i < nfaces; i++) {
+		Vec3f n = cross(verts_[vrt[i * 3 + 1]] - verts_[vrt[i * 3]], verts_[vrt[i * 3 + 2]] - verts_[vrt[i * 3]]);
+		for (int j = 0; j < 3; j++) {
+			int a = vrt[i * 3 + j], b = vrt[i * 3 + (j + 1) % 3];
+			int cnt = edges[std::make_pair(std::min(a, b), std::max(a, b))];
+			if (cnt > 2) locked[a] = locked[b] = 1;
+			if (cnt != 1) continue;
+			Vec3f border = cross(verts_[b] - verts_[a], n);
+			if (border.norm() < 1e-12f) continue;
+			Quadric q(border.normalize(), verts_[a], BORDER_WEIGHT);
+			quadrics[a].add(q);
+			quadrics[b].add(q);
+		}
+	}
+
+	std::vector<unsigned> version(nverts, 0);
+	std::priority_queue<Collapse, std::vector<Collapse>, std::greater<Collapse>> heap;
+	auto push = [&](int from, int to) {
+		if (locked[from]) return;
+		Quadric q = quadrics[from];
+		q.add(quadrics[to]);
+		Collapse c = { q.error(verts_[to]), from, to, version[from], version[to] };
+		heap.push(c);
+	};
+	auto push_edges = [&](int v) {
+		for (int f : faces_of[v]) {
+			if (dead[f]) continue;
+			for (int j = 0; j < 3; j++) {
+				int u = vrt[f * 3 + j];
+				if (u == v) continue;
+				push(v, u);
+				push(u, v);
+			}
+		}
+	};
+	for (int v = 0; v < nverts; v++) push_edges(v);
+
+	int alive = nfaces;
+	double max_error = 0.0;
+	while (alive > target_faces && !heap.empty()) {
+		Collapse c = heap.top();
+		heap.pop();
+		if (removed[c.from] || removed[c.to] || version[c.from] != c.version_from || version[c.to] != c.version_to) continue;
+
+		// attributes of to on the side of from, and no face around from may flip
+		int shared = -1;
+		bool flips = false;
+		for (int f : faces_of[c.from]) {
+			if (dead[f]) continue;
+			int k = -1;
+			for (int j = 0; j < 3; j++) {
+				if (vrt[f * 3 + j] == c.to) shared = f;
+				if (vrt[f * 3 + j] == c.from) k = f * 3 + j;
+			}
+			if (shared == f) continue;
+			Vec3f p[3];
+			for (int j = 0; j < 3; j++) p[j] = verts_[vrt[f * 3 + j]];
+			Vec3f before = cross(p[1] - p[0], p[2] - p[0]);
+			p[k - f * 3] = verts_[c.to];
+			Vec3f after = cross(p[1] - p[0], p[2] - p[0]);
+			if (dot(before, after) <= 0.2f * before.norm() * after.norm()) flips = true;
+		}
+		if (shared < 0 || flips) continue;
+		int to_tex = -1, to_nrm = -1;
+		for (int j = 0; j < 3; j++) {
+			if (vrt[shared * 3 + j] != c.to) continue;
+			to_tex = tex[shared * 3 + j];
+			to_nrm = nrm[shared * 3 + j];
+		}
+
+		for (int f : faces_of[c.from]) {
+			if (dead[f]) continue;
+			bool degenerate = false;
+			for (int j = 0; j < 3; j++) degenerate = degenerate || vrt[f * 3 + j] == c.to;
+			if (degenerate) {
+				dead[f] = 1;
+				alive--;
+				continue;
+			}
+			for (int j = 0; j < 3; j++) {
+				if (vrt[f * 3 + j] != c.from) continue;
+				vrt[f * 3 + j] = c.to;
+				tex[f * 3 + j] = to_tex;
+				nrm[f * 3 + j] = to_nrm;
+			}
+			faces_of[c.to].push_back(f);
+		}
+		removed[c.from] = 1;
+		quadrics[c.to].add(quadrics[c.from]);
+		version[c.from]++;
+		version[c.to]++;
+		max_error = std::max(max_error, c.cost);
+		push_edges(c.to);
+	}
+	if (alive == nfaces) return false;
+
+	// only the vertices, uvs and normals still referenced are kept
+	std::vector<int> vert_map(nverts, -1), tex_map(uv_.size(), -1), norm_map(norms_.size(), -1);
+	for (int i = 0; i < nfaces; i++) {
+		if (dead[i]) continue;
+		for (int j = 0; j < 3; j++) {
+			int v = vrt[i * 3 + j], t = tex[i * 3 + j], n = nrm[i * 3 + j];
+			if (vert_map[v] < 0) {
+				vert_map[v] = out.verts_.size();
+				out.verts_.push_back(verts_[v]);
+			}
+			if (tex_map[t] < 0) {
+				tex_map[t] = out.uv_.size();
+				out.uv_.push_back(uv_[t]);
+			}
+			if (norm_map[n] < 0) {
+				norm_map[n] = out.norms_.size();
+				out.norms_.push_back(norms_[n]);
+			}
+			out.facet_vrt_.push_back(vert_map[v]);
+			out.facet_tex_.push_back(tex_map[t]);
+			out.facet_nrm_.push_back(norm_map[n]);
+		}
+	}
+	out.compute_face_normals();
+	out.compute_tangents();
+	out.compute_bbox();
+	error = float(std::sqrt(std::max(0.0, max_error)));
+	return true;
+}
+
+void Mesh::build_lods() const {
+	// every level halves the faces of the previous one, until too few faces are left or the seams stop it
+	const int MIN_FACES = 64;
+	lods_.clear();
+	const Mesh *prev = this;
+	int nfaces = facet_vrt_.size() / 3;
+	while (nfaces / 2 >= MIN_FACES) {
+		std::shared_ptr<Mesh> lod = std::make_shared<Mesh>();
+		float error;
+		if (!prev->simplify(nfaces / 2, *lod, error)) break;
+		int lod_faces = lod->facet_vrt_.size() / 3;
+		if (lod_faces * 4 > nfaces * 3) break;
+		lod->lod_error_ = prev->lod_error_ + error;
+		lods_.push_back(lod);
+		prev = lod.get();
+		nfaces = lod_faces;
+	}
+	if (!lods_.empty()) {
+		std::cerr << "# lods";
+		for (const std::shared_ptr<const Mesh> &lod : lods_) std::cerr << " f# " << lod->facet_vrt_.size() / 3;
+		std::cerr << std::endl;
+	}
+}
+
+const std::vector<std::shared_ptr<const Mesh>> &Mesh::lods() const {
+	std::call_once(lods_once_, [this]() { build_lods(); });
+	return lods_;
+}
+
+size_t Mesh::bytes() const {
+	size_t ret = verts_.size() * sizeof(Vec3f) + uv_.size() * sizeof(Vec2f) + norms_.size() * sizeof(Vec3f)
+		+ tangents_.size() * sizeof(Vec4f) + facet_norm_.size() * sizeof(Vec3f)
+		+ (facet_vrt_.size() + facet_tex_.size() + facet_nrm_.size() + facet_tng_.size()) * sizeof(int);
+	return ret;
+}
+
+Model::Model(const std::string filename, ThreadPool *pool) : mesh_(), diffusemap_(), normalmap_(), specularmap_(), lods_(), lods_ready_(false), lods_mutex_(),
+	pending_mesh_(), pending_textures_() {
+	pending_mesh_ = AssetCache::instance().mesh_async(filename, pool);
+	pending_textures_[0] = load_texture(filename, "_diffuse.tga", pool);
+	pending_textures_[1] = load_texture(filename, "_nm_tangent.tga", pool);
+	pending_textures_[2] = load_texture(filename, "_spec.tga", pool);
+	if (pool) return;
+	wait_mesh();
+	wait_textures();
+}
+
+void Model::wait_mesh() {
+	if (!pending_mesh_.valid()) return;
+	mesh_ = pending_mesh_.get();
+	if (!mesh_) mesh_ = std::make_shared<const Mesh>();
+	pending_mesh_ = std::shared_future<std::shared_ptr<const Mesh>>();
+}
+
+Model::Model(const Model &full, const std::shared_ptr<const Mesh> &mesh) : mesh_(mesh), diffusemap_(full.diffusemap_), normalmap_(full.normalmap_),
+	specularmap_(full.specularmap_), lods_(), lods_ready_(true), lods_mutex_(), pending_mesh_(), pending_textures_() {}
+
+void Model::make_lods() const {
+	if (lods_ready_.load(std::memory_order_acquire)) return;
+	std::lock_guard<std::mutex> lock(lods_mutex_);
+	if (lods_ready_.load(std::memory_order_relaxed)) return;
+	for (const std::shared_ptr<const Mesh> &mesh : mesh_->lods())
+		lods_.push_back(std::shared_ptr<Model>(new Model(*this, mesh)));
+	lods_ready_.store(true, std::memory_order_release);
+}
+
+void Model::wait_textures() {
+	if (!pending_textures_[0].valid()) return;
+	std::shared_ptr<const TGAImage> maps[3];
+	for (int i = 0; i < 3; i++) {
+		maps[i] = pending_textures_[i].get();
+		if (!maps[i]) maps[i] = std::make_shared<const TGAImage>();
+		pending_textures_[i] = std::shared_future<std::shared_ptr<const TGAImage>>();
+	}
+	// the levels of detail may be created meanwhile by a pass that only needs the meshes
+	std::lock_guard<std::mutex> lock(lods_mutex_);
+	diffusemap_ = maps[0];
+	normalmap_ = maps[1];
+	specularmap_ = maps[2];
+	for (const std::shared_ptr<Model> &lod : lods_) {
+		lod->diffusemap_ = diffusemap_;
+		lod->normalmap_ = normalmap_;
+		lod->specularmap_ = specularmap_;
+	}
 }
 
 int Model::nverts() const {
-	return verts_.size();
+	return mesh_->verts_.size();
 }
 
 int Model::nfaces() const {
-	return facet_vrt_.size() / 3;
+	return mesh_->facet_vrt_.size() / 3;
+}
+
+int Model::nnormals() const {
+	return mesh_->norms_.size();
+}
+
+int Model::ntangents() const {
+	return mesh_->tangents_.size();
 }
 
 Vec3f Model::vert(const int i) const {
-	return verts_[i];
+	return mesh_->verts_[i];
 }
 
 Vec3f Model::vert(const int iface, const int nthvert) const {
-	return verts_[facet_vrt_[iface * 3 + nthvert]];
+	return mesh_->verts_[mesh_->facet_vrt_[iface * 3 + nthvert]];
 }
 
-void Model::load_texture(std::string filename, const std::string suffix, TGAImage &img) {
+int Model::vert_index(const int iface, const int nthvert) const {
+	return mesh_->facet_vrt_[iface * 3 + nthvert];
+}
+
+int Model::normal_index(const int iface, const int nthvert) const {
+	return mesh_->facet_nrm_[iface * 3 + nthvert];
+}
+
+int Model::tangent_index(const int iface, const int nthvert) const {
+	return mesh_->facet_tng_[iface * 3 + nthvert];
+}
+
+Vec3f Model::face_normal(const int iface) const {
+	return mesh_->facet_norm_[iface];
+}
+
+Vec4f Model::tangent(const int i) const {
+	return mesh_->tangents_[i];
+}
+
+Vec3f Model::bbox_min() const {
+	return mesh_->bboxmin_;
+}
+
+Vec3f Model::bbox_max() const {
+	return mesh_->bboxmax_;
+}
+
+std::shared_future<std::shared_ptr<const TGAImage>> Model::load_texture(std::string filename, const std::string suffix, ThreadPool *pool) {
 	size_t dot = filename.find_last_of(".");
-	if (dot == std::string::npos) return;
+	if (dot == std::string::npos) {
+		std::promise<std::shared_ptr<const TGAImage>> empty;
+		empty.set_value(std::make_shared<const TGAImage>());
+		return empty.get_future().share();
+	}
 	std::string texfile = filename.substr(0, dot) + suffix;
-	std::cerr << "texture file " << texfile << " loading " << (img.read_tga_file(texfile.c_str()) ? "ok" : "failed") << std::endl;
-	img.flip_vertically();
+	return AssetCache::instance().texture_async(texfile, pool);
+}
+
+int Model::nlods() const {
+	make_lods();
+	return lods_.size() + 1;
+}
+
+const Model &Model::lod(const int k) const {
+	if (k == 0) return *this;
+	make_lods();
+	return *lods_[k - 1];
+}
+
+float Model::lod_error(const int k) const {
+	return lod(k).mesh_->lod_error_;
+}
+
+Vec2i Model::texture_size() const {
+	return Vec2i(diffusemap_->get_width(), diffusemap_->get_height());
 }
 
 TGAColor Model::diffuse(const Vec2f &uvf) const {
-	return diffusemap_.get(uvf[0] * diffusemap_.get_width(), uvf[1] * diffusemap_.get_height());
+	return diffusemap_->get(uvf[0] * diffusemap_->get_width(), uvf[1] * diffusemap_->get_height());
 }
 
 Vec3f Model::normal(const Vec2f &uvf) const {
-	TGAColor c = normalmap_.get(uvf[0] * normalmap_.get_width(), uvf[1] * normalmap_.get_height());
+	TGAColor c = normalmap_->get(uvf[0] * normalmap_->get_width(), uvf[1] * normalmap_->get_height());
 	Vec3f res;
 	for (int i = 0; i < 3; i++)
 		res[2 - i] = c[i] / 255. * 2 - 1;
@@ -92,13 +504,17 @@ Vec3f Model::normal(const Vec2f &uvf) const {
 }
 
 double Model::specular(const Vec2f &uvf) const {
-	return specularmap_.get(uvf[0] * specularmap_.get_width(), uvf[1] * specularmap_.get_height())[0];
+	return specularmap_->get(uvf[0] * specularmap_->get_width(), uvf[1] * specularmap_->get_height())[0];
 }
 
 Vec2f Model::uv(const int iface, const int nthvert) const {
-	return uv_[facet_tex_[iface * 3 + nthvert]];
+	return mesh_->uv_[mesh_->facet_tex_[iface * 3 + nthvert]];
 }
 
 Vec3f Model::normal(const int iface, const int nthvert) const {
-	return norms_[facet_nrm_[iface * 3 + nthvert]];
+	return mesh_->norms_[mesh_->facet_nrm_[iface * 3 + nthvert]];
+}
+
+Vec3f Model::normal(const int i) const {
+	return mesh_->norms_[i];
 }
@@ -2,31 +2,87 @@
 
 #include <vector>
 #include <string>
+#include <memory>
+#include <future>
+#include <mutex>
+#include <atomic>
 
 #include "geometry.h"
 #include "tgaimage.h"
 
-class Model {
-private:
+class ThreadPool;
+
+// geometry part of a model, shared between all the models loaded from the same obj file
+struct Mesh {
 	std::vector<Vec3f> verts_;     // array of vertices
 	std::vector<Vec2f> uv_;        // array of tex coords
 	std::vector<Vec3f> norms_;     // array of normal vectors
 	std::vector<int> facet_vrt_;
 	std::vector<int> facet_tex_;  // indices in the above arrays per triangle
 	std::vector<int> facet_nrm_;
-	TGAImage diffusemap_;         // diffuse color texture
-	TGAImage normalmap_;          // normal map texture
-	TGAImage specularmap_;        // specular map texture
-	void load_texture(const std::string filename, const std::string suffix, TGAImage &img);
+	std::vector<Vec4f> tangents_;  // array of tangent vectors, w is the handedness of the bitangent
+	std::vector<int> facet_tng_;   // tangent indices per triangle
+	std::vector<Vec3f> facet_norm_;   // local-space face normals, used for back-face culling
+	Vec3f bboxmin_, bboxmax_;         // local-space bounding box
+	float lod_error_;                 // distance this mesh may stray from the loaded one, 0 for the loaded one
+	mutable std::vector<std::shared_ptr<const Mesh>> lods_;   // chain of simplified meshes, about half the faces each, see lods()
+	mutable std::once_flag lods_once_;
+
+	Mesh() : lod_error_(0), lods_(), lods_once_() {}
+	bool load(const std::string filename);
+	void compute_face_normals();
+	void compute_tangents();
+	void compute_bbox();
+	void build_lods() const;
+	bool simplify(const int target_faces, Mesh &out, float &error) const;   // into an empty out
+	const std::vector<std::shared_ptr<const Mesh>> &lods() const;   // built by the first call, so a scene without lod selection never simplifies
+	size_t bytes() const;                                            // without the levels of detail
+};
+
+class Model {
+private:
+	std::shared_ptr<const Mesh> mesh_;              // mesh shared through the asset cache
+	std::shared_ptr<const TGAImage> diffusemap_;    // diffuse color texture
+	std::shared_ptr<const TGAImage> normalmap_;     // normal map texture
+	std::shared_ptr<const TGAImage> specularmap_;   // specular map texture
+	mutable std::vector<std::shared_ptr<Model>> lods_;   // the levels of detail of the mesh with the same textures, lod k is lods_[k - 1]
+	mutable std::atomic<bool> lods_ready_;              // lods_ is complete, created by the first nlods() or lod()
+	mutable std::mutex lods_mutex_;                     // guards the creation of lods_ and the textures handed to them
+	std::shared_future<std::shared_ptr<const Mesh>> pending_mesh_;            // valid until wait_mesh()
+	std::shared_future<std::shared_ptr<const TGAImage>> pending_textures_[3]; // diffuse, normal and specular maps, valid until wait_textures()
+	std::shared_future<std::shared_ptr<const TGAImage>> load_texture(const std::string filename, const std::string suffix, ThreadPool *pool);
+	Model(const Model &full, const std::shared_ptr<const Mesh> &mesh);   // a level of detail of full
+	void make_lods() const;
 public:
-	Model(const std::string filename);
+	// with a pool, the mesh and every texture load as jobs of the pool and the model can't be used before
+	// wait_mesh() and wait_textures(), the mesh is enough for the depth-only passes; a mesh or texture that
+	// failed to load is replaced by an empty one, so the model draws nothing or samples no texels; the two
+	// must not run at the same time. The levels of detail are created on first use, after wait_mesh(), and
+	// get the textures whenever wait_textures() hands them over
+	Model(const std::string filename, ThreadPool *pool = nullptr);
+	void wait_mesh();
+	void wait_textures();
 	int nverts() const;
 	int nfaces() const;
+	int nnormals() const;
+	int ntangents() const;
 	Vec3f normal(const int iface, const int nthvert) const;  // per triangle corner normal vertex
 	Vec3f normal(const Vec2f &uv) const;                      // fetch the normal vector from the normal map texture
+	Vec3f normal(const int i) const;
 	Vec3f vert(const int i) const;
 	Vec3f vert(const int iface, const int nthvert) const;
+	int vert_index(const int iface, const int nthvert) const;
+	int normal_index(const int iface, const int nthvert) const;
+	int tangent_index(const int iface, const int nthvert) const;
 	Vec2f uv(const int iface, const int nthvert) const;
+	Vec3f face_normal(const int iface) const;                // precomputed at load time, in model space
+	Vec4f tangent(const int i) const;                        // bitangent = w * cross(normal, tangent)
+	Vec3f bbox_min() const;
+	Vec3f bbox_max() const;
+	Vec2i texture_size() const;                              // size of the diffuse map in texels
+	int nlods() const;                                       // levels of detail, the full mesh is lod 0
+	const Model &lod(const int k) const;
+	float lod_error(const int k) const;                      // how far lod k may stray from the full mesh, in model units
 	TGAColor diffuse(const Vec2f &uv) const;
 	double specular(const Vec2f &uv) const;
 };
@@ -0,0 +1,148 @@
+#include <algorithm>
+
+#include "profiler.h"
+
+const char *profileStageName(ProfileStage stage)
+{
+	static const char *names[CNT_PROFILE_STAGE] = { "shadow_pass", "vertex_transform", "backface_cull", "clip", "raster", "fragment", "resolve", "tga_write" };
+	return names[stage];
+}
+
+const char *profileCounterName(ProfileCounter counter)
+{
+	static const char *names[CNT_PROFILE_COUNTER] = { "triangles_in", "triangles_culled", "triangles_clipped", "samples_tested", "samples_passed",
+		"fragments_shaded" };
+	return names[counter];
+}
+
+const unsigned Profiler::ACCUMULATE_PERIOD;
+
+Profiler::Profiler() : logs_(), mutex_() {}
+
+Profiler &Profiler::instance()
+{
+	static Profiler profiler;
+	return profiler;
+}
+
+// the profiler is a singleton, so a thread needs only one pointer to its log; logs outlive their threads
+thread_local Profiler::ThreadLog *Profiler::threadLog_ = nullptr;
+
+Profiler::ThreadLog &Profiler::addThread()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	logs_.emplace_back(new ThreadLog());
+	ThreadLog *log = logs_.back().get();
+	log->thread = unsigned(logs_.size() - 1);
+	for (int i = 0; i < CNT_PROFILE_STAGE; ++i)
+	{
+		log->nanoseconds[i] = 0;
+		log->calls[i] = 0;
+		log->ticks[i] = 0;
+	}
+	for (int i = 0; i < CNT_PROFILE_COUNTER; ++i)
+	{
+		log->counters[i] = 0;
+	}
+	threadLog_ = log;
+	return *log;
+}
+
+// only the owner thread writes the values of a log, so a relaxed load and store add without a locked instruction
+template <typename T>
+static void addRelaxed(std::atomic<T> &value, T n)
+{
+	value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+void Profiler::addEvent(ProfileStage stage, Clock::time_point start, Clock::time_point end)
+{
+	addTime(stage, end - start);
+	ThreadLog &log = threadLog();
+	std::lock_guard<std::mutex> lock(log.mutex);
+	Event event = { stage, log.thread, start, end };
+	log.events.push_back(event);
+}
+
+void Profiler::addTime(ProfileStage stage, Clock::duration duration, unsigned long long calls)
+{
+	ThreadLog &log = threadLog();
+	addRelaxed(log.nanoseconds[stage], (unsigned long long)std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count());
+	addRelaxed(log.calls[stage], calls);
+}
+
+void Profiler::count(ProfileCounter counter, unsigned long long n)
+{
+	addRelaxed(threadLog().counters[counter], n);
+}
+
+void Profiler::reset()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	for (const std::unique_ptr<ThreadLog> &log : logs_)
+	{
+		for (int i = 0; i < CNT_PROFILE_STAGE; ++i)
+		{
+			log->nanoseconds[i] = 0;
+			log->calls[i] = 0;
+		}
+		for (int i = 0; i < CNT_PROFILE_COUNTER; ++i)
+		{
+			log->counters[i] = 0;
+		}
+		std::lock_guard<std::mutex> eventLock(log->mutex);
+		log->events.clear();
+	}
+}
+
+template <size_t N>
+unsigned long long Profiler::total(std::atomic<unsigned long long> (ThreadLog::*values)[N], int i) const
+{
+	unsigned long long ret = 0;
+	for (const std::unique_ptr<ThreadLog> &log : logs_)
+	{
+		ret += ((*log).*values)[i].load(std::memory_order_relaxed);
+	}
+	return ret;
+}
+
+void Profiler::writeJson(std::ostream &out) const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	out << "{\n  \"stages\": {";
+	for (int i = 0; i < CNT_PROFILE_STAGE; ++i)
+	{
+		out << (i ? "," : "") << "\n    \"" << profileStageName(ProfileStage(i)) << "\": {\"calls\": " << total(&ThreadLog::calls, i)
+			<< ", \"ms\": " << total(&ThreadLog::nanoseconds, i) / 1e6 << "}";
+	}
+	out << "\n  },\n  \"counters\": {";
+	for (int i = 0; i < CNT_PROFILE_COUNTER; ++i)
+	{
+		out << (i ? "," : "") << "\n    \"" << profileCounterName(ProfileCounter(i)) << "\": " << total(&ThreadLog::counters, i);
+	}
+	unsigned long long tested = total(&ThreadLog::counters, COUNTER_SAMPLES_TESTED);
+	out << ",\n    \"depth_test_pass_rate\": " << (tested ? double(total(&ThreadLog::counters, COUNTER_SAMPLES_PASSED)) / tested : 0.0);
+	out << "\n  }\n}\n";
+}
+
+void Profiler::writeTrace(std::ostream &out) const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	std::vector<Event> events;
+	for (const std::unique_ptr<ThreadLog> &log : logs_)
+	{
+		std::lock_guard<std::mutex> eventLock(log->mutex);
+		events.insert(events.end(), log->events.begin(), log->events.end());
+	}
+	std::sort(events.begin(), events.end(), [](const Event &a, const Event &b) { return a.start < b.start; });
+	Clock::time_point first = events.empty() ? Clock::time_point() : events[0].start;
+	out << "{\"traceEvents\": [";
+	for (size_t i = 0; i < events.size(); ++i)
+	{
+		const Event &event = events[i];
+		out << (i ? "," : "") << "\n  {\"name\": \"" << profileStageName(event.stage) << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << event.thread
+			<< ", \"ts\": " << std::chrono::duration<double, std::micro>(event.start - first).count()
+			<< ", \"dur\": " << std::chrono::duration<double, std::micro>(event.end - event.start).count() << "}";
+	}
+	out << "\n], \"displayTimeUnit\": \"ms\"}\n";
+}
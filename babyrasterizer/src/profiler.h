@@ -0,0 +1,166 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+// stages of the pipeline timed by the profiler
+enum ProfileStage
+{
+	TIMER_SHADOW_PASS,
+	TIMER_VERTEX_TRANSFORM,
+	TIMER_BACKFACE_CULL,
+	TIMER_CLIP,
+	TIMER_RASTER,                       // rasterization and depth test, the fragment shader included
+	TIMER_FRAGMENT,                     // fragment shader calls of every pass, not traced one by one
+	TIMER_RESOLVE,
+	TIMER_TGA_WRITE,
+	CNT_PROFILE_STAGE
+};
+
+enum ProfileCounter
+{
+	COUNTER_TRIANGLES_IN,               // faces entering the geometry front-end
+	COUNTER_TRIANGLES_CULLED,           // back faces, and faces entirely outside of the near and far planes
+	COUNTER_TRIANGLES_CLIPPED,          // faces cut by the near or far plane
+	COUNTER_SAMPLES_TESTED,             // samples inside a triangle reaching the depth test, in every pass
+	COUNTER_SAMPLES_PASSED,
+	COUNTER_FRAGMENTS_SHADED,           // shading invocations of the main pass
+	CNT_PROFILE_COUNTER
+};
+
+const char *profileStageName(ProfileStage stage);
+const char *profileCounterName(ProfileCounter counter);
+
+// collects the time spent in every stage and the counters of the pipeline, from any thread; the time of
+// every timed scope is also kept as an event of the Chrome trace. Every thread adds to a log of its own,
+// so the threads never wait for each other; the reports sum the logs once the work is done
+class Profiler
+{
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	static Profiler &instance();
+	void addEvent(ProfileStage stage, Clock::time_point start, Clock::time_point end);
+	void addTime(ProfileStage stage, Clock::duration duration, unsigned long long calls = 1);
+	void count(ProfileCounter counter, unsigned long long n);
+	// counts a scope of ScopedAccumulator, true for the one in ACCUMULATE_PERIOD that gets timed
+	bool accumulateCall(ProfileStage stage)
+	{
+		ThreadLog &log = threadLog();
+		log.calls[stage].store(log.calls[stage].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		return log.ticks[stage]++ % ACCUMULATE_PERIOD == 0;
+	}
+	void reset();
+	// totals per stage and counters as a JSON object
+	void writeJson(std::ostream &out) const;
+	// events in the Chrome trace event format, for chrome://tracing or Perfetto, timed from the first one
+	void writeTrace(std::ostream &out) const;
+
+	static const unsigned ACCUMULATE_PERIOD = 32;
+
+private:
+	struct Event
+	{
+		ProfileStage stage;
+		unsigned thread;
+		Clock::time_point start, end;
+	};
+	// what one thread collected; only that thread adds to it, the atomics let the reports read it
+	struct ThreadLog
+	{
+		unsigned thread;
+		std::atomic<unsigned long long> nanoseconds[CNT_PROFILE_STAGE];
+		std::atomic<unsigned long long> calls[CNT_PROFILE_STAGE];
+		std::atomic<unsigned long long> counters[CNT_PROFILE_COUNTER];
+		unsigned ticks[CNT_PROFILE_STAGE];
+		std::vector<Event> events;
+		std::mutex mutex;                   // of events, only contended while a report is written
+	};
+	std::vector<std::unique_ptr<ThreadLog>> logs_;
+	mutable std::mutex mutex_;          // of logs_
+
+	Profiler();
+	Profiler(const Profiler &);
+	Profiler &operator=(const Profiler &);
+	static thread_local ThreadLog *threadLog_;
+	ThreadLog &threadLog() { return threadLog_ ? *threadLog_ : addThread(); }    // of the calling thread
+	ThreadLog &addThread();
+	template <size_t N> unsigned long long total(std::atomic<unsigned long long> (ThreadLog::*values)[N], int i) const;   // of all the logs
+};
+
+// times its scope as one event of a stage
+class ScopedTimer
+{
+public:
+	explicit ScopedTimer(ProfileStage stage) : stage_(stage), start_(Profiler::Clock::now()) {}
+	~ScopedTimer() { Profiler::instance().addEvent(stage_, start_, Profiler::Clock::now()); }
+
+private:
+	ProfileStage stage_;
+	Profiler::Clock::time_point start_;
+};
+
+// adds the time of its scope to a stage without an event, for scopes too short and too many to trace; only
+// one in ACCUMULATE_PERIOD of the scopes of a thread is timed and stands for the whole period, so reading
+// the clock doesn't make up much of what it measures
+class ScopedAccumulator
+{
+public:
+	explicit ScopedAccumulator(ProfileStage stage) : stage_(stage), timed_(Profiler::instance().accumulateCall(stage))
+	{
+		if (timed_) start_ = Profiler::Clock::now();
+	}
+	~ScopedAccumulator()
+	{
+		if (timed_) Profiler::instance().addTime(stage_, (Profiler::Clock::now() - start_) * Profiler::ACCUMULATE_PERIOD, 0);
+	}
+
+private:
+	ProfileStage stage_;
+	bool timed_;
+	Profiler::Clock::time_point start_;
+};
+
+// counts the samples of a triangle that reach the depth test and those that pass it, and adds them to the
+// counters once the triangle is done
+#ifdef BABYRASTERIZER_PROFILE
+class SampleCounter
+{
+public:
+	SampleCounter() : tested_(0), passed_(0) {}
+	~SampleCounter()
+	{
+		Profiler::instance().count(COUNTER_SAMPLES_TESTED, tested_);
+		Profiler::instance().count(COUNTER_SAMPLES_PASSED, passed_);
+	}
+	void test(bool pass) { tested_++; passed_ += pass; }
+
+private:
+	unsigned tested_, passed_;
+};
+#else
+class SampleCounter
+{
+public:
+	void test(bool /*pass*/) {}
+};
+#endif
+
+// the instrumentation compiles to nothing unless BABYRASTERIZER_PROFILE is defined
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#ifdef BABYRASTERIZER_PROFILE
+#define PROFILE_ENABLED 1
+#define PROFILE_SCOPE(stage) ScopedTimer PROFILE_CONCAT(profileTimer, __LINE__)(stage)
+#define PROFILE_ACCUMULATE(stage) ScopedAccumulator PROFILE_CONCAT(profileAccumulator, __LINE__)(stage)
+#define PROFILE_COUNT(counter, n) Profiler::instance().count(counter, n)
+#else
+#define PROFILE_ENABLED 0
+#define PROFILE_SCOPE(stage) ((void)0)
+#define PROFILE_ACCUMULATE(stage) ((void)0)
+#define PROFILE_COUNT(counter, n) ((void)0)
+#endif
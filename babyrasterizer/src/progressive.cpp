@@ -0,0 +1,72 @@
+#include <algorithm>
+#include <chrono>
+
+#include "progressive.h"
+
+const char *stageName(ProgressiveStage stage)
+{
+	static const char *names[CNT_STAGE] = { "preview", "full", "msaa", "shadows" };
+	return names[stage];
+}
+
+ProgressiveStage finalStage(const RenderSettings &settings)
+{
+	if (settings.shadows) return STAGE_SHADOWS;
+	return settings.cntSample > 1 ? STAGE_MSAA : STAGE_FULL;
+}
+
+double renderProgressive(RenderContext &context, const Scene &scene, const Camera &camera, const Light &light, const StageCallback &callback)
+{
+	typedef std::chrono::steady_clock Clock;
+	Clock::time_point start = Clock::now();
+	const RenderSettings &settings = scene.settings;
+	FrameState state;
+
+	// reduced resolution, one sample per pixel, no shadows and approximate shading math
+	RenderSettings preview = settings;
+	preview.width = std::max(1u, settings.width / PREVIEW_SCALE);
+	preview.height = std::max(1u, settings.height / PREVIEW_SCALE);
+	preview.cntSample = 1;
+	preview.shadows = false;
+	preview.fastMath = true;
+	context.configure(preview);
+	context.geometryStage(scene, camera, light, state);
+	context.shadingStage(scene, state);
+	TGAImage small(preview.width, preview.height, TGAImage::RGB);
+	context.writeFrame(small);
+	callback(STAGE_PREVIEW, small, std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+
+	// full resolution, the triangles of its geometry stage are kept for the next stages
+	RenderSettings full = preview;
+	full.width = settings.width;
+	full.height = settings.height;
+	full.fastMath = settings.fastMath;
+	context.configure(full);
+	context.geometryStage(scene, camera, light, state);
+	context.shadingStage(scene, state);
+	TGAImage frame(settings.width, settings.height, TGAImage::RGB);
+	context.writeFrame(frame);
+	callback(STAGE_FULL, frame, std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+
+	// all the samples
+	if (settings.cntSample != full.cntSample)
+	{
+		full.cntSample = settings.cntSample;
+		context.configure(full);
+		context.shadingStage(scene, state);
+		context.writeFrame(frame);
+		callback(STAGE_MSAA, frame, std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+	}
+
+	// shadows: the depth buffer is already final, only the visible fragments are shaded again
+	if (settings.shadows)
+	{
+		full.shadows = true;
+		context.configure(full);
+		context.shadowStage(scene, light, state);
+		context.shadingStage(scene, state, true);
+		context.writeFrame(frame);
+		callback(STAGE_SHADOWS, frame, std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+	}
+	return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <functional>
+
+#include "scene.h"
+#include "renderer.h"
+
+// stages of a progressive render, every stage refines the image of the previous one
+enum ProgressiveStage
+{
+	STAGE_PREVIEW,                      // 1/PREVIEW_SCALE of the resolution, one sample per pixel, no shadows, FastMath
+	STAGE_FULL,                         // full resolution
+	STAGE_MSAA,                         // all the samples of the settings, skipped without MSAA
+	STAGE_SHADOWS,                      // PCF shadows: the final image
+	CNT_STAGE
+};
+const unsigned PREVIEW_SCALE = 4;
+
+const char *stageName(ProgressiveStage stage);
+ProgressiveStage finalStage(const RenderSettings &settings);
+
+// called with the image of every finished stage and the time since the render started
+typedef std::function<void(ProgressiveStage stage, const TGAImage &image, double ms)> StageCallback;
+
+// renders one camera in stages so a first image is available long before the final one; the full
+// resolution stages share one geometry stage, and the shadow stage reuses the depth buffer of the MSAA
+// stage, so only the visible fragments are shaded again; returns the time to the final image in ms
+double renderProgressive(RenderContext &context, const Scene &scene, const Camera &camera, const Light &light, const StageCallback &callback);
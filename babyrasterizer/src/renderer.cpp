@@ -0,0 +1,1429 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "renderer.h"
+#include "profiler.h"
+
+const float D_NonMSAA[1][2] = {         // displacements for non-MSAA samples
+	{0.0f, 0.0f}
+};
+// displacements for MSAA samples, the standard rotated and sparse patterns of Direct3D (offsets from the
+// pixel center in 1/16 of a pixel, each sample on a row and a column of its own)
+const float D_MSAA2[2][2] = {
+	{0.75f, 0.75f}, {0.25f, 0.25f}
+};
+const float D_MSAA4[4][2] = {
+	{0.375f, 0.125f}, {0.875f, 0.375f}, {0.125f, 0.625f}, {0.625f, 0.875f}
+};
+const float D_MSAA8[8][2] = {
+	{0.5625f, 0.3125f}, {0.4375f, 0.6875f}, {0.8125f, 0.5625f}, {0.3125f, 0.1875f},
+	{0.1875f, 0.8125f}, {0.0625f, 0.4375f}, {0.6875f, 0.9375f}, {0.9375f, 0.0625f}
+};
+const float D_MSAA16[16][2] = {
+	{0.5625f, 0.5625f}, {0.4375f, 0.3125f}, {0.3125f, 0.625f}, {0.75f, 0.4375f},
+	{0.1875f, 0.375f}, {0.625f, 0.8125f}, {0.8125f, 0.6875f}, {0.6875f, 0.1875f},
+	{0.375f, 0.875f}, {0.5f, 0.0625f}, {0.25f, 0.125f}, {0.125f, 0.75f},
+	{0.0f, 0.5f}, {0.9375f, 0.25f}, {0.875f, 0.9375f}, {0.0625f, 0.0f}
+};
+
+const float (*samplePattern(unsigned cntSample))[2]
+{
+	switch (cntSample)
+	{
+	case 2: return D_MSAA2;
+	case 4: return D_MSAA4;
+	case 8: return D_MSAA8;
+	case 16: return D_MSAA16;
+	}
+	return D_NonMSAA;
+}
+
+static Vec3f minVec(const Vec3f &a, const Vec3f &b)
+{
+	return Vec3f(std::min(a.x, b.x), std::min(a.y, b.y), std::min(a.z, b.z));
+}
+
+static Vec3f maxVec(const Vec3f &a, const Vec3f &b)
+{
+	return Vec3f(std::max(a.x, b.x), std::max(a.y, b.y), std::max(a.z, b.z));
+}
+
+// radical inverse of n in base
+static float radicalInverse(unsigned n, unsigned base)
+{
+	float ret = 0.0f, digit = 1.0f / base;
+	for (; n > 0; n /= base, digit /= base)
+	{
+		ret += (n % base) * digit;
+	}
+	return ret;
+}
+
+Vec2f temporalJitter(unsigned nth)
+{
+	unsigned k = nth % TAA_CNT_JITTER + 1;
+	return Vec2f(radicalInverse(k, 2) - 0.5f, radicalInverse(k, 3) - 0.5f);
+}
+
+// the samples of a buffer of the context as values of a format
+template <typename Format>
+static typename Format::Type *samples(std::vector<unsigned char> &buffer)
+{
+	return reinterpret_cast<typename Format::Type *>(buffer.data());
+}
+
+template <typename Format>
+static const typename Format::Type *samples(const std::vector<unsigned char> &buffer)
+{
+	return reinterpret_cast<const typename Format::Type *>(buffer.data());
+}
+
+template <typename Depth, typename F>
+static void withColorFormat(const RenderSettings &settings, Depth depth, F f)
+{
+	switch (settings.colorFormat)
+	{
+	case COLOR_HALF16: f(depth, ColorHalf16()); break;
+	case COLOR_RGBA8: f(depth, ColorRGBA8()); break;
+	default: f(depth, ColorFloat32()); break;
+	}
+}
+
+// calls f(Depth(), Color()) with the format types of the buffers of the settings, so a generic lambda is
+// instantiated for every pair of formats
+template <typename F>
+static void withFormats(const RenderSettings &settings, F f)
+{
+	switch (settings.depthFormat)
+	{
+	case DEPTH_UNORM24: withColorFormat(settings, DepthUnorm24(), f); break;
+	case DEPTH_HALF16: withColorFormat(settings, DepthHalf16(), f); break;
+	default: withColorFormat(settings, DepthFloat32(), f); break;
+	}
+}
+
+static bool sameVec(const Vec3f &a, const Vec3f &b)
+{
+	return a.x == b.x && a.y == b.y && a.z == b.z;
+}
+
+static bool sameLight(const Light &a, const Light &b)
+{
+	return sameVec(a.pos, b.pos) && sameVec(a.color.ambient, b.color.ambient) && sameVec(a.color.diffuse, b.color.diffuse)
+		&& sameVec(a.color.specular, b.color.specular);
+}
+
+static bool sameLights(const std::vector<LightSource> &a, const std::vector<LightSource> &b)
+{
+	if (a.size() != b.size()) return false;
+	for (size_t i = 0; i < a.size(); ++i)
+	{
+		if (a[i].type != b[i].type || !sameVec(a[i].position, b[i].position) || !sameVec(a[i].direction, b[i].direction)
+			|| !sameVec(a[i].color, b[i].color) || a[i].range != b[i].range || a[i].cosInner != b[i].cosInner || a[i].cosOuter != b[i].cosOuter) return false;
+	}
+	return true;
+}
+
+static bool sameMatrix(const Matrix &a, const Matrix &b)
+{
+	for (int r = 0; r < 4; ++r)
+	{
+		for (int c = 0; c < 4; ++c)
+		{
+			if (a[r][c] != b[r][c]) return false;
+		}
+	}
+	return true;
+}
+
+static bool sameTransforms(const std::vector<Matrix> &a, const std::vector<Matrix> &b)
+{
+	if (a.size() != b.size()) return false;
+	for (size_t i = 0; i < a.size(); ++i)
+	{
+		if (!sameMatrix(a[i], b[i])) return false;
+	}
+	return true;
+}
+
+void Rect::extend(float x, float y)
+{
+	int ix0 = int(std::floor(x)), iy0 = int(std::floor(y)), ix1 = int(std::ceil(x)), iy1 = int(std::ceil(y));
+	if (empty())
+	{
+		x0 = ix0; y0 = iy0; x1 = ix1; y1 = iy1;
+		return;
+	}
+	x0 = std::min(x0, ix0); y0 = std::min(y0, iy0);
+	x1 = std::max(x1, ix1); y1 = std::max(y1, iy1);
+}
+
+Rect Rect::expanded(int margin) const
+{
+	Rect ret = *this;
+	if (empty()) return ret;
+	ret.x0 -= margin; ret.y0 -= margin;
+	ret.x1 += margin; ret.y1 += margin;
+	return ret;
+}
+
+static void transformBatch(const Model &model, const Matrix *transforms, unsigned first, unsigned cnt, const Matrix *view, const Matrix *PV, InstanceScratch &scratch,
+	ThreadPool *pool = nullptr)
+{
+	PROFILE_SCOPE(TIMER_VERTEX_TRANSFORM);
+
+	// per-instance matrices, computed once for the batch instead of once per face
+	scratch.frames.resize(cnt);
+	for (unsigned k = 0; k < cnt; ++k)
+	{
+		InstanceFrame &frame = scratch.frames[k];
+		frame.model = transforms[first + k];
+		frame.modelInverTranspose = frame.model.invert_transpose();
+		if (PV) frame.clip = (*PV) * frame.model;
+		if (view) frame.viewInverTranspose = ((*view) * frame.model).invert_transpose();
+	}
+
+	// transform every vertex, normal and tangent of the mesh once per instance, tangents are only needed for shading
+	unsigned nverts = model.nverts(), nnormals = model.nnormals(), ntangents = PV ? model.ntangents() : 0;
+	scratch.worldCoords.resize(cnt * nverts);
+	scratch.clipCoords.resize(PV ? cnt * nverts : 0);
+	scratch.normals.resize(cnt * nnormals);
+	scratch.tangents.resize(cnt * ntangents);
+	auto transformRange = [&](unsigned begin, unsigned end, unsigned /*chunk*/)
+	{
+		for (unsigned k = 0; k < cnt; ++k)
+		{
+			const InstanceFrame &frame = scratch.frames[k];
+			for (unsigned i = begin; i < std::min(end, nverts); ++i)
+			{
+				Vec4f local = embed<4>(model.vert(i));
+				scratch.worldCoords[k * nverts + i] = frame.model * local;
+				if (PV) scratch.clipCoords[k * nverts + i] = frame.clip * local;
+			}
+			for (unsigned i = begin; i < std::min(end, nnormals); ++i)
+			{
+				scratch.normals[k * nnormals + i] = proj<3>(frame.modelInverTranspose * Vec4f(model.normal(i), 0.0f));
+			}
+			for (unsigned i = begin; i < std::min(end, ntangents); ++i)
+			{
+				Vec4f tangent = model.tangent(i);
+				Vec3f t = proj<3>(frame.model * Vec4f(proj<3>(tangent), 0.0f));
+				scratch.tangents[k * ntangents + i] = Vec4f(t.x, t.y, t.z, tangent.w);
+			}
+		}
+	};
+
+	// the threads of the pool take ranges of the indices of all the arrays
+	unsigned cntIndex = std::max(nverts, std::max(nnormals, ntangents));
+	if (pool) pool->parallelFor(cntIndex, FRONT_END_GRAIN, transformRange);
+	else transformRange(0, cntIndex, 0);
+}
+
+template <typename Math>
+void drawDepthInstanced(const Model &model, const Matrix *transforms, unsigned cntInstance, DepthShaderT<Math> &shader,
+	float *zBuffer, Vec3f *colorBuffer, unsigned width, unsigned height, InstanceScratch &scratch)
+{
+	unsigned nverts = model.nverts(), nnormals = model.nnormals();
+	for (unsigned first = 0; first < cntInstance; first += INSTANCE_BATCH)
+	{
+		unsigned cnt = std::min(INSTANCE_BATCH, cntInstance - first);
+		transformBatch(model, transforms, first, cnt, nullptr, nullptr, scratch);
+
+		for (unsigned k = 0; k < cnt; ++k)
+		{
+			for (int i = 0; i < model.nfaces(); ++i)
+			{
+				// vertex processing
+				Vec4f screenCoords[3];
+				for (int j = 0; j < 3; ++j)
+				{
+					Vec4f worldCoord = scratch.worldCoords[k * nverts + model.vert_index(i, j)];
+					Vec3f normal = scratch.normals[k * nnormals + model.normal_index(i, j)];
+					screenCoords[j] = shader.vertex(j, worldCoord, model.uv(i, j), normal, Vec4f());
+				}
+
+				// ransterization + fragment processing
+				triangle(screenCoords, shader, colorBuffer, zBuffer, width, height, D_NonMSAA, 1);
+			}
+		}
+	}
+}
+
+// back-face culling and clipping of the faces [begin, end) of a batch, numbered instance by instance; each
+// stage is timed once for the whole chunk
+static void cullAndClip(const Model &model, const InstanceScratch &scratch, unsigned first, unsigned begin, unsigned end,
+	FrontEndChunk &chunk, std::vector<ClippedTriangle> &triangles)
+{
+	unsigned nfaces = model.nfaces(), nverts = model.nverts(), nnormals = model.nnormals(), ntangents = model.ntangents();
+	PROFILE_COUNT(COUNTER_TRIANGLES_IN, end - begin);
+
+	// back-face culling
+	chunk.frontFaces.clear();
+	{
+		PROFILE_SCOPE(TIMER_BACKFACE_CULL);
+		for (unsigned k = begin / nfaces; k * nfaces < end; ++k)
+		{
+			const InstanceFrame &frame = scratch.frames[k];
+			unsigned i0 = std::max(begin, k * nfaces) - k * nfaces, i1 = std::min(end, (k + 1) * nfaces) - k * nfaces;
+			for (unsigned i = i0; i < i1; ++i)
+			{
+				Vec3f n = proj<3>(frame.viewInverTranspose * Vec4f(model.face_normal(i), 0.0f));
+				if (n.z > 0.0f) chunk.frontFaces.push_back(k * nfaces + i);
+			}
+		}
+	}
+	PROFILE_COUNT(COUNTER_TRIANGLES_CULLED, (end - begin) - chunk.frontFaces.size());
+
+	PROFILE_SCOPE(TIMER_CLIP);
+	for (unsigned face : chunk.frontFaces)
+	{
+		unsigned k = face / nfaces, i = face % nfaces;
+		// z-axis clipping
+		chunk.original.clear();
+		chunk.clipped.clear();
+		for (int j = 0; j < 3; ++j)
+		{
+			unsigned vi = k * nverts + model.vert_index(i, j);
+			unsigned ni = k * nnormals + model.normal_index(i, j);
+			unsigned ti = k * ntangents + model.tangent_index(i, j);
+			chunk.original.push_back(Vertex(scratch.worldCoords[vi], scratch.clipCoords[vi], model.uv(i, j), scratch.normals[ni], scratch.tangents[ti]));
+		}
+		homogeneousClip(chunk.original, chunk.clipped, 2);
+
+		// frustum culling (only z-axis)
+		if (chunk.clipped.size() < 3)
+		{
+			PROFILE_COUNT(COUNTER_TRIANGLES_CULLED, 1);
+			continue;
+		}
+#if PROFILE_ENABLED
+		for (const Vertex &v : chunk.original)
+		{
+			if (std::abs(v.clipCoord.z) > std::abs(v.clipCoord.w))
+			{
+				PROFILE_COUNT(COUNTER_TRIANGLES_CLIPPED, 1);
+				break;
+			}
+		}
+#endif
+
+		ClippedTriangle tri;
+		tri.instance = first + k;
+
+		// split the clipped polygon into sub-triangles
+		for (size_t j = 1; j < chunk.clipped.size() - 1; ++j)
+		{
+			tri.v[0] = chunk.clipped[0];
+			tri.v[1] = chunk.clipped[j];
+			tri.v[2] = chunk.clipped[j + 1];
+			triangles.push_back(tri);
+		}
+	}
+}
+
+void processInstances(const Model &model, const Matrix *transforms, unsigned cntInstance, const Matrix &view, const Matrix &PV,
+	InstanceScratch &scratch, std::vector<ClippedTriangle> &triangles, ThreadPool *pool)
+{
+	if (pool && pool->cntThread() == 1) pool = nullptr;
+	unsigned nfaces = model.nfaces();
+	if (nfaces == 0) return;
+	for (unsigned first = 0; first < cntInstance; first += INSTANCE_BATCH)
+	{
+		unsigned cnt = std::min(INSTANCE_BATCH, cntInstance - first);
+		transformBatch(model, transforms, first, cnt, &view, &PV, scratch, pool);
+
+		// back-face culling and clipping for the whole batch
+		if (!pool)
+		{
+			scratch.chunks.resize(std::max<size_t>(scratch.chunks.size(), 1));
+			cullAndClip(model, scratch, first, 0, cnt * nfaces, scratch.chunks[0], triangles);
+			continue;
+		}
+
+		// chunks of faces are spread over the threads, every one into its own triangles, which are appended in
+		// the order of the chunks so the output is the same as with a single thread
+		unsigned cntChunk = (cnt * nfaces + FRONT_END_GRAIN - 1) / FRONT_END_GRAIN;
+		scratch.chunks.resize(std::max<size_t>(scratch.chunks.size(), cntChunk));
+		pool->parallelFor(cnt * nfaces, FRONT_END_GRAIN, [&](unsigned begin, unsigned end, unsigned c)
+		{
+			scratch.chunks[c].triangles.clear();
+			cullAndClip(model, scratch, first, begin, end, scratch.chunks[c], scratch.chunks[c].triangles);
+		});
+		for (unsigned c = 0; c < cntChunk; ++c)
+		{
+			triangles.insert(triangles.end(), scratch.chunks[c].triangles.begin(), scratch.chunks[c].triangles.end());
+		}
+	}
+}
+
+template <typename Math, typename Depth, typename Color>
+unsigned drawTriangles(const std::vector<ClippedTriangle> &triangles, const Matrix *transforms, ShaderT<Math> &shader,
+	typename Depth::Type *zBuffer, typename Color::Type *colorBuffer, unsigned width, unsigned height, const float d[][2], unsigned cntSample, bool quads,
+	const TileMask *tiles, const RateMap *rates, bool centroid)
+{
+	PROFILE_SCOPE(TIMER_RASTER);
+	unsigned cntShaded = 0;
+	for (const ClippedTriangle &tri : triangles)
+	{
+		shader.uModel = transforms[tri.instance];
+
+		// vertex processing
+		Vec4f screenCoords[3];
+		for (int j = 0; j < 3; ++j)
+		{
+			screenCoords[j] = shader.vertex(j, tri.v[j].worldCoord, tri.v[j].uv, tri.v[j].normal, tri.v[j].tangent);
+		}
+
+		// ransterization + fragment processing
+		if (quads) cntShaded += triangleQuads<Depth, Color>(screenCoords, shader, colorBuffer, zBuffer, width, height, d, cntSample, tiles, rates, centroid);
+		else cntShaded += triangle<Depth, Color>(screenCoords, shader, colorBuffer, zBuffer, width, height, d, cntSample, tiles, centroid);
+	}
+	PROFILE_COUNT(COUNTER_FRAGMENTS_SHADED, cntShaded);
+	return cntShaded;
+}
+
+template <typename Math>
+void drawInstanced(const Model &model, const Matrix *transforms, unsigned cntInstance, ShaderT<Math> &shader, const Matrix &view, const Matrix &PV,
+	float *zBuffer, Vec3f *colorBuffer, unsigned width, unsigned height, const float d[][2], unsigned cntSample, InstanceScratch &scratch)
+{
+	for (unsigned first = 0; first < cntInstance; first += INSTANCE_BATCH)
+	{
+		unsigned cnt = std::min(INSTANCE_BATCH, cntInstance - first);
+		scratch.triangles.clear();
+		processInstances(model, transforms + first, cnt, view, PV, scratch, scratch.triangles);
+		drawTriangles(scratch.triangles, transforms + first, shader, zBuffer, colorBuffer, width, height, d, cntSample);
+	}
+}
+
+template void drawDepthInstanced(const Model &, const Matrix *, unsigned, DepthShaderT<PreciseMath> &, float *, Vec3f *, unsigned, unsigned,
+	InstanceScratch &);
+template void drawDepthInstanced(const Model &, const Matrix *, unsigned, DepthShaderT<FastMath> &, float *, Vec3f *, unsigned, unsigned,
+	InstanceScratch &);
+template unsigned drawTriangles(const std::vector<ClippedTriangle> &, const Matrix *, ShaderT<PreciseMath> &, float *, Vec3f *, unsigned, unsigned,
+	const float[][2], unsigned, bool, const TileMask *, const RateMap *, bool);
+template unsigned drawTriangles(const std::vector<ClippedTriangle> &, const Matrix *, ShaderT<FastMath> &, float *, Vec3f *, unsigned, unsigned,
+	const float[][2], unsigned, bool, const TileMask *, const RateMap *, bool);
+template void drawInstanced(const Model &, const Matrix *, unsigned, ShaderT<PreciseMath> &, const Matrix &, const Matrix &, float *, Vec3f *,
+	unsigned, unsigned, const float[][2], unsigned, InstanceScratch &);
+template void drawInstanced(const Model &, const Matrix *, unsigned, ShaderT<FastMath> &, const Matrix &, const Matrix &, float *, Vec3f *,
+	unsigned, unsigned, const float[][2], unsigned, InstanceScratch &);
+
+// affine function of the screen position, through the values of an attribute at the vertices of a triangle
+struct ScreenPlane
+{
+	float a, dx, dy;                    // value at the first vertex, gradient
+
+	ScreenPlane(const Vec2f p[3], float a0, float a1, float a2)
+	{
+		Vec2f e1 = p[1] - p[0], e2 = p[2] - p[0];
+		float det = e1.x * e2.y - e2.x * e1.y;
+		a = a0;
+		dx = ((a1 - a0) * e2.y - (a2 - a0) * e1.y) / det;
+		dy = ((a2 - a0) * e1.x - (a1 - a0) * e2.x) / det;
+	}
+	float at(Vec2f p0, float x, float y) const { return a + dx * (x - p0.x) + dy * (y - p0.y); }
+};
+
+void adaptiveShadingRates(const Scene &scene, const FrameState &state, const RenderSettings &settings, std::vector<ShadingRate> &rates)
+{
+	const float ANGLE_LIMIT = 0.05f;    // radians the normal may turn across a shading invocation
+	float texelLimit = settings.rateTexels;
+	unsigned width = settings.width, height = settings.height;
+	const ShadingRate RATES[4] = { ShadingRate(1, 1), ShadingRate(2, 1), ShadingRate(2, 2), ShadingRate(4, 4) };
+	unsigned cntTileX = (width + TILE_SIZE - 1) / TILE_SIZE, cntTileY = (height + TILE_SIZE - 1) / TILE_SIZE;
+	std::vector<int> level(cntTileX * cntTileY, 3);
+	for (unsigned m = 0; m < scene.models.size(); ++m)
+	{
+		const ModelInstances &instances = scene.models[m];
+		if (instances.shadingRate.x != 0) continue;
+		Vec2i size = instances.model->texture_size();
+		for (const ClippedTriangle &tri : state.triangles[m])
+		{
+			// attributes divided by w are affine in screen space, as in perspective-correct interpolation;
+			// 1/w changes sign behind the eye
+			Vec2f p[3];
+			float invW[3], attr[5][3];
+			for (int j = 0; j < 3; ++j)
+			{
+				Vec4f screenCoord = state.VpPV * tri.v[j].worldCoord;
+				p[j] = Vec2f(screenCoord[0] / screenCoord[3], screenCoord[1] / screenCoord[3]);
+				invW[j] = 1.0f / screenCoord[3];
+				Vec3f n = tri.v[j].normal;
+				n.normalize();
+				float a[5] = { tri.v[j].uv.x * size.x, tri.v[j].uv.y * size.y, n.x, n.y, n.z };
+				for (int k = 0; k < 5; ++k)
+				{
+					attr[k][j] = a[k] * invW[j];
+				}
+			}
+			Vec2f e1 = p[1] - p[0], e2 = p[2] - p[0];
+			if (std::fabs(e1.x * e2.y - e2.x * e1.y) < 1e-6f) continue;
+			ScreenPlane D(p, invW[0], invW[1], invW[2]);
+			ScreenPlane N[5] = { ScreenPlane(p, attr[0][0], attr[0][1], attr[0][2]), ScreenPlane(p, attr[1][0], attr[1][1], attr[1][2]),
+				ScreenPlane(p, attr[2][0], attr[2][1], attr[2][2]), ScreenPlane(p, attr[3][0], attr[3][1], attr[3][2]),
+				ScreenPlane(p, attr[4][0], attr[4][1], attr[4][2]) };
+
+			// the triangle lowers the rate of every tile its bounding box touches, with the derivatives at the tile center
+			int x0 = std::max(0, int(std::min(p[0].x, std::min(p[1].x, p[2].x)))) / int(TILE_SIZE);
+			int y0 = std::max(0, int(std::min(p[0].y, std::min(p[1].y, p[2].y)))) / int(TILE_SIZE);
+			int x1 = std::min(int(cntTileX) - 1, int(std::max(p[0].x, std::max(p[1].x, p[2].x))) / int(TILE_SIZE));
+			int y1 = std::min(int(cntTileY) - 1, int(std::max(p[0].y, std::max(p[1].y, p[2].y))) / int(TILE_SIZE));
+			for (int ty = y0; ty <= y1; ++ty)
+			{
+				for (int tx = x0; tx <= x1; ++tx)
+				{
+					float cx = (tx + 0.5f) * TILE_SIZE, cy = (ty + 0.5f) * TILE_SIZE;
+					float d = D.at(p[0], cx, cy);
+					if (d * invW[0] <= 0.0f)
+					{
+						level[ty * cntTileX + tx] = 0;
+						continue;
+					}
+
+					// d(N/D) = (dN - N/D dD) / D, for the uv in texels and the normal
+					float a[5], gx[5], gy[5];
+					for (int k = 0; k < 5; ++k)
+					{
+						a[k] = N[k].at(p[0], cx, cy) / d;
+						gx[k] = (N[k].dx - a[k] * D.dx) / d;
+						gy[k] = (N[k].dy - a[k] * D.dy) / d;
+					}
+					float texelX = std::max(std::fabs(gx[0]), std::fabs(gx[1])), texelY = std::max(std::fabs(gy[0]), std::fabs(gy[1]));
+					float angleX = std::sqrt(gx[2] * gx[2] + gx[3] * gx[3] + gx[4] * gx[4]);
+					float angleY = std::sqrt(gy[2] * gy[2] + gy[3] * gy[3] + gy[4] * gy[4]);
+
+					// coarsest rate allowed along each axis, then the coarsest supported rate within both
+					int rateX = 4, rateY = 4;
+					while (rateX > 1 && (texelX * rateX > texelLimit || angleX * rateX > ANGLE_LIMIT)) rateX /= 2;
+					while (rateY > 1 && (texelY * rateY > texelLimit || angleY * rateY > ANGLE_LIMIT)) rateY /= 2;
+					int tileLevel = rateX == 4 && rateY == 4 ? 3 : rateX >= 2 && rateY >= 2 ? 2 : rateX >= 2 ? 1 : 0;
+					level[ty * cntTileX + tx] = std::min(level[ty * cntTileX + tx], tileLevel);
+				}
+			}
+		}
+	}
+
+	rates.resize(level.size());
+	for (size_t i = 0; i < level.size(); ++i)
+	{
+		rates[i] = RATES[level[i]];
+	}
+}
+
+void cullLights(const std::vector<LightSource> &lights, const FrameState &state, const RenderSettings &settings, const Vec3f *viewDepth, LightGrid &grid)
+{
+	unsigned width = settings.width, height = settings.height;
+	grid.tileSize = TILE_SIZE;
+	grid.cntTileX = (width + TILE_SIZE - 1) / TILE_SIZE;
+	grid.cntTileY = (height + TILE_SIZE - 1) / TILE_SIZE;
+	unsigned cntTile = grid.cntTileX * grid.cntTileY;
+	grid.offsets.assign(cntTile + 1, 0);
+	grid.indices.clear();
+
+	// view-space spheres of influence
+	std::vector<Vec3f> centers(lights.size());
+	for (unsigned i = 0; i < lights.size(); ++i)
+	{
+		centers[i] = proj<3>(state.view * embed<4>(lights[i].position));
+	}
+
+	// the screen position (x, y) looks along the view-space direction (slopeX(x), slopeY(y), -1)
+	float tanY = tanf(state.camera.fov / 2.0f), tanX = tanY * width / height;
+	auto slopeX = [&](float x) { return (x - (width - 1) / 2.0f) / (width / 2.0f) * tanX; };
+	auto slopeY = [&](float y) { return (y - (height - 1) / 2.0f) / (height / 2.0f) * tanY; };
+
+	for (unsigned ty = 0; ty < grid.cntTileY; ++ty)
+	{
+		for (unsigned tx = 0; tx < grid.cntTileX; ++tx)
+		{
+			unsigned tile = ty * grid.cntTileX + tx;
+			grid.offsets[tile] = grid.indices.size();
+			if (!viewDepth)
+			{
+				for (unsigned i = 0; i < lights.size(); ++i)
+				{
+					grid.indices.push_back(i);
+				}
+				continue;
+			}
+
+			// depth bounds of the tile, the pixels around it also count for the samples on the edges of its pixels
+			unsigned x0 = tx * TILE_SIZE, x1 = std::min(width, x0 + TILE_SIZE), y0 = ty * TILE_SIZE, y1 = std::min(height, y0 + TILE_SIZE);
+			float dmin = std::numeric_limits<float>::max(), dmax = 0.0f;
+			for (unsigned y = y0 > 0 ? y0 - 1 : 0; y < std::min(height, y1 + 1); ++y)
+			{
+				for (unsigned x = x0 > 0 ? x0 - 1 : 0; x < std::min(width, x1 + 1); ++x)
+				{
+					float d = viewDepth[y * width + x].x;
+					if (d <= 0.0f) continue;
+					dmin = std::min(dmin, d);
+					dmax = std::max(dmax, d);
+				}
+			}
+			if (dmax == 0.0f) continue;
+
+			// side planes of the tile frustum through the eye, the normalized normals (1, 0, a) and (0, 1, b)
+			// point to increasing x and y
+			float a0 = slopeX(float(x0)), a1 = slopeX(float(x1)), b0 = slopeY(float(y0)), b1 = slopeY(float(y1));
+			float na0 = 1.0f / std::sqrt(1.0f + a0 * a0), na1 = 1.0f / std::sqrt(1.0f + a1 * a1);
+			float nb0 = 1.0f / std::sqrt(1.0f + b0 * b0), nb1 = 1.0f / std::sqrt(1.0f + b1 * b1);
+			for (unsigned i = 0; i < lights.size(); ++i)
+			{
+				if (lights[i].type != LIGHT_DIRECTIONAL)
+				{
+					const Vec3f &c = centers[i];
+					float r = lights[i].range;
+					if (-c.z + r < dmin || -c.z - r > dmax) continue;
+					if ((c.x + a0 * c.z) * na0 < -r || (c.x + a1 * c.z) * na1 > r) continue;
+					if ((c.y + b0 * c.z) * nb0 < -r || (c.y + b1 * c.z) * nb1 > r) continue;
+				}
+				grid.indices.push_back(i);
+			}
+		}
+	}
+	grid.offsets[cntTile] = grid.indices.size();
+}
+
+RenderContext::RenderContext() : settings_(), zBuffer_(), colorBuffer_(), frame_(), history_(), cntShaded_(0), cntCovered_(0), rates_(), viewZ_(), viewDepth_(), lightGrid_(), shadowCache_(),
+	shadowMutex_(), pool_(), temporal_()
+{
+	settings_.width = settings_.height = settings_.shadowWidth = settings_.shadowHeight = 0;
+}
+
+void RenderContext::configure(const RenderSettings &settings)
+{
+	settings_ = settings;
+	size_t cntSample = size_t(settings.width) * settings.height * settings.cntSample;
+	if (zBuffer_.size() != cntSample * depthBytes(settings.depthFormat) || colorBuffer_.size() != cntSample * colorBytes(settings.colorFormat))
+	{
+		zBuffer_.resize(cntSample * depthBytes(settings.depthFormat));
+		colorBuffer_.resize(cntSample * colorBytes(settings.colorFormat));
+	}
+	unsigned cntThread = settings.cntThread ? settings.cntThread : std::max(1u, std::thread::hardware_concurrency());
+	if (!pool_ || pool_->cntThread() != cntThread) pool_.reset(new ThreadPool(cntThread));
+}
+
+std::shared_ptr<ShadowMap> RenderContext::acquireShadowMap() const
+{
+	// a map only referenced by the pool is neither cached nor read by a frame in flight
+	for (std::shared_ptr<ShadowMap> &map : shadowCache_.pool)
+	{
+		if (map.use_count() == 1 && map != shadowCache_.base && map != shadowCache_.full) return map;
+	}
+	shadowCache_.pool.push_back(std::make_shared<ShadowMap>());
+	return shadowCache_.pool.back();
+}
+
+template <typename Math>
+void RenderContext::drawShadowCasters(const Scene &scene, bool dynamic, ShadowMap &map, InstanceScratch &scratch) const
+{
+	DepthShaderT<Math> depthShader;
+	depthShader.uVpPV = map.lightVpPV;
+	for (const ModelInstances &instances : scene.models)
+	{
+		if (instances.dynamic != dynamic) continue;
+		drawDepthInstanced(*instances.model, instances.transforms.data(), instances.transforms.size(), depthShader,
+			map.zBuffer.data(), map.colorBuffer.data(), settings_.shadowWidth, settings_.shadowHeight, scratch);
+	}
+}
+
+std::shared_ptr<const ShadowMap> RenderContext::shadowPass(const Scene &scene, const Light &light, InstanceScratch &scratch) const
+{
+	PROFILE_SCOPE(TIMER_SHADOW_PASS);
+	std::lock_guard<std::mutex> lock(shadowMutex_);
+	ShadowCache &cache = shadowCache_;
+
+	// find out what moved since the cached maps were rendered
+	bool rebuild = !settings_.shadowCache || !cache.valid || cache.width != settings_.shadowWidth || cache.height != settings_.shadowHeight
+		|| cache.lightPos.x != light.pos.x || cache.lightPos.y != light.pos.y || cache.lightPos.z != light.pos.z
+		|| cache.transforms.size() != scene.models.size();
+	bool redraw = false;
+	for (unsigned m = 0; !rebuild && m < scene.models.size(); ++m)
+	{
+		bool moved = !sameTransforms(scene.models[m].transforms, cache.transforms[m]);
+		if (moved && scene.models[m].dynamic) redraw = true;
+		else if (moved) rebuild = true;
+	}
+	if (!rebuild && !redraw)
+	{
+		cache.hits++;
+		return cache.full;
+	}
+
+	// static casters: rendered from scratch into the base map
+	bool hasDynamic = false;
+	for (const ModelInstances &instances : scene.models)
+	{
+		hasDynamic = hasDynamic || instances.dynamic;
+	}
+	size_t cntShadow = size_t(settings_.shadowWidth) * settings_.shadowHeight;
+	if (rebuild)
+	{
+		Matrix lightView = lookat(light.pos, Vec3f(0.0f, 0.0f, 0.0f), Vec3f(0.0f, 1.0f, 0.0f));
+		Matrix lightProject = ortho(-2.0f, 2.0f, -2.0f, 2.0f, -0.01f, -10.0f);
+		Matrix lightVp = viewport(settings_.shadowWidth, settings_.shadowHeight);
+		cache.base = nullptr;
+		cache.full = nullptr;
+		std::shared_ptr<ShadowMap> base = acquireShadowMap();
+		base->lightVpPV = lightVp * lightProject * lightView;
+		base->zBuffer.assign(cntShadow, -std::numeric_limits<float>::max());
+		base->colorBuffer.assign(cntShadow, Vec3f(0.0f, 0.0f, 0.0f));
+		if (settings_.fastMath) drawShadowCasters<FastMath>(scene, false, *base, scratch);
+		else drawShadowCasters<PreciseMath>(scene, false, *base, scratch);
+		cache.base = base;
+		cache.rebuilds++;
+	}
+	else cache.redraws++;
+
+	// dynamic casters: drawn on top of a copy of the base map
+	if (hasDynamic)
+	{
+		cache.full = nullptr;
+		std::shared_ptr<ShadowMap> full = acquireShadowMap();
+		*full = *cache.base;
+		if (settings_.fastMath) drawShadowCasters<FastMath>(scene, true, *full, scratch);
+		else drawShadowCasters<PreciseMath>(scene, true, *full, scratch);
+		cache.full = full;
+	}
+	else cache.full = cache.base;
+
+	cache.valid = true;
+	cache.lightPos = light.pos;
+	cache.width = settings_.shadowWidth;
+	cache.height = settings_.shadowHeight;
+	cache.transforms.resize(scene.models.size());
+	for (unsigned m = 0; m < scene.models.size(); ++m)
+	{
+		cache.transforms[m] = scene.models[m].transforms;
+	}
+	return cache.full;
+}
+
+void RenderContext::shadowStage(const Scene &scene, const Light &light, FrameState &state) const
+{
+	// shadow pass: calculate depth vewing from the light, or reuse the cached shadow map
+	state.light = light;
+	state.shadow = nullptr;
+	if (settings_.shadows) state.shadow = shadowPass(scene, light, state.shadowScratch);
+}
+
+// footprint of the bounding box of an instance in a coarse buffer, and the view-space depth of its nearest
+// corner; false when the box reaches the near plane
+static bool instanceBounds(const Model &model, const Matrix &transform, const Matrix &view, const Matrix &VpPV, Rect &rect, float &nearest)
+{
+	Vec3f bmin = model.bbox_min(), bmax = model.bbox_max();
+	rect = Rect();
+	nearest = std::numeric_limits<float>::max();
+	for (int corner = 0; corner < 8; ++corner)
+	{
+		Vec4f p = transform * embed<4>(Vec3f(corner & 1 ? bmax.x : bmin.x, corner & 2 ? bmax.y : bmin.y, corner & 4 ? bmax.z : bmin.z));
+		float depth = -(view * p)[2];
+		if (depth <= 0.01f) return false;
+		nearest = std::min(nearest, depth);
+		Vec4f screenCoord = VpPV * p;
+		rect.extend(screenCoord[0] / screenCoord[3], screenCoord[1] / screenCoord[3]);
+	}
+	return true;
+}
+
+static bool occluded(const OcclusionBuffer &buffer, const Rect &rect, float nearest)
+{
+	for (int y = rect.y0; y <= rect.y1; ++y)
+	{
+		for (int x = rect.x0; x <= rect.x1; ++x)
+		{
+			if (buffer.farthest[y * buffer.width + x] >= nearest) return false;
+		}
+	}
+	return true;
+}
+
+// coarsest level of detail of an instance whose error, seen from the nearest corner of its bounding box,
+// stays under maxPixels; pixelsPerUnit is the size on the screen of a unit at distance 1
+static int selectLod(const Model &model, const Matrix &transform, const Matrix &view, float pixelsPerUnit, float maxPixels)
+{
+	if (maxPixels <= 0.0f || model.nlods() == 1) return 0;
+	Vec3f bmin = model.bbox_min(), bmax = model.bbox_max();
+	float nearest = std::numeric_limits<float>::max();
+	for (int corner = 0; corner < 8; ++corner)
+	{
+		Vec4f p = transform * embed<4>(Vec3f(corner & 1 ? bmax.x : bmin.x, corner & 2 ? bmax.y : bmin.y, corner & 4 ? bmax.z : bmin.z));
+		nearest = std::min(nearest, -(view * p)[2]);
+	}
+	if (nearest <= 0.01f) return 0;
+
+	float scale = 0.0f;
+	for (int j = 0; j < 3; ++j)
+	{
+		scale = std::max(scale, Vec3f(transform[0][j], transform[1][j], transform[2][j]).norm());
+	}
+	int lod = 0;
+	while (lod + 1 < model.nlods() && model.lod_error(lod + 1) * scale * pixelsPerUnit / nearest <= maxPixels) ++lod;
+	return lod;
+}
+
+void RenderContext::cullOccluded(const Scene &scene, FrameState &state) const
+{
+	OcclusionBuffer &buffer = state.occlusion;
+	buffer.width = OCCLUSION_WIDTH;
+	buffer.height = std::max(1u, OCCLUSION_WIDTH * settings_.height / settings_.width);
+	buffer.zBuffer.assign(buffer.width * buffer.height, -std::numeric_limits<float>::max());
+	buffer.depth.assign(buffer.width * buffer.height, Vec3f(0.0f, 0.0f, 0.0f));
+	buffer.farthest.assign(buffer.width * buffer.height, std::numeric_limits<float>::infinity());
+	Matrix VpPV = viewport(buffer.width, buffer.height) * state.PV;
+	Rect screen;
+	screen.x0 = screen.y0 = 0;
+	screen.x1 = buffer.width - 1;
+	screen.y1 = buffer.height - 1;
+
+	// footprints of the instances, the ones off the screen are skipped right away
+	struct Candidate
+	{
+		unsigned model, instance;
+		Rect rect;
+		float nearest;
+		bool occluder;
+	};
+	std::vector<Candidate> candidates;
+	for (unsigned m = 0; m < scene.models.size(); ++m)
+	{
+		const ModelInstances &instances = scene.models[m];
+		for (unsigned i = 0; i < instances.transforms.size(); ++i)
+		{
+			Candidate c;
+			c.model = m;
+			c.instance = i;
+			if (!instanceBounds(*instances.model, instances.transforms[i], state.view, VpPV, c.rect, c.nearest)) continue;
+			if (!c.rect.overlaps(screen))
+			{
+				state.visible[m][i] = 0;
+				continue;
+			}
+			c.rect.x0 = std::max(c.rect.x0, 0); c.rect.y0 = std::max(c.rect.y0, 0);
+			c.rect.x1 = std::min(c.rect.x1, screen.x1); c.rect.y1 = std::min(c.rect.y1, screen.y1);
+			c.occluder = (c.rect.x1 - c.rect.x0 + 1) * (c.rect.y1 - c.rect.y0 + 1) * 64 >= int(buffer.width * buffer.height);
+			candidates.push_back(c);
+		}
+	}
+	std::sort(candidates.begin(), candidates.end(), [](const Candidate &a, const Candidate &b) { return a.nearest < b.nearest; });
+
+	// the large instances are drawn front to back as occluders, each one tested against the nearer ones
+	ViewDepthShader shader;
+	shader.uVpPV = VpPV;
+	shader.uView = state.view;
+	for (const Candidate &c : candidates)
+	{
+		if (!c.occluder) continue;
+		if (occluded(buffer, c.rect, c.nearest))
+		{
+			state.visible[c.model][c.instance] = 0;
+			continue;
+		}
+
+		const ModelInstances &instances = scene.models[c.model];
+		state.scratch.triangles.clear();
+		processInstances(*instances.model, instances.transforms.data() + c.instance, 1, state.view, state.PV, state.scratch, state.scratch.triangles);
+		for (const ClippedTriangle &tri : state.scratch.triangles)
+		{
+			Vec4f screenCoords[3];
+			for (int j = 0; j < 3; ++j)
+			{
+				screenCoords[j] = shader.vertex(j, tri.v[j].worldCoord, tri.v[j].uv, tri.v[j].normal, tri.v[j].tangent);
+			}
+			triangle(screenCoords, shader, buffer.depth.data(), buffer.zBuffer.data(), buffer.width, buffer.height, D_NonMSAA, 1);
+		}
+
+		// a pixel is fully covered when the centers of its neighbours are, as long as the occluders are watertight
+		Rect dirty = c.rect.expanded(1);
+		for (int y = std::max(dirty.y0, 0); y <= std::min(dirty.y1, screen.y1); ++y)
+		{
+			for (int x = std::max(dirty.x0, 0); x <= std::min(dirty.x1, screen.x1); ++x)
+			{
+				float farthest = 0.0f;
+				for (int dy = -1; dy <= 1 && farthest < std::numeric_limits<float>::infinity(); ++dy)
+				{
+					for (int dx = -1; dx <= 1; ++dx)
+					{
+						int nx = x + dx, ny = y + dy;
+						float depth = nx < 0 || ny < 0 || nx > screen.x1 || ny > screen.y1 ? 0.0f : buffer.depth[ny * buffer.width + nx].x;
+						farthest = depth > 0.0f ? std::max(farthest, depth) : std::numeric_limits<float>::infinity();
+						if (depth <= 0.0f) break;
+					}
+				}
+				buffer.farthest[y * buffer.width + x] = farthest;
+			}
+		}
+	}
+
+	// the other instances are only tested
+	for (const Candidate &c : candidates)
+	{
+		if (!c.occluder && occluded(buffer, c.rect, c.nearest)) state.visible[c.model][c.instance] = 0;
+	}
+}
+
+void RenderContext::geometryStage(const Scene &scene, const Camera &camera, const Light &light, FrameState &state, Vec2f jitter) const
+{
+	shadowStage(scene, light, state);
+	frontEndStage(scene, camera, state, jitter);
+}
+
+void RenderContext::frontEndStage(const Scene &scene, const Camera &camera, FrameState &state, Vec2f jitter) const
+{
+	// geometry front-end of the main pass; the jitter only moves the samples, clipping and culling keep the
+	// frustum without it
+	state.camera = camera;
+	state.view = lookat(camera.eye, camera.center, camera.up);
+	Matrix project = projection(camera.fov, float(settings_.width) / settings_.height, -0.01f, -10.0f);
+	state.PV = project * state.view;
+	state.VpPV = viewport(settings_.width, settings_.height) * project * state.view;
+	if (jitter.x != 0.0f || jitter.y != 0.0f) state.VpPV = translation(Vec3f(jitter.x, jitter.y, 0.0f)) * state.VpPV;
+	state.triangles.resize(scene.models.size());
+	state.visible.resize(scene.models.size());
+	for (unsigned m = 0; m < scene.models.size(); ++m)
+	{
+		state.visible[m].assign(scene.models[m].transforms.size(), 1);
+	}
+	if (settings_.occlusionCulling) cullOccluded(scene, state);
+
+	state.cntOccluded = state.cntOccludedFaces = 0;
+	state.cntFaces = state.cntFullFaces = 0;
+	float pixelsPerUnit = settings_.height / (2.0f * tanf(camera.fov / 2.0f));
+	std::vector<int> lods;
+	for (unsigned m = 0; m < scene.models.size(); ++m)
+	{
+		// runs of visible instances with the same level of detail go through the front-end together
+		const ModelInstances &instances = scene.models[m];
+		state.triangles[m].clear();
+		lods.resize(instances.transforms.size());
+		for (unsigned i = 0; i < instances.transforms.size(); ++i)
+		{
+			lods[i] = selectLod(*instances.model, instances.transforms[i], state.view, pixelsPerUnit, settings_.lodPixels);
+		}
+		for (unsigned first = 0; first < instances.transforms.size(); )
+		{
+			if (!state.visible[m][first])
+			{
+				++state.cntOccluded;
+				state.cntOccludedFaces += instances.model->nfaces();
+				++first;
+				continue;
+			}
+			unsigned last = first;
+			while (last < instances.transforms.size() && state.visible[m][last] && lods[last] == lods[first]) ++last;
+			const Model &model = instances.model->lod(lods[first]);
+			state.cntFaces += (last - first) * model.nfaces();
+			state.cntFullFaces += (last - first) * instances.model->nfaces();
+			size_t begin = state.triangles[m].size();
+			processInstances(model, instances.transforms.data() + first, last - first, state.view, state.PV,
+				state.scratch, state.triangles[m], pool_.get());
+			for (size_t t = begin; t < state.triangles[m].size(); ++t)
+			{
+				state.triangles[m][t].instance += first;
+			}
+			first = last;
+		}
+	}
+
+	// front to back: the models by their nearest instance, and the instances of every model, by the depth of
+	// the center of their bounding box
+	state.modelOrder.resize(scene.models.size());
+	for (unsigned m = 0; m < scene.models.size(); ++m)
+	{
+		state.modelOrder[m] = m;
+	}
+	if (!settings_.frontToBack) return;
+	std::vector<float> nearest(scene.models.size(), std::numeric_limits<float>::max());
+	std::vector<float> depth;
+	for (unsigned m = 0; m < scene.models.size(); ++m)
+	{
+		const ModelInstances &instances = scene.models[m];
+		Vec4f center = embed<4>((instances.model->bbox_min() + instances.model->bbox_max()) / 2.0f);
+		depth.resize(instances.transforms.size());
+		for (unsigned i = 0; i < instances.transforms.size(); ++i)
+		{
+			depth[i] = -(state.view * (instances.transforms[i] * center))[2];
+			if (state.visible[m][i]) nearest[m] = std::min(nearest[m], depth[i]);
+		}
+		std::stable_sort(state.triangles[m].begin(), state.triangles[m].end(),
+			[&depth](const ClippedTriangle &a, const ClippedTriangle &b) { return depth[a.instance] < depth[b.instance]; });
+	}
+	std::stable_sort(state.modelOrder.begin(), state.modelOrder.end(), [&nearest](unsigned a, unsigned b) { return nearest[a] < nearest[b]; });
+}
+
+void RenderContext::markTiles(const Rect &rect)
+{
+	if (rect.empty()) return;
+	unsigned cntTileX = (settings_.width + TILE_SIZE - 1) / TILE_SIZE, cntTileY = (settings_.height + TILE_SIZE - 1) / TILE_SIZE;
+	int x0 = std::max(0, rect.x0) / TILE_SIZE, y0 = std::max(0, rect.y0) / TILE_SIZE;
+	int x1 = std::min(int(settings_.width) - 1, rect.x1), y1 = std::min(int(settings_.height) - 1, rect.y1);
+	if (x1 < 0 || y1 < 0) return;
+	for (unsigned ty = y0; ty <= std::min(cntTileY - 1, unsigned(y1) / TILE_SIZE); ++ty)
+	{
+		for (unsigned tx = x0; tx <= std::min(cntTileX - 1, unsigned(x1) / TILE_SIZE); ++tx)
+		{
+			history_.tileMask[ty * cntTileX + tx] = 1;
+		}
+	}
+}
+
+void RenderContext::shadingStage(const Scene &scene, const FrameState &state, bool keepDepth)
+{
+	FrameHistory &history = history_;
+	unsigned cntTileX = (settings_.width + TILE_SIZE - 1) / TILE_SIZE, cntTileY = (settings_.height + TILE_SIZE - 1) / TILE_SIZE;
+	unsigned cntTile = cntTileX * cntTileY;
+
+	// footprints of the instances on the screen and in the shadow map
+	std::vector<std::vector<Rect>> screenBounds(scene.models.size()), lightBounds(scene.models.size());
+	for (unsigned m = 0; m < scene.models.size(); ++m)
+	{
+		const ModelInstances &instances = scene.models[m];
+		screenBounds[m].assign(instances.transforms.size(), Rect());
+		for (const ClippedTriangle &tri : state.triangles[m])
+		{
+			for (int j = 0; j < 3; ++j)
+			{
+				Vec4f screenCoord = state.VpPV * tri.v[j].worldCoord;
+				screenBounds[m][tri.instance].extend(screenCoord[0] / screenCoord[3], screenCoord[1] / screenCoord[3]);
+			}
+		}
+		lightBounds[m].assign(instances.transforms.size(), Rect());
+		if (!state.shadow) continue;
+		Vec3f bmin = instances.model->bbox_min(), bmax = instances.model->bbox_max();
+		for (unsigned i = 0; i < instances.transforms.size(); ++i)
+		{
+			Matrix lightClip = state.shadow->lightVpPV * instances.transforms[i];
+			for (int corner = 0; corner < 8; ++corner)
+			{
+				Vec3f p(corner & 1 ? bmax.x : bmin.x, corner & 2 ? bmax.y : bmin.y, corner & 4 ? bmax.z : bmin.z);
+				Vec4f lightCoord = lightClip * embed<4>(p);
+				lightBounds[m][i].extend(lightCoord[0] / lightCoord[3], lightCoord[1] / lightCoord[3]);
+			}
+		}
+	}
+
+	// the buffers of the last frame are kept when nothing but some instances changed since then
+	bool incremental = settings_.incremental && !keepDepth && history.valid && sameImageSettings(history.settings, settings_)
+		&& history.shadows == (state.shadow != nullptr)
+		&& history.transforms.size() == scene.models.size()
+		&& sameVec(history.camera.eye, state.camera.eye) && sameVec(history.camera.center, state.camera.center)
+		&& sameVec(history.camera.up, state.camera.up) && history.camera.fov == state.camera.fov
+		&& sameLight(history.light, state.light) && sameLights(history.lights, scene.lights);
+	for (unsigned m = 0; incremental && m < scene.models.size(); ++m)
+	{
+		incremental = history.transforms[m].size() == scene.models[m].transforms.size()
+			&& history.shadingRates[m].x == scene.models[m].shadingRate.x && history.shadingRates[m].y == scene.models[m].shadingRate.y;
+	}
+
+	history.tileMask.assign(cntTile, incremental ? 0 : 1);
+	if (incremental)
+	{
+		// the old and new footprints of the moved instances, and the shadow regions they left or entered;
+		// the shadow regions grow by the reach of the PCF kernel
+		std::vector<Rect> shadowRegions;
+		for (unsigned m = 0; m < scene.models.size(); ++m)
+		{
+			for (unsigned i = 0; i < scene.models[m].transforms.size(); ++i)
+			{
+				if (sameMatrix(scene.models[m].transforms[i], history.transforms[m][i])) continue;
+				markTiles(history.screenBounds[m][i].expanded(1));
+				markTiles(screenBounds[m][i].expanded(1));
+				shadowRegions.push_back(history.lightBounds[m][i].expanded(3));
+				shadowRegions.push_back(lightBounds[m][i].expanded(3));
+			}
+		}
+
+		// receivers of the shadows that changed
+		for (unsigned m = 0; !shadowRegions.empty() && m < scene.models.size(); ++m)
+		{
+			for (unsigned i = 0; i < scene.models[m].transforms.size(); ++i)
+			{
+				for (const Rect &region : shadowRegions)
+				{
+					if (!lightBounds[m][i].overlaps(region)) continue;
+					markTiles(screenBounds[m][i].expanded(1));
+					break;
+				}
+			}
+		}
+	}
+
+	history.cntTile = cntTile;
+	history.cntDirtyTile = 0;
+	for (unsigned char dirty : history.tileMask)
+	{
+		history.cntDirtyTile += dirty;
+	}
+
+	withFormats(settings_, [&](auto depth, auto color)
+	{
+		typedef decltype(depth) Depth;
+		typedef decltype(color) Color;
+		typename Depth::Type *z = samples<Depth>(zBuffer_);
+		typename Color::Type *c = samples<Color>(colorBuffer_);
+		typename Color::Type black = Color::encode(Vec3f(0.0f, 0.0f, 0.0f));
+		size_t cntSample = size_t(settings_.width) * settings_.height * settings_.cntSample;
+		if (!incremental && !keepDepth)
+		{
+			std::fill(z, z + cntSample, Depth::far());
+			std::fill(c, c + cntSample, black);
+		}
+		else if (incremental)
+		{
+			// clear the samples of the dirty tiles only
+			for (unsigned y = 0; y < settings_.height; ++y)
+			{
+				for (unsigned tx = 0; tx < cntTileX; ++tx)
+				{
+					if (!history.tileMask[(y / TILE_SIZE) * cntTileX + tx]) continue;
+					size_t first = settings_.cntSample * (size_t(y) * settings_.width + tx * TILE_SIZE);
+					size_t last = settings_.cntSample * (size_t(y) * settings_.width + std::min(settings_.width, (tx + 1) * TILE_SIZE));
+					std::fill(z + first, z + last, Depth::far());
+					std::fill(c + first, c + last, black);
+				}
+			}
+		}
+	});
+
+	TileMask tiles = { history.tileMask.data(), TILE_SIZE, cntTileX };
+	cntShaded_ = 0;
+
+	// coarse shading rates of the tiles, for the models that choose them adaptively
+	bool adaptive = false;
+	for (const ModelInstances &instances : scene.models)
+	{
+		adaptive = adaptive || instances.shadingRate.x == 0;
+	}
+	if (adaptive && settings_.quadShading) adaptiveShadingRates(scene, state, settings_, rates_);
+
+	// lights of the screen tiles, culled with the depth bounds of a prepass at one sample per pixel
+	lightGrid_ = LightGrid();
+	if (!scene.lights.empty() && history.cntDirtyTile > 0)
+	{
+		const Vec3f *viewDepth = nullptr;
+		if (settings_.lightCulling)
+		{
+			viewZ_.assign(size_t(settings_.width) * settings_.height, -std::numeric_limits<float>::max());
+			viewDepth_.assign(size_t(settings_.width) * settings_.height, Vec3f(0.0f, 0.0f, 0.0f));
+			ViewDepthShader depthShader;
+			depthShader.uVpPV = state.VpPV;
+			depthShader.uView = state.view;
+			for (const std::vector<ClippedTriangle> &triangles : state.triangles)
+			{
+				for (const ClippedTriangle &tri : triangles)
+				{
+					Vec4f screenCoords[3];
+					for (int j = 0; j < 3; ++j)
+					{
+						screenCoords[j] = depthShader.vertex(j, tri.v[j].worldCoord, tri.v[j].uv, tri.v[j].normal, tri.v[j].tangent);
+					}
+					triangle(screenCoords, depthShader, viewDepth_.data(), viewZ_.data(), settings_.width, settings_.height, D_NonMSAA, 1);
+				}
+			}
+			viewDepth = viewDepth_.data();
+		}
+		cullLights(scene.lights, state, settings_, viewDepth, lightGrid_);
+	}
+
+	// depth prepass: the samples keep the depth of the nearest surface, so the shading below only passes
+	// the fragments that end up visible
+	if (settings_.depthPrepass && !keepDepth && history.cntDirtyTile > 0)
+	{
+		ViewDepthShader depthShader;
+		depthShader.uVpPV = state.VpPV;
+		depthShader.uView = state.view;
+		for (unsigned m : state.modelOrder)
+		{
+			for (const ClippedTriangle &tri : state.triangles[m])
+			{
+				Vec4f screenCoords[3];
+				for (int j = 0; j < 3; ++j)
+				{
+					screenCoords[j] = depthShader.vertex(j, tri.v[j].worldCoord, tri.v[j].uv, tri.v[j].normal, tri.v[j].tangent);
+				}
+				withFormats(settings_, [&](auto depth, auto)
+				{
+					typedef decltype(depth) Depth;
+					triangleDepth<Depth>(screenCoords, samples<Depth>(zBuffer_), settings_.width, settings_.height, samplePattern(settings_.cntSample),
+						settings_.cntSample, incremental ? &tiles : nullptr);
+				});
+			}
+		}
+	}
+
+	for (unsigned k = 0; history.cntDirtyTile > 0 && k < state.modelOrder.size(); ++k)
+	{
+		unsigned m = state.modelOrder[k];
+		const ModelInstances &instances = scene.models[m];
+		RateMap rates = { instances.shadingRate.x == 0 ? rates_.data() : nullptr, TILE_SIZE, cntTileX, instances.shadingRate };
+		withFormats(settings_, [&](auto depth, auto color)
+		{
+			typedef decltype(depth) Depth;
+			typedef decltype(color) Color;
+			if (settings_.fastMath) cntShaded_ += shadeModel<FastMath, Depth, Color>(scene, state, m, incremental ? &tiles : nullptr, &rates);
+			else cntShaded_ += shadeModel<PreciseMath, Depth, Color>(scene, state, m, incremental ? &tiles : nullptr, &rates);
+		});
+	}
+
+	// pixels drawn, for the overdraw
+	cntCovered_ = 0;
+	withFormats(settings_, [&](auto depth, auto)
+	{
+		typedef decltype(depth) Depth;
+		for (unsigned y = 0; y < settings_.height; ++y)
+		{
+			for (unsigned x = 0; x < settings_.width; ++x)
+			{
+				if (!history.tileMask[(y / TILE_SIZE) * cntTileX + x / TILE_SIZE]) continue;
+				const typename Depth::Type *z = samples<Depth>(zBuffer_) + settings_.cntSample * (size_t(y) * settings_.width + x);
+				for (unsigned i = 0; i < settings_.cntSample; ++i)
+				{
+					if (z[i] == Depth::far()) continue;
+					++cntCovered_;
+					break;
+				}
+			}
+		}
+	});
+
+	history.valid = true;
+	history.camera = state.camera;
+	history.light = state.light;
+	history.lights = scene.lights;
+	history.settings = settings_;
+	history.shadows = state.shadow != nullptr;
+	history.transforms.resize(scene.models.size());
+	history.shadingRates.resize(scene.models.size());
+	for (unsigned m = 0; m < scene.models.size(); ++m)
+	{
+		history.transforms[m] = scene.models[m].transforms;
+		history.shadingRates[m] = scene.models[m].shadingRate;
+	}
+	history.screenBounds.swap(screenBounds);
+	history.lightBounds.swap(lightBounds);
+}
+
+template <typename Math, typename Depth, typename Color>
+unsigned RenderContext::shadeModel(const Scene &scene, const FrameState &state, unsigned m, const TileMask *tiles, const RateMap *rates)
+{
+	// create shader, set uniform variables of shader
+	const ModelInstances &instances = scene.models[m];
+	ShaderT<Math> PhongShader;
+	PhongShader.uTexture = instances.model;
+	PhongShader.uVpPV = state.VpPV;
+	PhongShader.uLightVpPV = state.shadow ? state.shadow->lightVpPV : Matrix::identity();
+	PhongShader.uEyePos = state.camera.eye;
+	PhongShader.uLightPos = state.light.pos;
+	PhongShader.uLightColor = state.light.color;
+	PhongShader.uShadowBuffer = state.shadow ? state.shadow->zBuffer.data() : nullptr;
+	PhongShader.uShadowBufferWidth = settings_.shadowWidth;
+	PhongShader.uShadowBufferHeight = settings_.shadowHeight;
+	PhongShader.uLights = scene.lights.data();
+	PhongShader.uLightGrid = scene.lights.empty() ? nullptr : &lightGrid_;
+
+	// rendering pipeline: calculate info for each sample
+	return drawTriangles<Math, Depth, Color>(state.triangles[m], instances.transforms.data(), PhongShader, samples<Depth>(zBuffer_), samples<Color>(colorBuffer_),
+		settings_.width, settings_.height, samplePattern(settings_.cntSample), settings_.cntSample,
+		settings_.quadShading, tiles, rates, settings_.centroid);
+}
+
+void RenderContext::writeDepth(const FrameState &state, TGAImage &depth) const
+{
+	// write depth color to TGAImage depth (for debugging)
+	if (!state.shadow) return;
+	for (unsigned x = 0; x < depth.get_width(); ++x)
+	{
+		for (unsigned y = 0; y < depth.get_height(); ++y)
+		{
+			Vec3f color = state.shadow->colorBuffer[y * settings_.shadowWidth + x];
+			depth.set(x, y, TGAColor(color.x, color.y, color.z, 255));
+		}
+	}
+}
+
+void RenderContext::writeFrame(TGAImage &frame) const
+{
+	PROFILE_SCOPE(TIMER_RESOLVE);
+	withFormats(settings_, [&](auto depth, auto color)
+	{
+		resolve<decltype(depth), decltype(color)>(frame);
+	});
+}
+
+template <typename Depth, typename Color>
+void RenderContext::resolve(TGAImage &frame) const
+{
+	// write shading color to TGAImage frame, average the MSAA samples for each pixel
+	unsigned cntSample = settings_.cntSample;
+	const typename Depth::Type *z = samples<Depth>(zBuffer_);
+	const typename Color::Type *c = samples<Color>(colorBuffer_);
+	for (unsigned x = 0; x < frame.get_width(); ++x)
+	{
+		for (unsigned y = 0; y < frame.get_height(); ++y)
+		{
+			Vec3f color(0.0f, 0.0f, 0.0f);
+			for (unsigned i = 0; i < cntSample; ++i)
+			{
+				if (z[cntSample * (y*settings_.width + x) + i] != Depth::far())
+				{
+					color = color + Color::decode(c[cntSample * (y*settings_.width + x) + i]);
+				}
+			}
+			color = color / cntSample;
+			frame.set(x, y, TGAColor(color.x, color.y, color.z, 255));
+		}
+	}
+}
+
+void RenderContext::render(const Scene &scene, const Camera &camera, const Light &light, TGAImage &frame, TGAImage *depth)
+{
+	geometryStage(scene, camera, light, frame_);
+	if (depth) writeDepth(frame_, *depth);
+	shadingStage(scene, frame_);
+	writeFrame(frame);
+}
+
+const RenderSettings &RenderContext::settings() const
+{
+	return settings_;
+}
+
+const ShadowCache &RenderContext::shadowCache() const
+{
+	return shadowCache_;
+}
+
+unsigned RenderContext::cntShaded() const
+{
+	return cntShaded_;
+}
+
+float RenderContext::overdraw() const
+{
+	return cntCovered_ > 0 ? float(cntShaded_) / cntCovered_ : 0.0f;
+}
+
+ThreadPool &RenderContext::pool() const
+{
+	return *pool_;
+}
+
+const LightGrid &RenderContext::lightGrid() const
+{
+	return lightGrid_;
+}
+
+float RenderContext::dirtyFraction() const
+{
+	return history_.cntTile > 0 ? float(history_.cntDirtyTile) / history_.cntTile : 0.0f;
+}
+
+void RenderContext::writeFrameTemporal(const FrameState &state, TGAImage &frame)
+{
+	if (settings_.cntSample != 1)
+	{
+		writeFrame(frame);
+		return;
+	}
+	PROFILE_SCOPE(TIMER_RESOLVE);
+	withFormats(settings_, [&](auto depth, auto color)
+	{
+		resolveTemporal<decltype(depth), decltype(color)>(state, frame);
+	});
+}
+
+template <typename Depth, typename Color>
+void RenderContext::resolveTemporal(const FrameState &state, TGAImage &frame)
+{
+	TemporalHistory &history = temporal_;
+	const typename Color::Type *colors = samples<Color>(colorBuffer_);
+	unsigned width = settings_.width, height = settings_.height;
+	Matrix VpPV = viewport(width, height) * state.PV;
+	if (history.width != width || history.height != height)
+	{
+		history.valid = false;
+		history.width = width;
+		history.height = height;
+		history.color.assign(size_t(width) * height, Vec3f(0.0f, 0.0f, 0.0f));
+		history.motion.assign(size_t(width) * height, Vec3f(0.0f, 0.0f, 0.0f));
+	}
+
+	// motion of the visible surfaces since the last frame; the depth buffer already holds the depth of this
+	// frame, so only the visible fragments pass the depth test, as with the keepDepth of shadingStage
+	std::fill(history.motion.begin(), history.motion.end(), Vec3f(0.0f, 0.0f, 0.0f));
+	if (history.valid)
+	{
+		MotionShader shader;
+		shader.uVpPV = state.VpPV;
+		shader.uCurrentVpPV = VpPV;
+		shader.uPreviousVpPV = history.VpPV;
+		for (const std::vector<ClippedTriangle> &triangles : state.triangles)
+		{
+			for (const ClippedTriangle &tri : triangles)
+			{
+				Vec4f screenCoords[3];
+				for (int j = 0; j < 3; ++j)
+				{
+					screenCoords[j] = shader.vertex(j, tri.v[j].worldCoord, tri.v[j].uv, tri.v[j].normal, tri.v[j].tangent);
+				}
+				triangle<Depth, ColorFloat32>(screenCoords, shader, history.motion.data(), samples<Depth>(zBuffer_), width, height, D_NonMSAA, 1);
+			}
+		}
+	}
+
+	// range of the colors of the 3 pixels around every pixel of a row, for the rows above, at and below the
+	// resolved one
+	history.rowLo.resize(3 * size_t(width));
+	history.rowHi.resize(3 * size_t(width));
+	auto rowRange = [&](unsigned y)
+	{
+		const typename Color::Type *c = colors + size_t(y) * width;
+		Vec3f *lo = &history.rowLo[(y % 3) * size_t(width)], *hi = &history.rowHi[(y % 3) * size_t(width)];
+		for (unsigned x = 0; x < width; ++x)
+		{
+			Vec3f at = Color::decode(c[x]), left = Color::decode(c[x ? x - 1 : x]), right = Color::decode(c[x + 1 < width ? x + 1 : x]);
+			lo[x] = minVec(at, minVec(left, right));
+			hi[x] = maxVec(at, maxVec(left, right));
+		}
+	};
+	rowRange(0);
+	for (unsigned y = 0; y < height; ++y)
+	{
+		if (y + 1 < height) rowRange(y + 1);
+		size_t above = ((y ? y - 1 : y) % 3) * size_t(width), at = (y % 3) * size_t(width), below = ((y + 1 < height ? y + 1 : y) % 3) * size_t(width);
+		for (unsigned x = 0; x < width; ++x)
+		{
+			// the color buffer is black where nothing was drawn
+			size_t idx = size_t(y) * width + x;
+			Vec3f color = Color::decode(colors[idx]);
+			float hx = x - history.motion[idx].x, hy = y - history.motion[idx].y;
+			if (history.valid && width > 1 && height > 1 && hx >= 0.0f && hy >= 0.0f && hx <= width - 1 && hy <= height - 1)
+			{
+				// bilinear sample of the history, clamped to the range of the colors of the 3x3 pixels around
+				unsigned x0 = std::min(unsigned(hx), width - 2), y0 = std::min(unsigned(hy), height - 2);
+				float fx = hx - x0, fy = hy - y0;
+				const Vec3f *row0 = &history.color[size_t(y0) * width + x0], *row1 = row0 + width;
+				Vec3f previous = (row0[0] * (1.0f - fx) + row0[1] * fx) * (1.0f - fy) + (row1[0] * (1.0f - fx) + row1[1] * fx) * fy;
+				Vec3f lo = minVec(history.rowLo[at + x], minVec(history.rowLo[above + x], history.rowLo[below + x]));
+				Vec3f hi = maxVec(history.rowHi[at + x], maxVec(history.rowHi[above + x], history.rowHi[below + x]));
+				previous = minVec(hi, maxVec(lo, previous));
+				color = previous + (color - previous) * TAA_BLEND;
+			}
+			// the motion of the pixel is not read again, its slot keeps the resolved color
+			history.motion[idx] = color;
+			frame.set(x, y, TGAColor(color.x, color.y, color.z, 255));
+		}
+	}
+
+	history.color.swap(history.motion);
+	history.VpPV = VpPV;
+	history.valid = true;
+}
+
+size_t RenderContext::bufferBytes() const
+{
+	const TemporalHistory &history = temporal_;
+	return zBuffer_.size() + colorBuffer_.size()
+		+ (history.color.size() + history.motion.size()) * sizeof(Vec3f);
+}
@@ -0,0 +1,266 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <mutex>
+
+#include "geometry.h"
+#include "model.h"
+#include "shader.h"
+#include "scene.h"
+#include "gl.h"
+#include "threadpool.h"
+
+const unsigned INSTANCE_BATCH = 16;     // number of instances transformed together by the front-end
+const unsigned TILE_SIZE = 32;          // size of the screen tiles tracked by incremental re-rendering
+const unsigned OCCLUSION_WIDTH = 256;   // width of the coarse depth buffer of occlusion culling
+const unsigned FRONT_END_GRAIN = 1024;  // faces or vertices of a task of the parallel geometry front-end
+const float TAA_BLEND = 0.1f;           // weight of the current frame in the blend of temporal anti-aliasing
+const unsigned TAA_CNT_JITTER = 8;      // frames of the jitter sequence of temporal anti-aliasing
+
+// triangle produced by the geometry front-end, ready for vertex shading and rasterization
+struct ClippedTriangle
+{
+	Vertex v[3];
+	unsigned instance;
+};
+
+// per-instance data computed once for a whole batch of instances
+struct InstanceFrame
+{
+	Matrix model, modelInverTranspose;
+	Matrix clip;                        // PV * model
+	Matrix viewInverTranspose;          // (view * model)^-T, for back-face culling
+};
+
+// a range of faces of the geometry front-end: the triangles it produced and the buffers of the thread
+// processing it
+struct FrontEndChunk
+{
+	std::vector<ClippedTriangle> triangles;
+	std::vector<unsigned> frontFaces;    // faces of the chunk left by back-face culling, k * nfaces + face for instance k of the batch
+	std::vector<Vertex> original, clipped;
+};
+
+struct InstanceScratch
+{
+	std::vector<InstanceFrame> frames;
+	std::vector<Vec4f> worldCoords, clipCoords;
+	std::vector<Vec3f> normals;
+	std::vector<Vec4f> tangents;
+	std::vector<ClippedTriangle> triangles;
+	std::vector<FrontEndChunk> chunks;
+};
+
+// instanced draw calls: per-mesh data is precomputed in the model, vertices are transformed once per
+// instance instead of once per face corner, and instances go through the pipeline in batches; the draw
+// functions are instantiated for the shaders of PreciseMath and FastMath
+template <typename Math>
+void drawDepthInstanced(const Model &model, const Matrix *transforms, unsigned cntInstance, DepthShaderT<Math> &shader,
+	float *zBuffer, Vec3f *colorBuffer, unsigned width, unsigned height, InstanceScratch &scratch);
+template <typename Math>
+void drawInstanced(const Model &model, const Matrix *transforms, unsigned cntInstance, ShaderT<Math> &shader, const Matrix &view, const Matrix &PV,
+	float *zBuffer, Vec3f *colorBuffer, unsigned width, unsigned height, const float d[][2], unsigned cntSample, InstanceScratch &scratch);
+
+// the two halves of drawInstanced: the geometry front-end appends the clipped triangles of the instances,
+// the back-end shades and rasterizes them; tri.instance indexes the transforms given to the front-end. With a
+// pool, the front-end splits the vertices and faces among its threads, the triangles keep the same order
+void processInstances(const Model &model, const Matrix *transforms, unsigned cntInstance, const Matrix &view, const Matrix &PV,
+	InstanceScratch &scratch, std::vector<ClippedTriangle> &triangles, ThreadPool *pool = nullptr);
+// drawTriangles returns the number of shading invocations, quads selects the rasterizer that shades 2x2 quads
+// at once, the only one that supports coarse shading rates; centroid as for triangle, and the buffers hold
+// samples of the Depth and Color formats
+template <typename Math, typename Depth = DepthFloat32, typename Color = ColorFloat32>
+unsigned drawTriangles(const std::vector<ClippedTriangle> &triangles, const Matrix *transforms, ShaderT<Math> &shader,
+	typename Depth::Type *zBuffer, typename Color::Type *colorBuffer, unsigned width, unsigned height, const float d[][2], unsigned cntSample, bool quads = false,
+	const TileMask *tiles = nullptr, const RateMap *rates = nullptr, bool centroid = false);
+
+
+// returns the displacements of the samples inside a pixel for a valid sample count (see validSampleCount)
+const float (*samplePattern(unsigned cntSample))[2];
+
+// depth of the scene viewed from the light, the color buffer holds the debugging depth image
+struct ShadowMap
+{
+	Matrix lightVpPV;
+	std::vector<float> zBuffer;
+	std::vector<Vec3f> colorBuffer;
+};
+
+// keeps the shadow map of the last frame while the light and the shadow casters stay where they were;
+// static casters are baked into a base map and only the dynamic ones are drawn again on top of it
+struct ShadowCache
+{
+	bool valid;
+	Vec3f lightPos;
+	unsigned width, height;
+	std::vector<std::vector<Matrix>> transforms;        // casters the maps were rendered with, per model
+	std::shared_ptr<ShadowMap> base, full;              // static casters only, all the casters
+	std::vector<std::shared_ptr<ShadowMap>> pool;       // maps are reused once no frame in flight holds them
+	unsigned hits, redraws, rebuilds;                   // reused as is, dynamic casters redrawn, rendered from scratch
+
+	ShadowCache() : valid(false), lightPos(), width(0), height(0), transforms(), base(), full(), pool(), hits(0), redraws(0), rebuilds(0) {}
+};
+
+// inclusive rectangle of pixels or texels, empty when x0 > x1
+struct Rect
+{
+	int x0, y0, x1, y1;
+
+	Rect() : x0(1), y0(1), x1(0), y1(0) {}
+	bool empty() const { return x0 > x1 || y0 > y1; }
+	bool overlaps(const Rect &r) const { return !empty() && !r.empty() && x0 <= r.x1 && r.x0 <= x1 && y0 <= r.y1 && r.y0 <= y1; }
+	void extend(float x, float y);
+	Rect expanded(int margin) const;
+};
+
+// what the previous frame left in the color and depth buffers; when only some instances moved, the
+// shading stage re-renders the tiles covered by their old and new footprints and by the receivers of
+// their shadows, and keeps the rest of the buffers
+struct FrameHistory
+{
+	bool valid;
+	Camera camera;
+	Light light;
+	std::vector<LightSource> lights;
+	RenderSettings settings;
+	bool shadows;
+	std::vector<ShadingRate> shadingRates;              // per model
+	std::vector<std::vector<Matrix>> transforms;        // per model, per instance
+	std::vector<std::vector<Rect>> screenBounds;        // footprints in pixels
+	std::vector<std::vector<Rect>> lightBounds;         // footprints in shadow map texels
+	std::vector<unsigned char> tileMask;
+	unsigned cntTile, cntDirtyTile;                     // of the last frame
+
+	FrameHistory() : valid(false), camera(), light(), lights(), settings(), shadows(false), shadingRates(), transforms(), screenBounds(), lightBounds(),
+		tileMask(), cntTile(0), cntDirtyTile(0) {}
+};
+
+// what temporal anti-aliasing keeps between the frames of a sequence: the resolved colors of the last
+// frame and its transform without jitter, to reproject the pixels of the next one
+struct TemporalHistory
+{
+	bool valid;
+	unsigned width, height;
+	Matrix VpPV;
+	std::vector<Vec3f> color;           // resolved colors of the last frame
+	std::vector<Vec3f> motion;          // per pixel, in pixels since the last frame, from MotionShader; takes the
+	                                    // resolved colors of the frame and is swapped with color when done
+	std::vector<Vec3f> rowLo, rowHi;    // scratch of the resolve, color ranges of 3 rows
+
+	TemporalHistory() : valid(false), width(0), height(0), VpPV(), color(), motion(), rowLo(), rowHi() {}
+};
+
+// sub-pixel offset of the projection of the nth frame of temporal anti-aliasing, in pixels: the points of
+// the Halton (2, 3) sequence, centered on the pixel and repeated every TAA_CNT_JITTER frames
+Vec2f temporalJitter(unsigned nth);
+
+// coarse depth buffer of the occluders of a frame, rasterized at one sample per pixel; an instance is hidden
+// when every pixel of its bounding box footprint is fully covered by occluders in front of its bounding box
+struct OcclusionBuffer
+{
+	unsigned width, height;
+	std::vector<float> zBuffer;
+	std::vector<Vec3f> depth;           // view-space depth of the occluders in x, 0 where none was drawn
+	std::vector<float> farthest;        // farthest depth of the 3x3 pixels around every pixel, infinity unless all are covered
+};
+
+// everything the shading stage needs from the geometry stage of a frame: the shadow map and the clipped
+// triangles of the main pass; frames in flight use separate states
+struct FrameState
+{
+	Camera camera;
+	Light light;
+	Matrix view, PV, VpPV;
+	std::shared_ptr<const ShadowMap> shadow;                // null when the settings turn shadows off
+	std::vector<std::vector<ClippedTriangle>> triangles;    // per model of the scene
+	std::vector<std::vector<unsigned char>> visible;        // per model, per instance, cleared by occlusion culling
+	std::vector<unsigned> modelOrder;                       // order the models are shaded in
+	unsigned cntOccluded, cntOccludedFaces;                 // instances skipped by occlusion culling and their faces
+	unsigned cntFaces, cntFullFaces;                        // faces sent to the front-end, and as many without levels of detail
+	OcclusionBuffer occlusion;
+	InstanceScratch scratch;
+	InstanceScratch shadowScratch;      // the shadow pass has its own, it may run along with the front-end
+
+	FrameState() : camera(), light(), view(), PV(), VpPV(), shadow(), triangles(), visible(), modelOrder(), cntOccluded(0), cntOccludedFaces(0), cntFaces(0), cntFullFaces(0), occlusion(), scratch(),
+		shadowScratch() {}
+};
+
+// picks the coarsest shading rate of every screen tile that keeps the uv and normal variation of a shading
+// invocation under settings.rateTexels texels and a small angle, from the triangles of the models with an
+// adaptive rate; the derivatives are evaluated at the tile centers
+void adaptiveShadingRates(const Scene &scene, const FrameState &state, const RenderSettings &settings, std::vector<ShadingRate> &rates);
+
+// sorts the lights of the scene into the screen tiles of grid.tileSize pixels they can reach; viewDepth holds
+// the view-space depth of every pixel, 0 where nothing was drawn, and a point or spot light is kept in a tile
+// when its sphere of influence crosses the frustum of the tile between the nearest and farthest depths of
+// the tile; without viewDepth every light goes to every tile
+void cullLights(const std::vector<LightSource> &lights, const FrameState &state, const RenderSettings &settings, const Vec3f *viewDepth, LightGrid &grid);
+
+// owns the buffers of a render and keeps them between frames, so a loaded scene can be rendered
+// from many cameras without reallocating anything
+class RenderContext
+{
+private:
+	RenderSettings settings_;
+	std::vector<unsigned char> zBuffer_;    // samples of the depth and color formats of the settings
+	std::vector<unsigned char> colorBuffer_;
+	FrameState frame_;                  // state of the frames rendered by render()
+	FrameHistory history_;
+	unsigned cntShaded_;                // shading invocations of the last shading stage
+	unsigned cntCovered_;               // pixels drawn by the last shading stage
+	std::vector<ShadingRate> rates_;    // per tile, for the models with an adaptive shading rate
+	std::vector<float> viewZ_;          // depth prepass of the light culling, one sample per pixel
+	std::vector<Vec3f> viewDepth_;
+	LightGrid lightGrid_;               // lights of the screen tiles, for the scene lights besides the main one
+	mutable ShadowCache shadowCache_;
+	mutable std::mutex shadowMutex_;
+	std::unique_ptr<ThreadPool> pool_;  // threads of the geometry front-end
+	TemporalHistory temporal_;
+
+	std::shared_ptr<ShadowMap> acquireShadowMap() const;
+	template <typename Math>
+	void drawShadowCasters(const Scene &scene, bool dynamic, ShadowMap &map, InstanceScratch &scratch) const;
+	std::shared_ptr<const ShadowMap> shadowPass(const Scene &scene, const Light &light, InstanceScratch &scratch) const;
+	void cullOccluded(const Scene &scene, FrameState &state) const;
+	void markTiles(const Rect &rect);
+	template <typename Math, typename Depth, typename Color>
+	unsigned shadeModel(const Scene &scene, const FrameState &state, unsigned m, const TileMask *tiles, const RateMap *rates);
+	template <typename Depth, typename Color>
+	void resolve(TGAImage &frame) const;
+	template <typename Depth, typename Color>
+	void resolveTemporal(const FrameState &state, TGAImage &frame);
+
+public:
+	RenderContext();
+	void configure(const RenderSettings &settings);     // reallocates the buffers only when their sizes change
+	// shadow pass and geometry front-end of the main pass, only write to the frame state; the front-end skips
+	// the instances hidden behind the large instances nearer to the camera, draws every instance with the
+	// coarsest level of detail whose error stays under settings.lodPixels pixels, and sorts the models and
+	// the instances front to back when the settings ask for it. geometryStage runs both, shadowStage and
+	// frontEndStage don't touch the same parts of the state and may run at the same time
+	// frontEndStage, jitter: offset of the projection in pixels, for temporal anti-aliasing
+	void shadowStage(const Scene &scene, const Light &light, FrameState &state) const;
+	void frontEndStage(const Scene &scene, const Camera &camera, FrameState &state, Vec2f jitter = Vec2f()) const;
+	void geometryStage(const Scene &scene, const Camera &camera, const Light &light, FrameState &state, Vec2f jitter = Vec2f()) const;
+	// vertex shading, rasterization and fragment shading of the triangles of a finished geometry stage;
+	// keepDepth: the depth buffer already holds the depth of this very frame, so only the visible
+	// fragments pass the depth test and get shaded again; the depth prepass of the settings fills the
+	// depth buffer that way before shading
+	void shadingStage(const Scene &scene, const FrameState &state, bool keepDepth = false);
+	void writeDepth(const FrameState &state, TGAImage &depth) const;
+	void writeFrame(TGAImage &frame) const;
+	// temporal anti-aliasing of the frames of a sequence shaded at one sample per pixel with the jitter of
+	// temporalJitter: blends the frame into the history reprojected along the motion of the surfaces, the
+	// history being clamped to the range of the colors around every pixel so what was hidden doesn't ghost
+	void writeFrameTemporal(const FrameState &state, TGAImage &frame);
+	size_t bufferBytes() const;         // of the sample buffers and the history of temporal anti-aliasing
+	void render(const Scene &scene, const Camera &camera, const Light &light, TGAImage &frame, TGAImage *depth = nullptr);
+	const RenderSettings &settings() const;
+	ThreadPool &pool() const;           // shared by the geometry front-end and the passes of a task graph
+	const ShadowCache &shadowCache() const;
+	float dirtyFraction() const;        // fraction of the tiles re-rendered by the last shading stage
+	unsigned cntShaded() const;
+	float overdraw() const;             // shading invocations per pixel drawn by the last shading stage
+	const LightGrid &lightGrid() const; // of the last shading stage, empty without scene lights
+};
@@ -0,0 +1,438 @@
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <cstdio>
+
+#include "scene.h"
+#include "gl.h"
+
+Scene::Scene() : models(), names(), cameras(), keyframes(), light(), lights(), settings() {}
+
+Scene::~Scene()
+{
+	for (ModelInstances &instances : models)
+	{
+		delete instances.model;
+	}
+}
+
+int Scene::find(const std::string &name) const
+{
+	for (unsigned i = 0; i < names.size(); ++i)
+	{
+		if (names[i] == name) return i;
+	}
+	return -1;
+}
+
+int Scene::addModel(const std::string &name, const std::string &filename, bool dynamic, ShadingRate shadingRate, ThreadPool *pool)
+{
+	models.push_back(ModelInstances(new Model(filename, pool), dynamic, shadingRate));
+	names.push_back(name);
+	return models.size() - 1;
+}
+
+void Scene::waitMeshes()
+{
+	for (ModelInstances &instances : models)
+	{
+		instances.model->wait_mesh();
+	}
+}
+
+void Scene::waitTextures()
+{
+	for (ModelInstances &instances : models)
+	{
+		instances.model->wait_textures();
+	}
+}
+
+unsigned Scene::cntInstance() const
+{
+	unsigned ret = 0;
+	for (const ModelInstances &instances : models)
+	{
+		ret += instances.transforms.size();
+	}
+	return ret;
+}
+
+unsigned Scene::cntFrame() const
+{
+	return keyframes.empty() ? 0 : keyframes.back().frame + 1;
+}
+
+void Scene::sequenceFrame(unsigned nth, Camera &camera, Light &light) const
+{
+	unsigned k = 0;
+	while (k + 1 < keyframes.size() && keyframes[k + 1].frame <= nth) ++k;
+	const Keyframe &key = keyframes[k];
+	camera = key.camera;
+	light = key.light;
+	if (k + 1 == keyframes.size() || nth <= key.frame) return;
+
+	const Keyframe &next = keyframes[k + 1];
+	float t = float(nth - key.frame) / (next.frame - key.frame);
+	camera.eye = key.camera.eye + (next.camera.eye - key.camera.eye) * t;
+	camera.center = key.camera.center + (next.camera.center - key.camera.center) * t;
+	camera.up = key.camera.up + (next.camera.up - key.camera.up) * t;
+	camera.fov = key.camera.fov + (next.camera.fov - key.camera.fov) * t;
+	light.pos = key.light.pos + (next.light.pos - key.light.pos) * t;
+}
+
+static bool readVec3(std::istringstream &iss, Vec3f &v)
+{
+	return bool(iss >> v.x >> v.y >> v.z);
+}
+
+static bool readRate(std::istringstream &iss, ShadingRate &rate)
+{
+	std::string value;
+	if (!(iss >> value)) return false;
+	if (value == "adaptive") rate = ShadingRate(0, 0);
+	else if (value == "1x1") rate = ShadingRate(1, 1);
+	else if (value == "2x1") rate = ShadingRate(2, 1);
+	else if (value == "2x2") rate = ShadingRate(2, 2);
+	else if (value == "4x4") rate = ShadingRate(4, 4);
+	else return false;
+	return true;
+}
+
+bool Scene::load(const std::string filename, ThreadPool *pool)
+{
+	std::ifstream in(filename);
+	if (in.fail())
+	{
+		std::cerr << "can't open scene file " << filename << std::endl;
+		return false;
+	}
+
+	const float PI = acosf(-1.0f);
+	ShadingRate shadingRate;
+	std::string line;
+	for (unsigned lineNumber = 1; std::getline(in, line); ++lineNumber)
+	{
+		size_t comment = line.find('#');
+		if (comment != std::string::npos) line.erase(comment);
+		std::istringstream iss(line);
+		std::string key;
+		if (!(iss >> key)) continue;
+
+		bool ok = true;
+		if (key == "resolution")
+		{
+			ok = bool(iss >> settings.width >> settings.height) && settings.width > 0 && settings.height > 0;
+		}
+		else if (key == "shadow")
+		{
+			ok = bool(iss >> settings.shadowWidth >> settings.shadowHeight) && settings.shadowWidth > 0 && settings.shadowHeight > 0;
+		}
+		else if (key == "msaa")
+		{
+			ok = bool(iss >> settings.cntSample) && validSampleCount(settings.cntSample);
+		}
+		else if (key == "shadows")
+		{
+			std::string value;
+			ok = bool(iss >> value) && (value == "on" || value == "off");
+			settings.shadows = value == "on";
+		}
+		else if (key == "shadowcache")
+		{
+			std::string value;
+			ok = bool(iss >> value) && (value == "on" || value == "off");
+			settings.shadowCache = value == "on";
+		}
+		else if (key == "incremental")
+		{
+			std::string value;
+			ok = bool(iss >> value) && (value == "on" || value == "off");
+			settings.incremental = value == "on";
+		}
+		else if (key == "shading")
+		{
+			std::string value;
+			ok = bool(iss >> value) && (value == "quad" || value == "scalar");
+			settings.quadShading = value == "quad";
+		}
+		else if (key == "shadingrate")
+		{
+			ok = readRate(iss, shadingRate);
+		}
+		else if (key == "ratetexels")
+		{
+			ok = bool(iss >> settings.rateTexels) && settings.rateTexels > 0.0f;
+		}
+		else if (key == "lightculling")
+		{
+			std::string value;
+			ok = bool(iss >> value) && (value == "on" || value == "off");
+			settings.lightCulling = value == "on";
+		}
+		else if (key == "occlusionculling")
+		{
+			std::string value;
+			ok = bool(iss >> value) && (value == "on" || value == "off");
+			settings.occlusionCulling = value == "on";
+		}
+		else if (key == "depthprepass")
+		{
+			std::string value;
+			ok = bool(iss >> value) && (value == "on" || value == "off");
+			settings.depthPrepass = value == "on";
+		}
+		else if (key == "sorting")
+		{
+			std::string value;
+			ok = bool(iss >> value) && (value == "on" || value == "off");
+			settings.frontToBack = value == "on";
+		}
+		else if (key == "lodpixels")
+		{
+			ok = bool(iss >> settings.lodPixels) && settings.lodPixels >= 0.0f;
+		}
+		else if (key == "centroid")
+		{
+			std::string value;
+			ok = bool(iss >> value) && (value == "on" || value == "off");
+			settings.centroid = value == "on";
+		}
+		else if (key == "depthformat")
+		{
+			std::string value;
+			ok = bool(iss >> value) && parseDepthFormat(value, settings.depthFormat);
+		}
+		else if (key == "colorformat")
+		{
+			std::string value;
+			ok = bool(iss >> value) && parseColorFormat(value, settings.colorFormat);
+		}
+		else if (key == "fastmath")
+		{
+			std::string value;
+			ok = bool(iss >> value) && (value == "on" || value == "off");
+			settings.fastMath = value == "on";
+		}
+		else if (key == "taa")
+		{
+			std::string value;
+			ok = bool(iss >> value) && (value == "on" || value == "off");
+			settings.temporalAA = value == "on";
+		}
+		else if (key == "threads")
+		{
+			ok = bool(iss >> settings.cntThread);
+		}
+		else if (key == "output")
+		{
+			ok = bool(iss >> settings.framePath);
+			settings.depthPath.clear();
+			iss >> settings.depthPath;
+		}
+		else if (key == "model")
+		{
+			std::string name, path, op;
+			ok = bool(iss >> name >> path) && find(name) < 0;
+			bool dynamic = false;
+			ShadingRate rate = shadingRate;
+			while (ok && iss >> op)
+			{
+				if (op == "dynamic") dynamic = true;
+				else if (op == "rate") ok = readRate(iss, rate);
+				else ok = false;
+			}
+			if (ok) addModel(name, path, dynamic, rate, pool);
+		}
+		else if (key == "instance")
+		{
+			// transformations are applied in the order they are written
+			std::string name, op;
+			ok = bool(iss >> name) && find(name) >= 0;
+			Matrix transform = Matrix::identity();
+			while (ok && iss >> op)
+			{
+				Vec3f v;
+				if (op == "translate" && readVec3(iss, v))
+				{
+					transform = translation(v) * transform;
+				}
+				else if (op == "rotate" && readVec3(iss, v))
+				{
+					float degrees;
+					ok = bool(iss >> degrees);
+					transform = rotation(v, degrees * PI / 180.0f) * transform;
+				}
+				else if (op == "scale" && iss >> v.x)
+				{
+					if (!(iss >> v.y >> v.z))
+					{
+						v.y = v.z = v.x;
+						iss.clear();
+					}
+					transform = scaling(v) * transform;
+				}
+				else ok = false;
+			}
+			if (ok) models[find(name)].transforms.push_back(transform);
+		}
+		else if (key == "camera")
+		{
+			Camera camera;
+			ok = readVec3(iss, camera.eye) && readVec3(iss, camera.center);
+			std::string op;
+			while (ok && iss >> op)
+			{
+				float degrees;
+				if (op == "up") ok = readVec3(iss, camera.up);
+				else if (op == "fov" && iss >> degrees) camera.fov = degrees * PI / 180.0f;
+				else ok = false;
+			}
+			if (ok) cameras.push_back(camera);
+		}
+		else if (key == "keyframe")
+		{
+			Keyframe keyframe;
+			keyframe.camera = !keyframes.empty() ? keyframes.back().camera : (cameras.empty() ? Camera() : cameras.front());
+			keyframe.light = !keyframes.empty() ? keyframes.back().light : light;
+			ok = bool(iss >> keyframe.frame) && (keyframes.empty() || keyframe.frame > keyframes.back().frame);
+			std::string op;
+			while (ok && iss >> op)
+			{
+				float degrees;
+				if (op == "eye") ok = readVec3(iss, keyframe.camera.eye);
+				else if (op == "center") ok = readVec3(iss, keyframe.camera.center);
+				else if (op == "up") ok = readVec3(iss, keyframe.camera.up);
+				else if (op == "light") ok = readVec3(iss, keyframe.light.pos);
+				else if (op == "fov" && iss >> degrees) keyframe.camera.fov = degrees * PI / 180.0f;
+				else ok = false;
+			}
+			if (ok) keyframes.push_back(keyframe);
+		}
+		else if (key == "turntable")
+		{
+			unsigned frames;
+			float degrees = 360.0f;
+			std::string op;
+			bool rotateLight = false;
+			ok = bool(iss >> frames) && frames > 0;
+			float value;
+			if (ok && iss >> value) degrees = value;
+			else iss.clear();
+			while (ok && iss >> op)
+			{
+				if (op == "light") rotateLight = true;
+				else ok = false;
+			}
+			Camera camera = !keyframes.empty() ? keyframes.back().camera : (cameras.empty() ? Camera() : cameras.front());
+			Light base = !keyframes.empty() ? keyframes.back().light : light;
+			unsigned first = keyframes.empty() ? 0 : keyframes.back().frame + 1;
+			for (unsigned i = 0; ok && i < frames; ++i)
+			{
+				Matrix orbit = rotation(camera.up, degrees * PI / 180.0f * i / frames);
+				Keyframe keyframe;
+				keyframe.frame = first + i;
+				keyframe.camera = camera;
+				keyframe.camera.eye = camera.center + proj<3>(orbit * embed<4>(camera.eye - camera.center, 0.0f));
+				keyframe.light = base;
+				if (rotateLight) keyframe.light.pos = proj<3>(orbit * embed<4>(base.pos, 0.0f));
+				keyframes.push_back(keyframe);
+			}
+		}
+		else if (key == "light")
+		{
+			ok = readVec3(iss, light.pos);
+		}
+		else if (key == "pointlight")
+		{
+			LightSource source;
+			source.type = LIGHT_POINT;
+			ok = readVec3(iss, source.position) && readVec3(iss, source.color) && iss >> source.range && source.range > 0.0f;
+			if (ok) lights.push_back(source);
+		}
+		else if (key == "spotlight")
+		{
+			LightSource source;
+			source.type = LIGHT_SPOT;
+			float inner, outer;
+			ok = readVec3(iss, source.position) && readVec3(iss, source.direction) && readVec3(iss, source.color)
+				&& iss >> source.range >> inner >> outer && source.range > 0.0f && source.direction.norm() > 0.0f && inner <= outer;
+			source.direction.normalize();
+			source.cosInner = cosf(inner * PI / 180.0f);
+			source.cosOuter = cosf(outer * PI / 180.0f);
+			if (ok) lights.push_back(source);
+		}
+		else if (key == "dirlight")
+		{
+			LightSource source;
+			source.type = LIGHT_DIRECTIONAL;
+			ok = readVec3(iss, source.direction) && readVec3(iss, source.color) && source.direction.norm() > 0.0f;
+			source.direction.normalize();
+			if (ok) lights.push_back(source);
+		}
+		else if (key == "randomlights")
+		{
+			// a linear congruential generator, so the same seed scatters the same lights on every platform
+			unsigned count, seed = 1;
+			float range;
+			ok = bool(iss >> count >> range) && range > 0.0f;
+			if (ok && !(iss >> seed)) iss.clear();
+			auto random = [&seed]() { seed = seed * 1664525u + 1013904223u; return (seed >> 8) / float(1 << 24); };
+			for (unsigned i = 0; ok && i < count; ++i)
+			{
+				LightSource source;
+				source.type = LIGHT_POINT;
+				source.position.x = random() * 2.0f - 1.0f;
+				source.position.y = random() - 0.2f;
+				source.position.z = random() * 2.0f - 1.0f;
+				source.color.x = random() * 0.5f;
+				source.color.y = random() * 0.5f;
+				source.color.z = random() * 0.5f;
+				source.range = range;
+				lights.push_back(source);
+			}
+		}
+		else if (key == "ambient")
+		{
+			ok = readVec3(iss, light.color.ambient);
+		}
+		else if (key == "diffuse")
+		{
+			ok = readVec3(iss, light.color.diffuse);
+		}
+		else if (key == "specular")
+		{
+			ok = readVec3(iss, light.color.specular);
+		}
+		else ok = false;
+
+		if (!ok)
+		{
+			std::cerr << filename << ":" << lineNumber << ": bad scene statement: " << line << std::endl;
+			return false;
+		}
+	}
+
+	if (cameras.empty()) cameras.push_back(Camera());
+	return true;
+}
+
+bool sameImageSettings(const RenderSettings &a, const RenderSettings &b)
+{
+	return a.width == b.width && a.height == b.height && a.shadowWidth == b.shadowWidth && a.shadowHeight == b.shadowHeight
+		&& a.cntSample == b.cntSample && a.centroid == b.centroid && a.depthFormat == b.depthFormat && a.colorFormat == b.colorFormat
+		&& a.shadows == b.shadows && a.shadowCache == b.shadowCache && a.quadShading == b.quadShading && a.rateTexels == b.rateTexels
+		&& a.lightCulling == b.lightCulling && a.occlusionCulling == b.occlusionCulling && a.depthPrepass == b.depthPrepass
+		&& a.frontToBack == b.frontToBack && a.lodPixels == b.lodPixels && a.fastMath == b.fastMath && a.temporalAA == b.temporalAA;
+}
+
+std::string numberedPath(const std::string &path, unsigned nth, unsigned cnt)
+{
+	if (cnt <= 1) return path;
+	char number[16];
+	snprintf(number, sizeof(number), "_%04u", nth);
+	size_t dot = path.find_last_of(".");
+	size_t slash = path.find_last_of("/\\");
+	if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) return path + number;
+	return path.substr(0, dot) + number + path.substr(dot);
+}
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <vector>
+#include <string>
+
+#include "geometry.h"
+#include "model.h"
+#include "shader.h"
+#include "gl.h"
+
+// all the instances of one model, drawn by a single instanced draw call
+struct ModelInstances
+{
+	Model *model;
+	std::vector<Matrix> transforms;
+	bool dynamic;                       // dynamic shadow casters are drawn on top of the cached static shadow map
+	ShadingRate shadingRate;            // 0 x 0: chosen per tile from the screen-space variation of uv and normals
+
+	ModelInstances(Model *model = nullptr, bool dynamic = false, ShadingRate shadingRate = ShadingRate())
+		: model(model), transforms(), dynamic(dynamic), shadingRate(shadingRate) {}
+};
+
+struct Camera
+{
+	Vec3f eye, center, up;
+	float fov;                          // vertical field of view in radians
+
+	Camera(Vec3f eye = Vec3f(1.0f, 1.0f, 3.0f), Vec3f center = Vec3f(0.0f, 0.0f, 0.0f), Vec3f up = Vec3f(0.0f, 1.0f, 0.0f), float fov = acosf(-1.0f) / 4.0f)
+		: eye(eye), center(center), up(up), fov(fov) {}
+};
+
+struct Light
+{
+	Vec3f pos;                          // directional light, shining from pos towards the origin
+	LightColor color;
+
+	Light() : pos(1.0f, 1.0f, 1.0f), color(Vec3f(0.3f, 0.3f, 0.3f), Vec3f(1.0f, 1.0f, 1.0f), Vec3f(0.5f, 0.5f, 0.5f)) {}
+};
+
+struct RenderSettings
+{
+	unsigned width, height;
+	unsigned shadowWidth, shadowHeight;
+	unsigned cntSample;                 // number of samples for every pixel, 1, 2, 4, 8 or 16
+	bool centroid;                      // shade the partly covered pixels at their covered samples instead of their center
+	DepthFormat depthFormat;            // what the depth and color samples of the frame are stored as
+	ColorFormat colorFormat;
+	bool shadows;
+	bool shadowCache;                   // reuse the shadow map while the light and the casters don't move
+	bool incremental;                   // only re-render the tiles touched by the instances that moved
+	bool quadShading;                   // shade 2x2 quads of pixels at once instead of pixel by pixel
+	float rateTexels;                   // texels an adaptive coarse shading invocation may span along an axis
+	bool lightCulling;                  // shade every fragment with the lights reaching its screen tile only
+	bool occlusionCulling;              // skip the instances hidden behind others before the geometry front-end
+	bool depthPrepass;                  // lay down the depth of the frame first, then only shade the visible fragments
+	bool frontToBack;                   // draw models and instances sorted by their distance to the camera
+	float lodPixels;                    // error in pixels a level of detail may show on the screen, 0: full meshes only
+	bool fastMath;                      // shade with the approximations of FastMath instead of the library math functions
+	bool temporalAA;                    // sequences: one jittered sample per pixel blended with the previous frames instead of msaa
+	unsigned cntThread;                 // threads of the geometry front-end, 0: one per core
+	std::string framePath, depthPath;   // empty path: the image is not written
+
+	RenderSettings() : width(800), height(800), shadowWidth(800), shadowHeight(800), cntSample(4), centroid(false), depthFormat(DEPTH_FLOAT32), colorFormat(COLOR_FLOAT32), shadows(true), shadowCache(true), incremental(true), quadShading(true), rateTexels(2.0f), lightCulling(true), occlusionCulling(true), depthPrepass(false), frontToBack(false), lodPixels(1.0f), fastMath(false), temporalAA(false), cntThread(0),
+		framePath("./output/frame.tga"), depthPath("./output/depth.tga") {}
+};
+
+// whether two settings render the same pixels: compares every setting but the threads, the output paths
+// and incremental itself, so a setting added to RenderSettings must be added there too
+bool sameImageSettings(const RenderSettings &a, const RenderSettings &b);
+
+// a point of the camera/light path of a sequence, the path is interpolated linearly between keyframes
+struct Keyframe
+{
+	unsigned frame;
+	Camera camera;
+	Light light;
+};
+
+// models, instances, cameras, light and output settings of a render job; the models are loaded
+// once and every camera of the scene can be rendered from them
+//
+// text format, one statement per line, '#' starts a comment:
+//   resolution <width> <height>
+//   shadow <width> <height>
+//   msaa 1|2|4|8|16
+//   centroid on|off
+//   depthformat float32|unorm24|half16
+//   colorformat float32|half16|rgba8
+//   shadows on|off
+//   shadowcache on|off
+//   incremental on|off
+//   shading quad|scalar
+//   shadingrate 1x1|2x1|2x2|4x4|adaptive
+//   ratetexels <texels>
+//   lightculling on|off
+//   occlusionculling on|off
+//   depthprepass on|off
+//   sorting on|off
+//   lodpixels <pixels>
+//   fastmath on|off
+//   taa on|off
+//   threads <count>
+//   output <frame.tga> [depth.tga]
+//   model <name> <file.obj> [dynamic] [rate 1x1|2x1|2x2|4x4|adaptive]
+//   instance <name> [translate x y z] [rotate x y z degrees] [scale s | scale x y z] ...
+//   camera <eye x y z> <center x y z> [up x y z] [fov degrees]
+//   light <x y z>
+//   ambient|diffuse|specular <r g b>
+//   pointlight <x y z> <r g b> <range>
+//   spotlight <x y z> <direction x y z> <r g b> <range> <inner degrees> <outer degrees>
+//   dirlight <direction x y z> <r g b>
+//   randomlights <count> <range> [seed]
+// a scene with keyframes is a sequence, its frames are rendered along the path instead of the cameras:
+//   keyframe <frame> [eye x y z] [center x y z] [up x y z] [fov degrees] [light x y z]
+//   turntable <frames> [degrees] [light]
+// shadingrate sets the coarse shading rate of the models declared after it, coarse rates only apply to
+// quad shading; taa only applies to the frames of a sequence, which it renders at one sample per pixel
+// whatever msaa says;
+// a keyframe inherits what it doesn't set from the previous one (the first camera and the light at
+// first); the lights of pointlight, spotlight, dirlight and randomlights cast no shadows and are added
+// to the light of the light statement, randomlights scatters point lights of random colors above the
+// floor of the default scene; a turntable appends one keyframe per frame, orbiting the eye (and the light) around the
+// vertical axis through the center
+class Scene
+{
+public:
+	std::vector<ModelInstances> models;
+	std::vector<std::string> names;
+	std::vector<Camera> cameras;
+	std::vector<Keyframe> keyframes;    // camera/light path of a sequence, by increasing frame
+	Light light;
+	std::vector<LightSource> lights;    // unshadowed lights besides the main one
+	RenderSettings settings;
+
+	Scene();
+	~Scene();
+	// with a pool, the models only start loading on it: waitMeshes() before the geometry passes and
+	// waitTextures() before shading
+	bool load(const std::string filename, ThreadPool *pool = nullptr);
+	int find(const std::string &name) const;
+	int addModel(const std::string &name, const std::string &filename, bool dynamic = false, ShadingRate shadingRate = ShadingRate(),
+		ThreadPool *pool = nullptr);
+	void waitMeshes();
+	void waitTextures();
+	unsigned cntInstance() const;
+	unsigned cntFrame() const;          // number of frames of the sequence, 0 without keyframes
+	void sequenceFrame(unsigned nth, Camera &camera, Light &light) const;
+
+private:
+	Scene(const Scene &);
+	Scene &operator=(const Scene &);
+};
+
+// output path for the nth of cnt frames rendered to the same path, "frame.tga" -> "frame_0003.tga"
+std::string numberedPath(const std::string &path, unsigned nth, unsigned cnt);
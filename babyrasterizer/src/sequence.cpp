@@ -0,0 +1,76 @@
+#include <chrono>
+#include <future>
+#include <iostream>
+#include <string>
+
+#include "sequence.h"
+#include "renderer.h"
+
+static void prepareFrame(const RenderContext &context, const Scene &scene, unsigned nth, FrameState &state)
+{
+	Camera camera;
+	Light light;
+	scene.sequenceFrame(nth, camera, light);
+	context.geometryStage(scene, camera, light, state, context.settings().temporalAA ? temporalJitter(nth) : Vec2f());
+}
+
+double renderSequence(const Scene &scene, bool pipelined)
+{
+	typedef std::chrono::steady_clock Clock;
+	RenderSettings settings = scene.settings;
+	if (settings.temporalAA)
+	{
+		// the jitter moves the camera every frame, nothing could be kept by incremental rendering anyway
+		settings.cntSample = 1;
+		settings.incremental = false;
+	}
+	RenderContext context;
+	context.configure(settings);
+	TGAImage depth(settings.shadowWidth, settings.shadowHeight, TGAImage::RGB);
+	TGAImage frame(settings.width, settings.height, TGAImage::RGB);
+
+	// two frame states: one is filled by the geometry stage while the other one is shaded
+	FrameState states[2];
+	unsigned cntFrame = scene.cntFrame();
+	double dirtyTiles = 0.0;
+	Clock::time_point start = Clock::now();
+	if (cntFrame > 0) prepareFrame(context, scene, 0, states[0]);
+	for (unsigned k = 0; k < cntFrame; ++k)
+	{
+		FrameState &current = states[k % 2];
+		std::future<void> next;
+		if (pipelined && k + 1 < cntFrame)
+		{
+			next = std::async(std::launch::async, prepareFrame, std::cref(context), std::cref(scene), k + 1, std::ref(states[(k + 1) % 2]));
+		}
+
+		if (!settings.depthPath.empty())
+		{
+			context.writeDepth(current, depth);
+			depth.write_tga_file(numberedPath(settings.depthPath, k, cntFrame));
+		}
+		context.shadingStage(scene, current);
+		dirtyTiles += context.dirtyFraction();
+		if (settings.temporalAA) context.writeFrameTemporal(current, frame);
+		else context.writeFrame(frame);
+		if (!settings.framePath.empty())
+		{
+			frame.write_tga_file(numberedPath(settings.framePath, k, cntFrame));
+		}
+
+		if (next.valid()) next.get();
+		else if (k + 1 < cntFrame) prepareFrame(context, scene, k + 1, states[(k + 1) % 2]);
+		std::cerr << "finish frame " << k << std::endl;
+	}
+
+	double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+	double fps = seconds > 0.0 ? cntFrame / seconds : 0.0;
+	std::cerr << "rendered " << cntFrame << " frames in " << seconds << " s (" << fps << " frames/s, "
+		<< (pipelined ? "pipelined" : "not pipelined") << ")" << std::endl;
+	std::cerr << "frame buffers: " << context.bufferBytes() / (1024.0 * 1024.0) << " MB, "
+		<< (settings.temporalAA ? "temporal anti-aliasing" : std::to_string(settings.cntSample) + " samples per pixel") << std::endl;
+	const ShadowCache &cache = context.shadowCache();
+	std::cerr << "shadow maps: " << cache.hits << " reused, " << cache.redraws << " redrawn dynamic casters, " << cache.rebuilds << " rendered" << std::endl;
+	if (cntFrame > 0) std::cerr << "tiles re-rendered: " << 100.0 * dirtyTiles / cntFrame << "% on average" << std::endl;
+	return fps;
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include "scene.h"
+
+// renders every frame of the camera/light path of a sequence scene to numbered images, reusing the
+// loaded assets and one set of buffers; when pipelined, the geometry stage of frame k+1 (shadow pass
+// and vertex processing) runs on a second thread while frame k is shaded and encoded
+// returns the throughput in frames per second
+double renderSequence(const Scene &scene, bool pipelined);
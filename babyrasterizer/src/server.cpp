@@ -0,0 +1,366 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+#include "server.h"
+#include "renderer.h"
+
+#ifndef _WIN32
+#include <cerrno>
+#include <csignal>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+void LatencyStats::add(double ms)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	samples_.push_back(ms);
+}
+
+unsigned LatencyStats::count() const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return samples_.size();
+}
+
+double LatencyStats::percentile(double p) const
+{
+	std::vector<double> sorted;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		sorted = samples_;
+	}
+	if (sorted.empty()) return 0.0;
+	std::sort(sorted.begin(), sorted.end());
+	size_t rank = size_t(std::ceil(p / 100.0 * sorted.size()));
+	return sorted[std::min(sorted.size() - 1, rank > 0 ? rank - 1 : 0)];
+}
+
+std::string LatencyStats::summary() const
+{
+	char buffer[128];
+	snprintf(buffer, sizeof(buffer), "%u p50 %.3f p90 %.3f p99 %.3f max %.3f",
+		count(), percentile(50.0), percentile(90.0), percentile(99.0), percentile(100.0));
+	return buffer;
+}
+
+#ifdef _WIN32
+
+int runServer(const Scene &scene, const std::string &socketPath, unsigned cntWorker, unsigned queueSize)
+{
+	std::cerr << "server mode needs unix domain sockets, it is not supported on this platform" << std::endl;
+	return 1;
+}
+
+#else
+
+struct ServerState
+{
+	const Scene &scene;
+	unsigned queueSize;
+	std::deque<int> connections;        // accepted connections waiting for a worker
+	std::mutex mutex;
+	std::condition_variable notEmpty, notFull;
+	bool stopping;
+	int listenFd;
+	LatencyStats latency;
+
+	ServerState(const Scene &scene, unsigned queueSize)
+		: scene(scene), queueSize(queueSize), connections(), mutex(), notEmpty(), notFull(), stopping(false), listenFd(-1), latency() {}
+};
+
+struct RenderRequest
+{
+	Camera camera;
+	Light light;
+	RenderSettings settings;
+	std::string output;
+};
+
+static bool sendAll(int fd, const void *data, size_t size)
+{
+	const char *p = static_cast<const char *>(data);
+	while (size > 0)
+	{
+		ssize_t sent = send(fd, p, size, 0);
+		if (sent < 0 && errno == EINTR) continue;
+		if (sent <= 0) return false;
+		p += sent;
+		size -= sent;
+	}
+	return true;
+}
+
+static bool sendLine(int fd, const std::string &line)
+{
+	return sendAll(fd, (line + "\n").data(), line.size() + 1);
+}
+
+// reads the next line from the connection, gives up when the connection is closed or the server stops
+static bool readLine(ServerState &state, int fd, std::string &buffer, std::string &line)
+{
+	for (;;)
+	{
+		size_t end = buffer.find('\n');
+		if (end != std::string::npos)
+		{
+			line = buffer.substr(0, end);
+			buffer.erase(0, end + 1);
+			if (!line.empty() && line.back() == '\r') line.pop_back();
+			return true;
+		}
+
+		pollfd pfd = { fd, POLLIN, 0 };
+		int ready = poll(&pfd, 1, 200);
+		if (ready < 0 && errno != EINTR) return false;
+		if (ready <= 0)
+		{
+			std::lock_guard<std::mutex> lock(state.mutex);
+			if (state.stopping) return false;
+			continue;
+		}
+
+		char chunk[4096];
+		ssize_t received = recv(fd, chunk, sizeof(chunk), 0);
+		if (received < 0 && errno == EINTR) continue;
+		if (received <= 0) return false;
+		buffer.append(chunk, received);
+	}
+}
+
+static bool readVec3(std::istringstream &iss, Vec3f &v)
+{
+	return bool(iss >> v.x >> v.y >> v.z);
+}
+
+static bool parseRender(std::istringstream &iss, const Scene &scene, RenderRequest &request, std::string &error)
+{
+	const float PI = acosf(-1.0f);
+	request.camera = scene.cameras.front();
+	request.light = scene.light;
+	request.settings = scene.settings;
+
+	std::string key;
+	while (iss >> key)
+	{
+		float degrees;
+		bool ok;
+		if (key == "eye") ok = readVec3(iss, request.camera.eye);
+		else if (key == "center") ok = readVec3(iss, request.camera.center);
+		else if (key == "up") ok = readVec3(iss, request.camera.up);
+		else if (key == "light") ok = readVec3(iss, request.light.pos);
+		else if (key == "fov")
+		{
+			ok = bool(iss >> degrees);
+			request.camera.fov = degrees * PI / 180.0f;
+		}
+		else if (key == "resolution")
+		{
+			ok = iss >> request.settings.width >> request.settings.height && request.settings.width > 0 && request.settings.height > 0
+				&& request.settings.width <= 8192 && request.settings.height <= 8192;
+		}
+		else if (key == "msaa")
+		{
+			ok = iss >> request.settings.cntSample && validSampleCount(request.settings.cntSample);
+		}
+		else if (key == "depthformat")
+		{
+			std::string value;
+			ok = iss >> value && parseDepthFormat(value, request.settings.depthFormat);
+		}
+		else if (key == "colorformat")
+		{
+			std::string value;
+			ok = iss >> value && parseColorFormat(value, request.settings.colorFormat);
+		}
+		else if (key == "centroid")
+		{
+			std::string value;
+			ok = iss >> value && (value == "on" || value == "off");
+			request.settings.centroid = value == "on";
+		}
+		else if (key == "output") ok = bool(iss >> request.output);
+		else ok = false;
+
+		if (!ok)
+		{
+			error = "bad render parameter " + key;
+			return false;
+		}
+	}
+	return true;
+}
+
+static void serveConnection(ServerState &state, int fd, RenderContext &context)
+{
+	typedef std::chrono::steady_clock Clock;
+	std::string buffer, line;
+	while (readLine(state, fd, buffer, line))
+	{
+		Clock::time_point start = Clock::now();
+		std::istringstream iss(line);
+		std::string command;
+		if (!(iss >> command)) continue;
+
+		if (command == "render")
+		{
+			RenderRequest request;
+			std::string error;
+			if (!parseRender(iss, state.scene, request, error))
+			{
+				if (!sendLine(fd, "error " + error)) return;
+				continue;
+			}
+
+			// render with the buffers of this worker, they are only reallocated when the resolution changes
+			context.configure(request.settings);
+			TGAImage frame(request.settings.width, request.settings.height, TGAImage::RGB);
+			context.render(state.scene, request.camera, request.light, frame);
+
+			bool sent;
+			if (!request.output.empty())
+			{
+				bool written = frame.write_tga_file(request.output);
+				double ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+				state.latency.add(ms);
+				std::ostringstream response;
+				if (written) response << "ok " << ms;
+				else response << "error can't write " << request.output;
+				sent = sendLine(fd, response.str());
+			}
+			else
+			{
+				size_t bytes = size_t(frame.get_width()) * frame.get_height() * frame.get_bytespp();
+				double ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+				state.latency.add(ms);
+				std::ostringstream header;
+				header << "pixels " << frame.get_width() << " " << frame.get_height() << " " << bytes << " " << ms;
+				sent = sendLine(fd, header.str()) && sendAll(fd, frame.buffer(), bytes);
+			}
+			if (!sent) return;
+		}
+		else if (command == "stats")
+		{
+			if (!sendLine(fd, "stats " + state.latency.summary())) return;
+		}
+		else if (command == "quit")
+		{
+			return;
+		}
+		else if (command == "shutdown")
+		{
+			{
+				std::lock_guard<std::mutex> lock(state.mutex);
+				state.stopping = true;
+			}
+			shutdown(state.listenFd, SHUT_RDWR);
+			state.notEmpty.notify_all();
+			state.notFull.notify_all();
+			sendLine(fd, "ok");
+			return;
+		}
+		else if (!sendLine(fd, "error unknown command " + command)) return;
+	}
+}
+
+static void serverWorker(ServerState &state)
+{
+	RenderContext context;
+	for (;;)
+	{
+		int fd;
+		{
+			std::unique_lock<std::mutex> lock(state.mutex);
+			state.notEmpty.wait(lock, [&state] { return state.stopping || !state.connections.empty(); });
+			if (state.connections.empty()) return;
+			fd = state.connections.front();
+			state.connections.pop_front();
+		}
+		state.notFull.notify_one();
+		serveConnection(state, fd, context);
+		close(fd);
+	}
+}
+
+int runServer(const Scene &scene, const std::string &socketPath, unsigned cntWorker, unsigned queueSize)
+{
+	// a client hanging up must not kill the server
+	signal(SIGPIPE, SIG_IGN);
+
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (socketPath.size() >= sizeof(address.sun_path))
+	{
+		std::cerr << "socket path " << socketPath << " is too long" << std::endl;
+		return 1;
+	}
+	strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+
+	ServerState state(scene, std::max(1u, queueSize));
+	state.listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(socketPath.c_str());
+	if (state.listenFd < 0 || bind(state.listenFd, (sockaddr *)&address, sizeof(address)) < 0 || listen(state.listenFd, 64) < 0)
+	{
+		std::cerr << "can't listen on " << socketPath << ": " << strerror(errno) << std::endl;
+		if (state.listenFd >= 0) close(state.listenFd);
+		return 1;
+	}
+	std::cerr << "serving on " << socketPath << " with " << cntWorker << " workers" << std::endl;
+
+	std::vector<std::thread> workers;
+	for (unsigned i = 0; i < std::max(1u, cntWorker); ++i)
+	{
+		workers.push_back(std::thread(serverWorker, std::ref(state)));
+	}
+
+	// accept connections and queue them for the workers, blocking while the queue is full
+	for (;;)
+	{
+		int fd = accept(state.listenFd, nullptr, nullptr);
+		std::unique_lock<std::mutex> lock(state.mutex);
+		if (fd < 0)
+		{
+			if (state.stopping) break;
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			std::cerr << "accept failed: " << strerror(errno) << std::endl;
+			state.stopping = true;
+			break;
+		}
+		state.notFull.wait(lock, [&state] { return state.stopping || state.connections.size() < state.queueSize; });
+		if (state.stopping)
+		{
+			close(fd);
+			break;
+		}
+		state.connections.push_back(fd);
+		state.notEmpty.notify_one();
+	}
+	state.notEmpty.notify_all();
+
+	for (std::thread &worker : workers)
+	{
+		worker.join();
+	}
+	for (int fd : state.connections)
+	{
+		close(fd);
+	}
+	close(state.listenFd);
+	unlink(socketPath.c_str());
+
+	std::cerr << "server stopped, request latency (ms): " << state.latency.summary() << std::endl;
+	return 0;
+}
+
+#endif
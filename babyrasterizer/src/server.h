@@ -0,0 +1,37 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <mutex>
+
+#include "scene.h"
+
+// latencies of the served requests, in milliseconds
+class LatencyStats
+{
+private:
+	std::vector<double> samples_;
+	mutable std::mutex mutex_;
+
+public:
+	void add(double ms);
+	unsigned count() const;
+	double percentile(double p) const;   // nearest-rank percentile, p in [0, 100]
+	std::string summary() const;
+};
+
+// serves render requests for an already loaded scene over a unix domain socket, until a client
+// sends "shutdown"; each worker owns a render context, so up to cntWorker requests run concurrently
+// and up to queueSize accepted connections wait for a free worker
+//
+// one request per line, every request gets exactly one response:
+//   render [eye x y z] [center x y z] [up x y z] [fov degrees] [light x y z]
+//          [resolution w h] [msaa 1|2|4|8|16] [centroid on|off] [depthformat float32|unorm24|half16]
+//          [colorformat float32|half16|rgba8] [output path.tga]
+//     -> "ok <ms>" after the frame is written to path, or without output
+//        "pixels <width> <height> <bytes> <ms>" followed by the raw BGR pixels, bottom row first
+//   stats    -> "stats <count> p50 <ms> p90 <ms> p99 <ms> max <ms>"
+//   quit     -> closes the connection
+//   shutdown -> stops the server once the running requests are done
+// a malformed request gets "error <message>"
+int runServer(const Scene &scene, const std::string &socketPath, unsigned cntWorker, unsigned queueSize);
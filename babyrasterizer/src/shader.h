@@ -0,0 +1,529 @@
+#pragma once
+
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <vector>
+
+#if defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>
+#endif
+
+#include "geometry.h"
+#include "model.h"
+#include "gl.h"
+
+// math functions of the shaders, chosen at compile time by their Math parameter: PreciseMath calls the
+// library functions, FastMath approximates them for previews and for speed over last-bit accuracy
+struct PreciseMath
+{
+	static float rsqrt(float x) { return 1.0f / std::sqrt(x); }
+	static Vec3f normalize(Vec3f v) { return v.normalize(); }
+	template <unsigned N> static float pow(float x) { return powf(x, float(N)); }
+	static float exp(float x) { return expf(x); }
+};
+
+struct FastMath
+{
+	// hardware estimate refined by a Newton step, relative error around 1e-7; without SSE the integer
+	// estimate needs two steps for about 5e-6
+	static float rsqrt(float x)
+	{
+#if defined(__SSE__) || defined(_M_X64)
+		float y = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+		return y * (1.5f - 0.5f * x * y * y);
+#else
+		unsigned i;
+		memcpy(&i, &x, sizeof(i));
+		i = 0x5f375a86u - (i >> 1);
+		float y;
+		memcpy(&y, &i, sizeof(y));
+		y = y * (1.5f - 0.5f * x * y * y);
+		return y * (1.5f - 0.5f * x * y * y);
+#endif
+	}
+
+	static Vec3f normalize(Vec3f v) { return v * rsqrt(v.x * v.x + v.y * v.y + v.z * v.z); }
+
+	// exponentiation by squaring, unrolled by the compiler for the constant exponent
+	template <unsigned N> static float pow(float x)
+	{
+		float ret = 1.0f;
+		for (unsigned n = N; n; n >>= 1)
+		{
+			if (n & 1) ret *= x;
+			x *= x;
+		}
+		return ret;
+	}
+
+	// 2^(x log2(e)): the integer part goes into the exponent bits, the fraction through a degree 5 Taylor
+	// polynomial of 2^f, relative error under 1e-4
+	static float exp(float x)
+	{
+		float t = std::min(126.0f, std::max(-126.0f, x * 1.44269504f));
+		int n = int(t) - (t < 0.0f);
+		float f = t - float(n);
+		float p = 1.0f + f * (0.693147181f + f * (0.240226507f + f * (0.0555041087f + f * (0.00961812911f + f * 0.00133335581f))));
+		unsigned bits = unsigned(n + 127) << 23;
+		float scale;
+		memcpy(&scale, &bits, sizeof(scale));
+		return p * scale;
+	}
+};
+
+const unsigned SPECULAR_POWER = 32;
+
+template <typename Math>
+struct DepthShaderT : public IShader
+{
+	// uniform variables
+	Matrix uVpPV;
+	// varying variables
+	mat<4, 3, float> vScreenCoords;
+
+
+	DepthShaderT() {}
+
+	Vec4f vertex(unsigned nthvert, Vec4f worldCoord, Vec2f /*uv*/, Vec3f /*normal*/, Vec4f /*tangent*/)
+	{
+		Vec4f screenCoord = uVpPV * worldCoord;
+		screenCoord = screenCoord / screenCoord[3];
+		vScreenCoords.set_col(nthvert, screenCoord);
+
+		return screenCoord;
+	}
+
+	bool fragment(Vec3f bar, Vec3f &color)
+	{
+		Vec4f fragPos = vScreenCoords * bar;
+		color = Vec3f(255.0f, 255.0f, 255.0f) * Math::template pow<4>(Math::exp(fragPos[2]-1.0f));
+
+		return true;
+	}
+};
+
+typedef DepthShaderT<PreciseMath> DepthShader;
+typedef DepthShaderT<FastMath> FastDepthShader;
+
+struct LightColor
+{
+	Vec3f ambient, diffuse, specular;
+
+	LightColor(Vec3f ambi = Vec3f(), Vec3f diff = Vec3f(), Vec3f spec = Vec3f())
+	{
+		ambient = ambi;
+		diffuse = diff;
+		specular = spec;
+	}
+};
+
+enum LightType { LIGHT_POINT, LIGHT_SPOT, LIGHT_DIRECTIONAL };
+
+// unshadowed light added to the main light; point and spot lights fade out smoothly up to their range
+struct LightSource
+{
+	LightType type;
+	Vec3f position;                     // point and spot lights
+	Vec3f direction;                    // normalized, towards the light for directional lights, along the cone for spot lights
+	Vec3f color;
+	float range;
+	float cosInner, cosOuter;           // spot cone, full intensity inside the inner cone
+
+	LightSource() : type(LIGHT_POINT), position(), direction(0.0f, 1.0f, 0.0f), color(1.0f, 1.0f, 1.0f), range(1.0f), cosInner(1.0f), cosOuter(1.0f) {}
+};
+
+// lights reaching every screen tile: tile t is lit by the lights indices[offsets[t]] .. indices[offsets[t + 1] - 1]
+struct LightGrid
+{
+	unsigned tileSize, cntTileX, cntTileY;
+	std::vector<unsigned> offsets, indices;
+
+	LightGrid() : tileSize(1), cntTileX(0), cntTileY(0), offsets(), indices() {}
+};
+
+// view-space depth of the visible surfaces, for the depth bounds of the tiles
+struct ViewDepthShader : public IShader
+{
+	// uniform variables
+	Matrix uVpPV, uView;
+	// varying variables
+	mat<4, 3, float> vScreenCoords;
+	Vec3f vDepth;
+
+
+	ViewDepthShader() {}
+
+	Vec4f vertex(unsigned nthvert, Vec4f worldCoord, Vec2f /*uv*/, Vec3f /*normal*/, Vec4f /*tangent*/)
+	{
+		// same screen coordinates as Shader, so the same samples are covered
+		Vec4f screenCoord = uVpPV * worldCoord;
+		float w = screenCoord[3];
+		screenCoord = screenCoord / w;
+		screenCoord[2] = screenCoord[2] / w;
+		screenCoord[3] = 1.0f / w;
+		vScreenCoords.set_col(nthvert, screenCoord);
+		vDepth[nthvert] = -(uView * worldCoord)[2] / w;
+
+		return screenCoord;
+	}
+
+	bool fragment(Vec3f bar, Vec3f &color)
+	{
+		float w = (vScreenCoords * bar)[3];
+		if (fabs(w) < 1e-7) return false;
+		color = Vec3f(dot(vDepth, bar) / w, 0.0f, 0.0f);
+		return true;
+	}
+};
+
+// screen-space motion of the visible surfaces since the previous frame, in pixels, for the reprojection of
+// temporal anti-aliasing; covers the same samples as Shader with the same uVpPV
+struct MotionShader : public IShader
+{
+	// uniform variables
+	Matrix uVpPV;                       // of the current frame, with its jitter
+	Matrix uCurrentVpPV, uPreviousVpPV; // without jitter
+	// varying variables
+	mat<4, 3, float> vScreenCoords;
+	mat<3, 3, float> vWorldCoords;
+
+
+	MotionShader() {}
+
+	Vec4f vertex(unsigned nthvert, Vec4f worldCoord, Vec2f /*uv*/, Vec3f /*normal*/, Vec4f /*tangent*/)
+	{
+		Vec4f screenCoord = uVpPV * worldCoord;
+		float w = screenCoord[3];
+		vWorldCoords.set_col(nthvert, proj<3>(worldCoord) / w);
+		screenCoord = screenCoord / w;
+		screenCoord[2] = screenCoord[2] / w;
+		screenCoord[3] = 1.0f / w;
+		vScreenCoords.set_col(nthvert, screenCoord);
+
+		return screenCoord;
+	}
+
+	bool fragment(Vec3f bar, Vec3f &color)
+	{
+		float w = (vScreenCoords * bar)[3];
+		if (fabs(w) < 1e-7) return false;
+		Vec4f worldCoord = embed<4>(vWorldCoords * bar / w);
+		Vec4f current = uCurrentVpPV * worldCoord, previous = uPreviousVpPV * worldCoord;
+		color = Vec3f(current[0] / current[3] - previous[0] / previous[3], current[1] / current[3] - previous[1] / previous[3], 0.0f);
+		return true;
+	}
+};
+
+template <typename Math>
+struct ShaderT : public IQuadShader
+{
+	// uniform variables
+	const Model *uTexture;
+	Matrix uModel, uVpPV, uLightVpPV;
+	Vec3f uEyePos, uLightPos;
+	LightColor uLightColor;
+	const float *uShadowBuffer;         // null: no shadows
+	unsigned uShadowBufferWidth, uShadowBufferHeight;
+	const LightSource *uLights;         // lights of the scene besides the main one, culled per tile by uLightGrid
+	const LightGrid *uLightGrid;        // null: no other lights
+	// varying variables
+	mat<4, 3, float> vScreenCoords;
+	mat<2, 3, float> vUv;
+	mat<3, 3, float> vN;
+	mat<3, 3, float> vTangent;
+	float vHandedness;
+	mat<3, 3, float> vLightSpacePos;
+	mat<3, 3, float> vWorldCoords;
+
+
+	ShaderT() : uShadowBuffer(nullptr), uLights(nullptr), uLightGrid(nullptr) {}
+
+	// percentage-closer filtering over 4x4 texels of the shadow map
+	float shadowFactor(Vec3f lightSpacePos) const
+	{
+		if (!uShadowBuffer) return 0.0f;
+		float shadow = 0.0f;
+		int cntSample = 0;
+		for (int dx = -2; dx < 2; dx++)
+		{
+			int sampleX = lightSpacePos.x + dx;
+			if (sampleX < 0 || sampleX >= uShadowBufferWidth) continue;
+			for (int dy = -2; dy < 2; dy++)
+			{
+				int sampleY = lightSpacePos.y + dy;
+				if (sampleY < 0 || sampleY >= uShadowBufferHeight) continue;
+				cntSample++;
+				if (lightSpacePos.z + 0.005f < uShadowBuffer[sampleY * uShadowBufferWidth + sampleX])
+					shadow += 1.0f;
+			}
+		}
+		return shadow / cntSample;
+	}
+
+	// sum of the unshadowed lights of the tile of a screen position
+	Vec3f localLighting(float screenX, float screenY, Vec3f n, Vec3f worldCoord, Vec3f eyeDir, Vec3f materialDiffuse, float materialSpecular) const
+	{
+		Vec3f sum(0.0f, 0.0f, 0.0f);
+		if (!uLightGrid) return sum;
+		int tx = std::min(int(uLightGrid->cntTileX) - 1, std::max(0, int(screenX) / int(uLightGrid->tileSize)));
+		int ty = std::min(int(uLightGrid->cntTileY) - 1, std::max(0, int(screenY) / int(uLightGrid->tileSize)));
+		unsigned tile = ty * uLightGrid->cntTileX + tx;
+		for (unsigned k = uLightGrid->offsets[tile]; k < uLightGrid->offsets[tile + 1]; ++k)
+		{
+			const LightSource &light = uLights[uLightGrid->indices[k]];
+			Vec3f lightDir = light.direction;
+			float attenuation = 1.0f;
+			if (light.type != LIGHT_DIRECTIONAL)
+			{
+				Vec3f toLight = light.position - worldCoord;
+				float distance = toLight.norm();
+				if (distance >= light.range || distance < 1e-6f) continue;
+				lightDir = toLight / distance;
+				float x = distance / light.range;
+				attenuation = (1.0f - x * x) * (1.0f - x * x);
+				if (light.type == LIGHT_SPOT)
+				{
+					float cosAngle = -dot(lightDir, light.direction);
+					if (cosAngle <= light.cosOuter) continue;
+					float t = std::min(1.0f, (cosAngle - light.cosOuter) / std::max(1e-6f, light.cosInner - light.cosOuter));
+					attenuation *= t * t * (3.0f - 2.0f * t);
+				}
+			}
+			Vec3f half = (lightDir + eyeDir) / 2.0f;
+			float kd = std::max(0.0f, dot(n, lightDir));
+			float ks = materialSpecular * Math::template pow<SPECULAR_POWER>(std::max(0.0f, dot(n, half)));
+			sum = sum + light.color * (materialDiffuse * kd + Vec3f(ks, ks, ks)) * attenuation;
+		}
+		return sum;
+	}
+
+	Vec4f vertex(unsigned nthvert, Vec4f worldCoord, Vec2f uv, Vec3f normal, Vec4f tangent)
+	{
+		Vec4f screenCoord = uVpPV * worldCoord;
+		float w = screenCoord[3];
+
+		vWorldCoords.set_col(nthvert, proj<3>(worldCoord) / w);
+
+		screenCoord = screenCoord / w;
+		screenCoord[2] = screenCoord[2] / w;
+		screenCoord[3] = 1.0f / w;
+		vScreenCoords.set_col(nthvert, screenCoord);
+
+		Vec2f vertUv = uv / w;
+		vUv.set_col(nthvert, vertUv);
+
+		Vec3f vertN = normal / w;
+		vN.set_col(nthvert, vertN);
+
+		Vec3f vertTangent = proj<3>(tangent) / w;
+		vTangent.set_col(nthvert, vertTangent);
+		vHandedness = tangent.w;
+
+		Vec4f temp = uLightVpPV * worldCoord;
+		temp = temp / temp.w;
+		Vec3f vertLightSpacePos = proj<3>(temp) / w;
+		vLightSpacePos.set_col(nthvert, vertLightSpacePos);
+
+		return screenCoord;
+	}
+
+	bool fragment(Vec3f bar, Vec3f &color)
+	{
+		// calculate w for perspective-correct interpolation
+		float w = (vScreenCoords * bar)[3];
+		if (fabs(w) < 1e-7) return false;
+		w = 1.0f / w;
+
+		// calculate uv for texture indexing
+		Vec2f uv = vUv * bar * w;
+
+		// calculate normal vector from tangent space, the interpolated tangent is made orthogonal to the normal again
+		Vec3f normal = Math::normalize(vN * bar * w);
+		Vec3f tangent = vTangent * bar * w;
+		tangent = Math::normalize(tangent - normal * dot(normal, tangent));
+		mat<3, 3, float> TBN;
+		TBN.set_col(0, tangent);
+		TBN.set_col(1, cross(normal, tangent) * (vHandedness < 0.0f ? -1.0f : 1.0f));
+		TBN.set_col(2, normal);
+		Vec3f n = Math::normalize(TBN * uTexture->normal(uv));
+		
+		// calculate direction vectors for lattter use
+		Vec3f worldCoord = vWorldCoords * bar * w;
+		Vec3f lightDir = Math::normalize(uLightPos);
+		Vec3f eyeDir = Math::normalize(uEyePos - worldCoord);
+		Vec3f half = (lightDir + eyeDir) / 2.0f;
+
+		// ambient reflection
+		Vec3f materialAmbient = uTexture->diffuse(uv).rgb();
+		Vec3f ambient = uLightColor.ambient * materialAmbient;
+		
+		// diffuse reflection
+		Vec3f materialDiffuse = uTexture->diffuse(uv).rgb();
+		Vec3f diffuse = uLightColor.diffuse * (materialDiffuse * std::max(0.0f, dot(n, lightDir)));
+
+		// specular reflection
+		float materialSpecular = uTexture->specular(uv);
+		Vec3f specular = uLightColor.specular * (materialSpecular * Math::template pow<SPECULAR_POWER>(std::max(0.0f, dot(n, half))));
+
+		// calculate shadow
+		float shadow = shadowFactor(vLightSpacePos * bar * w);
+
+		// Blinn-Phong lighting model
+		color = ambient + (diffuse + specular) * (1.0f - shadow);
+		if (uLightGrid)
+		{
+			Vec4f screenCoord = vScreenCoords * bar;
+			color = color + localLighting(screenCoord[0], screenCoord[1], n, worldCoord, eyeDir, materialDiffuse, materialSpecular);
+		}
+
+		return true;
+	}
+
+	// same computation as fragment() for the 4 lanes of a quad, with every attribute stored as one array
+	// per component so the arithmetic of the lanes runs in lockstep and can be vectorized; only the texture
+	// and shadow map fetches are done lane by lane, and only for the lanes in mask
+	unsigned fragmentQuad(const Vec3f bar[4], unsigned mask, Vec3f color[4])
+	{
+		float b[3][4];
+		for (int l = 0; l < 4; ++l)
+		{
+			b[0][l] = bar[l].x; b[1][l] = bar[l].y; b[2][l] = bar[l].z;
+		}
+
+		// calculate w for perspective-correct interpolation
+		float w[4];
+		unsigned valid = 0;
+		for (int l = 0; l < 4; ++l)
+		{
+			w[l] = vScreenCoords[3][2] * b[2][l] + vScreenCoords[3][1] * b[1][l] + vScreenCoords[3][0] * b[0][l];
+			if (!(fabs(w[l]) < 1e-7)) valid |= 1u << l;
+			w[l] = 1.0f / w[l];
+		}
+		mask &= valid;
+		if (!mask) return 0;
+
+		// interpolate the varying variables
+		float u[4], v[4], nx[4], ny[4], nz[4], tx[4], ty[4], tz[4], px[4], py[4], pz[4], lx[4], ly[4], lz[4];
+		interpolateQuad(vUv[0], b, w, u);
+		interpolateQuad(vUv[1], b, w, v);
+		interpolateQuad(vN[0], b, w, nx);
+		interpolateQuad(vN[1], b, w, ny);
+		interpolateQuad(vN[2], b, w, nz);
+		interpolateQuad(vTangent[0], b, w, tx);
+		interpolateQuad(vTangent[1], b, w, ty);
+		interpolateQuad(vTangent[2], b, w, tz);
+		interpolateQuad(vWorldCoords[0], b, w, px);
+		interpolateQuad(vWorldCoords[1], b, w, py);
+		interpolateQuad(vWorldCoords[2], b, w, pz);
+		interpolateQuad(vLightSpacePos[0], b, w, lx);
+		interpolateQuad(vLightSpacePos[1], b, w, ly);
+		interpolateQuad(vLightSpacePos[2], b, w, lz);
+
+		// tangent frame, the interpolated tangent is made orthogonal to the normal again
+		float bx[4], by[4], bz[4];
+		float handedness = vHandedness < 0.0f ? -1.0f : 1.0f;
+		normalizeQuad(nx, ny, nz);
+		for (int l = 0; l < 4; ++l)
+		{
+			float d = nz[l] * tz[l] + ny[l] * ty[l] + nx[l] * tx[l];
+			tx[l] = tx[l] - nx[l] * d;
+			ty[l] = ty[l] - ny[l] * d;
+			tz[l] = tz[l] - nz[l] * d;
+		}
+		normalizeQuad(tx, ty, tz);
+		for (int l = 0; l < 4; ++l)
+		{
+			bx[l] = (ny[l] * tz[l] - nz[l] * ty[l]) * handedness;
+			by[l] = (nz[l] * tx[l] - nx[l] * tz[l]) * handedness;
+			bz[l] = (nx[l] * ty[l] - ny[l] * tx[l]) * handedness;
+		}
+
+		// texture fetches
+		float mx[4], my[4], mz[4], dr[4], dg[4], db[4], ms[4], shadow[4];
+		for (int l = 0; l < 4; ++l)
+		{
+			if (!(mask >> l & 1))
+			{
+				mx[l] = my[l] = mz[l] = dr[l] = dg[l] = db[l] = ms[l] = shadow[l] = 0.0f;
+				continue;
+			}
+			Vec2f uv(u[l], v[l]);
+			Vec3f m = uTexture->normal(uv), diffuse = uTexture->diffuse(uv).rgb();
+			mx[l] = m.x; my[l] = m.y; mz[l] = m.z;
+			dr[l] = diffuse.x; dg[l] = diffuse.y; db[l] = diffuse.z;
+			ms[l] = uTexture->specular(uv);
+			shadow[l] = shadowFactor(Vec3f(lx[l], ly[l], lz[l]));
+		}
+
+		// normal from the normal map
+		for (int l = 0; l < 4; ++l)
+		{
+			float x = nx[l] * mz[l] + bx[l] * my[l] + tx[l] * mx[l];
+			float y = ny[l] * mz[l] + by[l] * my[l] + ty[l] * mx[l];
+			float z = nz[l] * mz[l] + bz[l] * my[l] + tz[l] * mx[l];
+			nx[l] = x; ny[l] = y; nz[l] = z;
+		}
+		normalizeQuad(nx, ny, nz);
+
+		// direction vectors
+		Vec3f lightDir = Math::normalize(uLightPos);
+		float ex[4], ey[4], ez[4];
+		for (int l = 0; l < 4; ++l)
+		{
+			ex[l] = uEyePos.x - px[l];
+			ey[l] = uEyePos.y - py[l];
+			ez[l] = uEyePos.z - pz[l];
+		}
+		normalizeQuad(ex, ey, ez);
+
+		// Blinn-Phong lighting model
+		float r[4], g[4], bl[4];
+		for (int l = 0; l < 4; ++l)
+		{
+			float hx = (lightDir.x + ex[l]) / 2.0f, hy = (lightDir.y + ey[l]) / 2.0f, hz = (lightDir.z + ez[l]) / 2.0f;
+			float kd = std::max(0.0f, nz[l] * lightDir.z + ny[l] * lightDir.y + nx[l] * lightDir.x);
+			float ks = ms[l] * Math::template pow<SPECULAR_POWER>(std::max(0.0f, nz[l] * hz + ny[l] * hy + nx[l] * hx));
+			float lit = 1.0f - shadow[l];
+			r[l] = uLightColor.ambient.x * dr[l] + (uLightColor.diffuse.x * (dr[l] * kd) + uLightColor.specular.x * ks) * lit;
+			g[l] = uLightColor.ambient.y * dg[l] + (uLightColor.diffuse.y * (dg[l] * kd) + uLightColor.specular.y * ks) * lit;
+			bl[l] = uLightColor.ambient.z * db[l] + (uLightColor.diffuse.z * (db[l] * kd) + uLightColor.specular.z * ks) * lit;
+		}
+		for (int l = 0; l < 4; ++l)
+		{
+			color[l] = Vec3f(r[l], g[l], bl[l]);
+		}
+
+		// the other lights of the tile, lane by lane
+		for (int l = 0; uLightGrid && l < 4; ++l)
+		{
+			if (!(mask >> l & 1)) continue;
+			float screenX = vScreenCoords[0][2] * b[2][l] + vScreenCoords[0][1] * b[1][l] + vScreenCoords[0][0] * b[0][l];
+			float screenY = vScreenCoords[1][2] * b[2][l] + vScreenCoords[1][1] * b[1][l] + vScreenCoords[1][0] * b[0][l];
+			color[l] = color[l] + localLighting(screenX, screenY, Vec3f(nx[l], ny[l], nz[l]), Vec3f(px[l], py[l], pz[l]),
+				Vec3f(ex[l], ey[l], ez[l]), Vec3f(dr[l], dg[l], db[l]), ms[l]);
+		}
+		return mask;
+	}
+
+private:
+	static void interpolateQuad(const Vec3f &row, const float b[3][4], const float w[4], float out[4])
+	{
+		for (int l = 0; l < 4; ++l)
+		{
+			out[l] = (row[2] * b[2][l] + row[1] * b[1][l] + row[0] * b[0][l]) * w[l];
+		}
+	}
+
+	static void normalizeQuad(float x[4], float y[4], float z[4])
+	{
+		for (int l = 0; l < 4; ++l)
+		{
+			float scale = Math::rsqrt(x[l] * x[l] + y[l] * y[l] + z[l] * z[l]);
+			x[l] *= scale; y[l] *= scale; z[l] *= scale;
+		}
+	}
+};
+
+typedef ShaderT<PreciseMath> Shader;
+typedef ShaderT<FastMath> FastShader;
@@ -0,0 +1,154 @@
+#include <algorithm>
+
+#include "taskgraph.h"
+
+static bool intersect(const std::vector<std::string> &a, const std::vector<std::string> &b)
+{
+	for (const std::string &name : a)
+	{
+		if (std::find(b.begin(), b.end(), name) != b.end()) return true;
+	}
+	return false;
+}
+
+bool TaskGraph::dependsOn(const Pass &pass, const Pass &earlier)
+{
+	// read after write, write after write and write after read
+	return intersect(pass.reads, earlier.writes) || intersect(pass.writes, earlier.writes) || intersect(pass.writes, earlier.reads);
+}
+
+unsigned TaskGraph::addPass(const std::string &name, const std::vector<std::string> &reads, const std::vector<std::string> &writes,
+	std::function<void()> run)
+{
+	Pass pass;
+	pass.name = name;
+	pass.reads = reads;
+	pass.writes = writes;
+	pass.run = run;
+	pass.remaining = 0;
+	pass.ms = 0.0;
+	unsigned index = unsigned(passes_.size());
+	for (unsigned i = 0; i < index; ++i)
+	{
+		if (!dependsOn(pass, passes_[i])) continue;
+		pass.dependencies.push_back(i);
+		passes_[i].successors.push_back(index);
+	}
+	passes_.push_back(pass);
+	return index;
+}
+
+void TaskGraph::runPass(ThreadPool &pool, unsigned index)
+{
+	Pass &pass = passes_[index];
+	Clock::time_point start = Clock::now();
+	pass.run();
+	pass.ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+	// queue the successors this pass was the last dependency of
+	std::vector<unsigned> ready;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		for (unsigned successor : pass.successors)
+		{
+			if (--passes_[successor].remaining == 0) ready.push_back(successor);
+		}
+		if (++cntDone_ == passes_.size()) done_.notify_all();
+	}
+	for (unsigned successor : ready)
+	{
+		pool.submit([this, &pool, successor]() { runPass(pool, successor); });
+	}
+}
+
+void TaskGraph::run(ThreadPool &pool)
+{
+	start_ = Clock::now();
+	std::vector<unsigned> ready;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		cntDone_ = 0;
+		for (unsigned i = 0; i < passes_.size(); ++i)
+		{
+			passes_[i].remaining = unsigned(passes_[i].dependencies.size());
+			if (passes_[i].remaining == 0) ready.push_back(i);
+		}
+	}
+	for (unsigned index : ready)
+	{
+		pool.submit([this, &pool, index]() { runPass(pool, index); });
+	}
+
+	// help the pool until the last pass is done; the calling thread is outside of any pass, so whatever it
+	// picks up is a pass of the graph or a chunk of one
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			if (cntDone_ == passes_.size()) break;
+		}
+		if (pool.runOne()) continue;
+		std::unique_lock<std::mutex> lock(mutex_);
+		done_.wait_for(lock, std::chrono::milliseconds(1), [this]() { return cntDone_ == passes_.size(); });
+	}
+	end_ = Clock::now();
+}
+
+double TaskGraph::totalWork() const
+{
+	double ms = 0.0;
+	for (const Pass &pass : passes_)
+	{
+		ms += pass.ms;
+	}
+	return ms;
+}
+
+double TaskGraph::criticalPath(std::vector<unsigned> *path) const
+{
+	// the dependencies of a pass are declared before it, the declaration order is a topological order
+	std::vector<double> finish(passes_.size(), 0.0);
+	std::vector<int> previous(passes_.size(), -1);
+	int last = -1;
+	for (unsigned i = 0; i < passes_.size(); ++i)
+	{
+		double start = 0.0;
+		for (unsigned dependency : passes_[i].dependencies)
+		{
+			if (finish[dependency] <= start) continue;
+			start = finish[dependency];
+			previous[i] = int(dependency);
+		}
+		finish[i] = start + passes_[i].ms;
+		if (last < 0 || finish[i] > finish[last]) last = int(i);
+	}
+	if (path)
+	{
+		path->clear();
+		for (int i = last; i >= 0; i = previous[i])
+		{
+			path->insert(path->begin(), unsigned(i));
+		}
+	}
+	return last < 0 ? 0.0 : finish[last];
+}
+
+double TaskGraph::wallTime() const
+{
+	return std::chrono::duration<double, std::milli>(end_ - start_).count();
+}
+
+void TaskGraph::report(std::ostream &out) const
+{
+	std::vector<unsigned> path;
+	double critical = criticalPath(&path), work = totalWork();
+	out << "task graph: " << passes_.size() << " passes, " << work << " ms of work, critical path " << critical << " ms, "
+		<< wallTime() << " ms wall time";
+	if (critical > 0.0) out << ", parallelism " << work / critical;
+	out << std::endl << "critical path:";
+	for (unsigned i = 0; i < path.size(); ++i)
+	{
+		out << (i ? " -> " : " ") << passes_[path[i]].name << " (" << passes_[path[i]].ms << " ms)";
+	}
+	out << std::endl;
+}
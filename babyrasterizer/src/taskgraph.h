@@ -0,0 +1,53 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "threadpool.h"
+
+// passes of a render and the buffers they read and write, named by strings; a pass waits for the passes
+// declared before it that write a buffer it reads or writes, and for the ones that read a buffer it writes,
+// so the passes run on a thread pool as soon as their inputs are ready and give the results of running them
+// one after another in declaration order
+class TaskGraph
+{
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	TaskGraph() : passes_(), start_(), end_(), mutex_(), done_(), cntDone_(0) {}
+	// returns the index of the pass
+	unsigned addPass(const std::string &name, const std::vector<std::string> &reads, const std::vector<std::string> &writes,
+		std::function<void()> run);
+	// runs every pass once, returns when all are done
+	void run(ThreadPool &pool);
+	// time of the passes of the last run: the sum of their times, and the longest chain of dependent passes,
+	// the shortest the graph can take with any number of threads
+	double totalWork() const;
+	double criticalPath(std::vector<unsigned> *path = nullptr) const;
+	double wallTime() const;
+	void report(std::ostream &out) const;
+
+private:
+	struct Pass
+	{
+		std::string name;
+		std::vector<std::string> reads, writes;
+		std::function<void()> run;
+		std::vector<unsigned> dependencies, successors;
+		unsigned remaining;             // dependencies not done yet in the current run
+		double ms;
+	};
+	std::vector<Pass> passes_;
+	Clock::time_point start_, end_;
+	std::mutex mutex_;
+	std::condition_variable done_;
+	unsigned cntDone_;
+
+	static bool dependsOn(const Pass &pass, const Pass &earlier);
+	void runPass(ThreadPool &pool, unsigned index);
+};
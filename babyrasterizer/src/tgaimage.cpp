@@ -4,6 +4,7 @@
 #include <string>
 
 #include "tgaimage.h"
+#include "profiler.h"
 
 TGAImage::TGAImage() : data(), width(0), height(0), bytespp(0) {}
 TGAImage::TGAImage(const int w, const int h, const int bpp) : data(w*h*bpp, 0), width(w), height(h), bytespp(bpp) {}
@@ -113,6 +114,7 @@ bool TGAImage::load_rle_data(std::ifstream &in) {
 }
 
 bool TGAImage::write_tga_file(const std::string filename, const bool vflip, const bool rle) const {
+	PROFILE_SCOPE(TIMER_TGA_WRITE);
 	std::uint8_t developer_area_ref[4] = { 0, 0, 0, 0 };
 	std::uint8_t extension_area_ref[4] = { 0, 0, 0, 0 };
 	std::uint8_t footer[18] = { 'T','R','U','E','V','I','S','I','O','N','-','X','F','I','L','E','.','\0' };
@@ -223,7 +225,7 @@ void TGAImage::set(int x, int y, const TGAColor &c) {
 	memcpy(data.data() + (x + y * width)*bytespp, c.bgra, bytespp);
 }
 
-int TGAImage::get_bytespp() {
+int TGAImage::get_bytespp() const {
 	return bytespp;
 }
 
@@ -75,7 +75,7 @@ public:
 	void set(const int x, const int y, const TGAColor &c);
 	int get_width() const;
 	int get_height() const;
-	int get_bytespp();
+	int get_bytespp() const;
 	std::uint8_t *buffer();
 	void clear();
 };
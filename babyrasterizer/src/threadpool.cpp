@@ -0,0 +1,157 @@
+#include <algorithm>
+#include <chrono>
+
+#include "threadpool.h"
+
+// pool and queue of the worker running on the current thread, if any
+static thread_local const ThreadPool *currentPool = nullptr;
+static thread_local unsigned currentQueue = 0;
+
+ThreadPool::ThreadPool(unsigned cntThread) : queues_(), workers_(), sleepMutex_(), wake_(), cntQueued_(0), next_(0), stop_(false)
+{
+	if (cntThread == 0) cntThread = std::max(1u, std::thread::hardware_concurrency());
+	for (unsigned i = 0; i + 1 < cntThread; ++i)
+	{
+		queues_.push_back(std::unique_ptr<WorkQueue>(new WorkQueue()));
+	}
+	for (unsigned i = 0; i + 1 < cntThread; ++i)
+	{
+		workers_.push_back(std::thread(&ThreadPool::work, this, i));
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex_);
+		stop_ = true;
+	}
+	wake_.notify_all();
+	for (std::thread &worker : workers_)
+	{
+		worker.join();
+	}
+}
+
+void ThreadPool::submit(Task task)
+{
+	if (queues_.empty())
+	{
+		task();
+		return;
+	}
+	unsigned index = currentPool == this ? currentQueue : next_.fetch_add(1) % queues_.size();
+	{
+		std::lock_guard<std::mutex> lock(queues_[index]->mutex);
+		queues_[index]->tasks.push_back(std::move(task));
+	}
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex_);
+		cntQueued_++;
+	}
+	wake_.notify_one();
+}
+
+bool ThreadPool::pop(unsigned index, Task &task)
+{
+	// the newest task of the own queue, it is the most likely to find its data in the cache
+	{
+		std::lock_guard<std::mutex> lock(queues_[index]->mutex);
+		if (!queues_[index]->tasks.empty())
+		{
+			task = std::move(queues_[index]->tasks.back());
+			queues_[index]->tasks.pop_back();
+			cntQueued_--;
+			return true;
+		}
+	}
+
+	// or the oldest task of another queue
+	for (unsigned i = 1; i < queues_.size(); ++i)
+	{
+		WorkQueue &victim = *queues_[(index + i) % queues_.size()];
+		std::lock_guard<std::mutex> lock(victim.mutex);
+		if (!victim.tasks.empty())
+		{
+			task = std::move(victim.tasks.front());
+			victim.tasks.pop_front();
+			cntQueued_--;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool ThreadPool::runOne()
+{
+	if (queues_.empty()) return false;
+	Task task;
+	if (!pop(currentPool == this ? currentQueue : next_.load() % queues_.size(), task)) return false;
+	task();
+	return true;
+}
+
+void ThreadPool::work(unsigned index)
+{
+	currentPool = this;
+	currentQueue = index;
+	for (;;)
+	{
+		Task task;
+		if (pop(index, task))
+		{
+			task();
+			continue;
+		}
+		std::unique_lock<std::mutex> lock(sleepMutex_);
+		wake_.wait(lock, [this]() { return stop_ || cntQueued_ > 0; });
+		if (stop_ && cntQueued_ == 0) return;
+	}
+}
+
+void ThreadPool::parallelFor(unsigned cnt, unsigned grain, const std::function<void(unsigned, unsigned, unsigned)> &body)
+{
+	grain = std::max(1u, grain);
+	unsigned cntChunk = (cnt + grain - 1) / grain;
+	if (queues_.empty() || cntChunk <= 1)
+	{
+		for (unsigned chunk = 0; chunk < cntChunk; ++chunk)
+		{
+			body(chunk * grain, std::min(cnt, (chunk + 1) * grain), chunk);
+		}
+		return;
+	}
+
+	// the chunks are claimed from a counter by the calling thread and by helper tasks of the pool, so the
+	// calling thread only ever runs chunks of its own loop; a helper that starts after the loop is done
+	// claims nothing, the state it shares with the loop outlives the call
+	struct Loop
+	{
+		std::atomic<unsigned> next;
+		unsigned remaining;             // chunks not done yet, under mutex
+		std::mutex mutex;
+		std::condition_variable done;
+	};
+	std::shared_ptr<Loop> loop = std::make_shared<Loop>();
+	loop->next = 0;
+	loop->remaining = cntChunk;
+	const std::function<void(unsigned, unsigned, unsigned)> *loopBody = &body;
+	auto runChunks = [loop, loopBody, cnt, grain, cntChunk]()
+	{
+		for (unsigned chunk = loop->next++; chunk < cntChunk; chunk = loop->next++)
+		{
+			(*loopBody)(chunk * grain, std::min(cnt, (chunk + 1) * grain), chunk);
+			std::lock_guard<std::mutex> lock(loop->mutex);
+			if (--loop->remaining == 0) loop->done.notify_all();
+		}
+	};
+	for (unsigned i = 1; i < std::min(cntChunk, cntThread()); ++i)
+	{
+		submit(runChunks);
+	}
+	runChunks();
+
+	// every chunk is claimed, the ones still running are in the hands of helpers running them
+	std::unique_lock<std::mutex> lock(loop->mutex);
+	loop->done.wait(lock, [&loop]() { return loop->remaining == 0; });
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// work-stealing thread pool: every worker pops the newest task of its own queue and, when it runs dry,
+// steals the oldest task of another queue; parallelFor may be called from a task, its calling thread works
+// through the chunks itself and never picks up an unrelated task while it waits
+class ThreadPool
+{
+public:
+	typedef std::function<void()> Task;
+
+	// cntThread counts the calling thread, which works while it waits; 0: one thread per core
+	explicit ThreadPool(unsigned cntThread = 0);
+	~ThreadPool();
+	unsigned cntThread() const { return unsigned(workers_.size()) + 1; }
+
+	// queues a task, on the queue of the calling worker or else round robin
+	void submit(Task task);
+	// runs a queued task on the calling thread, false when there is none
+	bool runOne();
+	// splits [0, cnt) into chunks of grain indices and calls body(begin, end, chunk) for every chunk, chunk
+	// being its index in order; the calling thread and up to cntThread() - 1 workers take the chunks in turn,
+	// returns when all of them are done
+	void parallelFor(unsigned cnt, unsigned grain, const std::function<void(unsigned, unsigned, unsigned)> &body);
+
+private:
+	struct WorkQueue
+	{
+		std::mutex mutex;
+		std::deque<Task> tasks;
+	};
+	std::vector<std::unique_ptr<WorkQueue>> queues_;    // one per worker
+	std::vector<std::thread> workers_;
+	std::mutex sleepMutex_;
+	std::condition_variable wake_;
+	std::atomic<unsigned> cntQueued_;
+	std::atomic<unsigned> next_;        // queue of the next task submitted from outside of the pool
+	bool stop_;
+
+	ThreadPool(const ThreadPool &);
+	ThreadPool &operator=(const ThreadPool &);
+	bool pop(unsigned index, Task &task);
+	void work(unsigned index);
+};
@@ -0,0 +1,13 @@
+#!/bin/sh
+# the checks a change has to pass, run from the top of the repository: the release build and the golden
+# images of raster_regress (the render times depend on the machine, see --update-timing), then a Debug
+# build with the profiler, which has to compile and link without warnings; builds go to build-gate/ or $1
+set -e
+dir=${1:-build-gate}
+
+cmake -S . -B "$dir/release" -DCMAKE_BUILD_TYPE=Release
+cmake --build "$dir/release"
+"$dir/release/raster_regress" --no-timing
+
+cmake -S . -B "$dir/profile" -DCMAKE_BUILD_TYPE=Debug -DBABYRASTERIZER_PROFILE=ON -DCMAKE_CXX_FLAGS=-Werror
+cmake --build "$dir/profile"